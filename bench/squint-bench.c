@@ -0,0 +1,523 @@
+//
+// squint-bench: measure the throughput of squint in a headless X server
+//
+// usage: squint-bench [-d SECONDS] [-a SQUINT_ARG]... SQUINT XVFB XRANDR SCENARIO
+//
+// The benchmark starts a Xvfb server with two side-by-side monitors (declared
+// with RandR 1.5 'xrandr --setmonitor'), runs squint (which duplicates the
+// right monitor into the left one) and generates synthetic damage on the
+// source monitor according to SCENARIO:
+//
+//	caret	a blinking text cursor (2 Hz)
+//	scroll	a document scrolling at 60 lines per second
+//	video	a fullscreen video (30 fps)
+//	cursor	a fast mouse motion (1000 Hz)
+//
+// The frame statistics reported by squint (--stats-fd) are aggregated and
+// printed at the end of the run.
+//
+// Extra arguments can be given to squint with -a (eg: '-a --shm' to
+// benchmark the MIT-SHM capture path).
+//
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <math.h>
+#include <sys/wait.h>
+
+#include <X11/Xlib.h>
+#include <X11/Xutil.h>
+#ifdef HAVE_XTST
+#include <X11/extensions/XTest.h>
+#endif
+
+#define MONITOR_WIDTH	1920
+#define MONITOR_HEIGHT	1080
+
+// duration of the warm up period (statistics are ignored)
+#define WARMUP_MS	2000
+
+#define STATS_FD	3
+
+#define MAX_SQUINT_ARGS	16
+
+// must match the histogram reported by squint
+static const int latency_bounds[] = { 1, 2, 4, 8, 16, 32, 64, 128, 256, 512 };
+#define LATENCY_BUCKETS (sizeof(latency_bounds)/sizeof(*latency_bounds) + 1)
+
+static struct {
+	double   elapsed;
+	uint64_t frames;
+	uint64_t coalesced;
+	uint64_t missed;
+	uint64_t bytes;
+	uint64_t cursor_updates;
+	uint64_t wakeups;
+	uint64_t requests;
+	double   cpu_ms;
+	int      latency_max;
+	uint64_t latency[LATENCY_BUCKETS];
+} total;
+
+static pid_t xvfb_pid = 0;
+static pid_t squint_pid = 0;
+
+static Display* display;
+static Window   window;
+static GC       gc;
+static XImage*  image;
+
+static void
+die(const char* msg)
+{
+	fprintf(stderr, "squint-bench: %s\n", msg);
+	if (squint_pid) {
+		kill(squint_pid, SIGTERM);
+	}
+	if (xvfb_pid) {
+		kill(xvfb_pid, SIGTERM);
+	}
+	exit(1);
+}
+
+static int64_t
+now_ms()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// run a command and wait for its termination
+static void
+run(char* const argv[])
+{
+	int status;
+	pid_t pid = fork();
+	if (pid < 0) {
+		die("fork() failed");
+	}
+	if (pid == 0) {
+		execvp(argv[0], argv);
+		_exit(127);
+	}
+	if ((waitpid(pid, &status, 0) < 0) || !WIFEXITED(status) || WEXITSTATUS(status)) {
+		fprintf(stderr, "squint-bench: %s failed\n", argv[0]);
+		die("cannot configure the X server");
+	}
+}
+
+// start Xvfb and set $DISPLAY
+static void
+start_xvfb(const char* xvfb, const char* xrandr)
+{
+	int fds[2];
+	char fd_str[16], geometry[32], buff[32];
+
+	if (pipe(fds)) {
+		die("pipe() failed");
+	}
+	snprintf(fd_str, sizeof(fd_str), "%d", fds[1]);
+	snprintf(geometry, sizeof(geometry), "%dx%dx24", 2*MONITOR_WIDTH, MONITOR_HEIGHT);
+
+	xvfb_pid = fork();
+	if (xvfb_pid < 0) {
+		die("fork() failed");
+	}
+	if (xvfb_pid == 0) {
+		close(fds[0]);
+		execlp(xvfb, xvfb, "-displayfd", fd_str, "-screen", "0", geometry,
+				"-nolisten", "tcp", "+extension", "RANDR", NULL);
+		_exit(127);
+	}
+	close(fds[1]);
+
+	// Xvfb writes the display number when it is ready
+	ssize_t len = read(fds[0], buff, sizeof(buff)-1);
+	close(fds[0]);
+	if (len <= 0) {
+		die("cannot start Xvfb");
+	}
+	buff[len] = 0;
+	buff[strcspn(buff, "\n")] = 0;
+
+	char display_name[40];
+	snprintf(display_name, sizeof(display_name), ":%s", buff);
+	setenv("DISPLAY", display_name, 1);
+
+	// declare two monitors
+	char left[64], right[64];
+	snprintf(left,  sizeof(left),  "%d/508x%d/286+0+0",
+			MONITOR_WIDTH, MONITOR_HEIGHT);
+	snprintf(right, sizeof(right), "%d/508x%d/286+%d+0",
+			MONITOR_WIDTH, MONITOR_HEIGHT, MONITOR_WIDTH);
+	run((char*[]){ (char*)xrandr, "--setmonitor", "BENCH-DST", left,  "screen", NULL });
+	run((char*[]){ (char*)xrandr, "--setmonitor", "BENCH-SRC", right, "none",   NULL });
+}
+
+// start squint, return the fd for reading the statistics
+static int
+start_squint(const char* squint, const char** extra_args, int n_extra_args)
+{
+	int fds[2];
+	if (pipe(fds)) {
+		die("pipe() failed");
+	}
+
+	squint_pid = fork();
+	if (squint_pid < 0) {
+		die("fork() failed");
+	}
+	if (squint_pid == 0) {
+		close(fds[0]);
+		if (dup2(fds[1], STATS_FD) < 0) {
+			_exit(127);
+		}
+		char fd_str[16];
+		snprintf(fd_str, sizeof(fd_str), "%d", STATS_FD);
+
+		const char* argv[MAX_SQUINT_ARGS + 6] = {
+			squint, "--stats-fd", fd_str, "--stats-interval", "1000",
+		};
+		for (int i=0 ; i<n_extra_args ; i++) {
+			argv[5+i] = extra_args[i];
+		}
+		execv(squint, (char**)argv);
+		_exit(127);
+	}
+	close(fds[1]);
+	fcntl(fds[0], F_SETFL, O_NONBLOCK);
+	return fds[0];
+}
+
+static uint64_t
+json_uint(const char* line, const char* key)
+{
+	const char* p = strstr(line, key);
+	return p ? strtoull(p + strlen(key), NULL, 10) : 0;
+}
+
+static double
+json_double(const char* line, const char* key)
+{
+	const char* p = strstr(line, key);
+	return p ? strtod(p + strlen(key), NULL) : 0;
+}
+
+// accumulate a line of statistics
+static void
+parse_stats(const char* line)
+{
+	total.elapsed        += json_double(line, "\"interval\":");
+	total.frames         += json_uint(line, "\"frames\":");
+	total.coalesced      += json_uint(line, "\"coalesced\":");
+	total.missed         += json_uint(line, "\"missed_deadlines\":");
+	total.bytes          += json_uint(line, "\"bytes\":");
+	total.cursor_updates += json_uint(line, "\"cursor_updates\":");
+	total.wakeups        += json_uint(line, "\"wakeups\":");
+	total.requests       += json_uint(line, "\"requests\":");
+	total.cpu_ms         += json_double(line, "\"cpu_ms\":");
+
+	int max = json_uint(line, "\"max\":");
+	if (max > total.latency_max) {
+		total.latency_max = max;
+	}
+
+	const char* p = strstr(line, "\"count\":[");
+	if (p) {
+		p += strlen("\"count\":[");
+		for (unsigned int i=0 ; i<LATENCY_BUCKETS ; i++) {
+			char* end;
+			total.latency[i] += strtoull(p, &end, 10);
+			if (*end != ',') {
+				break;
+			}
+			p = end + 1;
+		}
+	}
+}
+
+// read the available statistics
+static void
+read_stats(int fd, int keep)
+{
+	static char buff[4096];
+	static size_t len = 0;
+
+	for (;;) {
+		ssize_t n = read(fd, buff+len, sizeof(buff)-1-len);
+		if (n <= 0) {
+			if ((n < 0) && (errno != EAGAIN)) {
+				die("cannot read the statistics");
+			}
+			return;
+		}
+		len += n;
+		buff[len] = 0;
+
+		char* eol;
+		while ((eol = strchr(buff, '\n'))) {
+			*eol = 0;
+			if (keep) {
+				parse_stats(buff);
+			}
+			len -= eol + 1 - buff;
+			memmove(buff, eol+1, len+1);
+		}
+		if (len == sizeof(buff)-1) {
+			die("statistics line too long");
+		}
+	}
+}
+
+// return the upper bound of the bucket containing the given percentile
+static const char*
+latency_percentile(double percentile)
+{
+	static char buff[8][16];
+	static int index = 0;
+	uint64_t count = 0, sum = 0;
+	unsigned int i;
+
+	for (i=0 ; i<LATENCY_BUCKETS ; i++) {
+		count += total.latency[i];
+	}
+	if (!count) {
+		return "-";
+	}
+
+	char* out = buff[index++ % 8];
+	for (i=0 ; i<LATENCY_BUCKETS-1 ; i++) {
+		sum += total.latency[i];
+		if (sum >= ceil(count * percentile)) {
+			snprintf(out, 16, "<=%d", latency_bounds[i]);
+			return out;
+		}
+	}
+	snprintf(out, 16, ">%d", latency_bounds[LATENCY_BUCKETS-2]);
+	return out;
+}
+
+//
+// Scenarios
+//
+// each scenario draws into a window covering the source monitor
+//
+
+static void
+step_caret(int n)
+{
+	XSetForeground(display, gc, (n & 1) ? 0xffffff : 0);
+	XFillRectangle(display, window, gc, 200, 200, 2, 24);
+}
+
+static void
+step_scroll(int n)
+{
+	const int line = 24;
+	XCopyArea(display, window, window, gc, 0, line,
+			MONITOR_WIDTH, MONITOR_HEIGHT - line, 0, 0);
+	XSetForeground(display, gc, 0xffffff);
+	XFillRectangle(display, window, gc,
+			0, MONITOR_HEIGHT - line, MONITOR_WIDTH, line);
+
+	// some 'text'
+	XSetForeground(display, gc, 0);
+	for (int x = 20 ; x < MONITOR_WIDTH - 40 ; x += 12 + (n*7 + x) % 23) {
+		XFillRectangle(display, window, gc,
+			x, MONITOR_HEIGHT - line + 6, 8, 12);
+	}
+}
+
+static void
+step_video(int n)
+{
+	uint32_t* pixels = (uint32_t*) image->data;
+	for (int y=0 ; y<MONITOR_HEIGHT ; y++) {
+		uint32_t v = (uint32_t)(y + n * 3) * 0x010203;
+		for (int x=0 ; x<MONITOR_WIDTH ; x++) {
+			pixels[y*MONITOR_WIDTH + x] = v ^ (x * 0x000101);
+		}
+	}
+	XPutImage(display, window, gc, image, 0, 0, 0, 0,
+			MONITOR_WIDTH, MONITOR_HEIGHT);
+}
+
+static void
+step_cursor(int n)
+{
+	double a = n * 0.01;
+	int x = MONITOR_WIDTH + MONITOR_WIDTH/2 + (int)(400 * cos(a));
+	int y = MONITOR_HEIGHT/2 + (int)(400 * sin(a));
+#ifdef HAVE_XTST
+	// fake events go through the input devices (and generate the
+	// XI_RawMotion events tracked by squint)
+	XTestFakeMotionEvent(display, -1, x, y, CurrentTime);
+#else
+	XWarpPointer(display, None, DefaultRootWindow(display), 0, 0, 0, 0, x, y);
+#endif
+}
+
+static const struct scenario {
+	const char* name;
+	int period;	// in ms
+	void (*step)(int n);
+} scenarios[] = {
+	{ "caret",	500,	step_caret },
+	{ "scroll",	16,	step_scroll },
+	{ "video",	33,	step_video },
+	{ "cursor",	1,	step_cursor },
+	{ NULL }
+};
+
+static void
+create_window()
+{
+	XSetWindowAttributes attr;
+	attr.override_redirect = True;
+	attr.background_pixel = 0xffffff;
+
+	window = XCreateWindow(display, DefaultRootWindow(display),
+			MONITOR_WIDTH, 0, MONITOR_WIDTH, MONITOR_HEIGHT, 0,
+			CopyFromParent, InputOutput, CopyFromParent,
+			CWOverrideRedirect | CWBackPixel, &attr);
+	XMapWindow(display, window);
+	gc = XCreateGC(display, window, 0, NULL);
+
+	image = XCreateImage(display, DefaultVisual(display, DefaultScreen(display)),
+			24, ZPixmap, 0,
+			malloc(MONITOR_WIDTH * MONITOR_HEIGHT * 4),
+			MONITOR_WIDTH, MONITOR_HEIGHT, 32, 0);
+	if (!image || !image->data) {
+		die("cannot create the image");
+	}
+	XSync(display, False);
+}
+
+int
+main(int argc, char* argv[])
+{
+	int duration = 10;
+	const char* extra_args[MAX_SQUINT_ARGS];
+	int n_extra_args = 0;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "a:d:")) != -1) {
+		switch (opt) {
+		case 'a':
+			if (n_extra_args == MAX_SQUINT_ARGS) {
+				die("too many arguments for squint");
+			}
+			extra_args[n_extra_args++] = optarg;
+			break;
+		case 'd':
+			duration = atoi(optarg);
+			break;
+		default:
+			argc = 0;
+		}
+	}
+	if (argc - optind != 4) {
+		fprintf(stderr, "usage: %s [-d SECONDS] [-a SQUINT_ARG]... SQUINT XVFB XRANDR SCENARIO\n", argv[0]);
+		return 1;
+	}
+	const char* squint   = argv[optind];
+	const char* xvfb     = argv[optind+1];
+	const char* xrandr   = argv[optind+2];
+	const char* scenario = argv[optind+3];
+
+	const struct scenario* sc;
+	for (sc=scenarios ; sc->name ; sc++) {
+		if (!strcmp(sc->name, scenario)) {
+			break;
+		}
+	}
+	if (!sc->name) {
+		die("unknown scenario");
+	}
+
+	start_xvfb(xvfb, xrandr);
+
+	display = XOpenDisplay(NULL);
+	if (!display) {
+		die("cannot open the display");
+	}
+	create_window();
+
+	int stats_fd = start_squint(squint, extra_args, n_extra_args);
+
+	int64_t start = now_ms();
+	int64_t end   = start + WARMUP_MS + duration * 1000;
+	int64_t next  = start;
+	int n = 0;
+
+	for (;;)
+	{
+		int64_t now = now_ms();
+		if (now >= end) {
+			break;
+		}
+		if (now >= next) {
+			sc->step(n++);
+			XFlush(display);
+			next += sc->period;
+			if (next < now) {
+				// we are late
+				next = now;
+			}
+		}
+
+		struct pollfd pfd = { stats_fd, POLLIN, 0 };
+		poll(&pfd, 1, (int)(next - now_ms() > 0 ? next - now_ms() : 0));
+		if (pfd.revents) {
+			read_stats(stats_fd, now_ms() >= start + WARMUP_MS);
+		}
+
+		int status;
+		if (waitpid(squint_pid, &status, WNOHANG) == squint_pid) {
+			squint_pid = 0;
+			die("squint terminated unexpectedly");
+		}
+	}
+
+	kill(squint_pid, SIGTERM);
+	waitpid(squint_pid, NULL, 0);
+	squint_pid = 0;
+	XCloseDisplay(display);
+	kill(xvfb_pid, SIGTERM);
+	waitpid(xvfb_pid, NULL, 0);
+	xvfb_pid = 0;
+
+	if (total.elapsed <= 0) {
+		die("no statistics received");
+	}
+
+	printf("scenario:          %s\n", sc->name);
+	printf("squint arguments: ");
+	for (int i=0 ; i<n_extra_args ; i++) {
+		printf(" %s", extra_args[i]);
+	}
+	printf("\n");
+	printf("duration:          %.1f s\n", total.elapsed);
+	printf("frames:            %llu (%.1f fps)\n",
+			(unsigned long long) total.frames, total.frames / total.elapsed);
+	printf("coalesced:         %llu\n", (unsigned long long) total.coalesced);
+	printf("missed deadlines:  %llu\n", (unsigned long long) total.missed);
+	printf("bytes copied:      %.1f MB/s\n", total.bytes / total.elapsed / 1e6);
+	printf("cursor updates:    %.1f /s\n", total.cursor_updates / total.elapsed);
+	printf("wakeups:           %.1f /s\n", total.wakeups / total.elapsed);
+	printf("X requests:        %.1f /s\n", total.requests / total.elapsed);
+	printf("cpu time:          %.1f %%\n", total.cpu_ms / total.elapsed / 10);
+	printf("latency (ms):      p50 %s  p90 %s  p99 %s  max %d\n",
+			latency_percentile(0.50), latency_percentile(0.90),
+			latency_percentile(0.99), total.latency_max);
+	return 0;
+}
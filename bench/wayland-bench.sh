@@ -0,0 +1,80 @@
+#!/bin/sh
+#
+# wayland-bench: measure the throughput of squint in a headless wayland
+# compositor
+#
+# usage: wayland-bench.sh SQUINT SWAY [SECONDS]
+#
+# The benchmark starts sway with two side-by-side headless outputs, runs
+# squint (which duplicates one output into the other) and generates damage
+# with a clock displayed in a bar on both outputs (refreshed at 20 Hz). The
+# frames reported by squint (--stats-fd) are summed and printed at the end of
+# the run. It fails if no frame was mirrored, if the frames copied more than a
+# tenth of the output on average (the clock is a small damage; the first
+# report with frames is skipped since it holds the initial full frame), or if
+# the capture buffers were allocated more than once.
+#
+
+set -e
+
+if [ $# -lt 2 ] ; then
+	echo "usage: $0 SQUINT SWAY [SECONDS]" >&2
+	exit 1
+fi
+SQUINT="$1"
+SWAY="$2"
+DURATION="${3:-10}"
+
+TMPDIR="$(mktemp -d)"
+trap 'rm -rf "$TMPDIR"' EXIT
+STATS="$TMPDIR/stats"
+
+cat > "$TMPDIR/config" <<END
+output HEADLESS-1 resolution 1920x1080 position 0 0
+output HEADLESS-2 resolution 1920x1080 position 1920 0
+bar {
+	status_command while date +%T.%N ; do sleep 0.05 ; done
+}
+exec GDK_BACKEND=wayland "$SQUINT" --stats-fd 3 --stats-interval 1000 3>"$STATS"
+END
+
+export XDG_RUNTIME_DIR="$TMPDIR"
+export WLR_BACKENDS=headless
+export WLR_HEADLESS_OUTPUTS=2
+export WLR_LIBINPUT_NO_DEVICES=1
+export WLR_RENDERER=pixman
+unset WAYLAND_DISPLAY DISPLAY
+
+"$SWAY" --config "$TMPDIR/config" >"$TMPDIR/log" 2>&1 &
+SWAY_PID=$!
+sleep "$DURATION"
+kill "$SWAY_PID"
+wait "$SWAY_PID" || true
+
+FRAMES="$(sed -n 's/.*"frames":\([0-9]*\).*/\1/p' "$STATS" | awk '{n += $1} END {print n+0}')"
+ALLOCATIONS="$(sed -n 's/.*"allocations":\([0-9]*\).*/\1/p' "$STATS" | awk '{n += $1} END {print n+0}')"
+BYTES_PER_FRAME="$(sed -n 's/.*"frames":\([0-9]*\).*"bytes":\([0-9]*\).*/\1 \2/p' "$STATS" \
+	| awk '$1 && !seen {seen = 1 ; next} {f += $1 ; b += $2} END {print (f ? int(b / f) : 0)}')"
+FULL_FRAME=$((1920 * 1080 * 4))
+
+echo "scenario:          wayland"
+echo "duration:          $DURATION s"
+echo "frames:            $FRAMES"
+echo "bytes per frame:   $BYTES_PER_FRAME (full frame: $FULL_FRAME)"
+echo "allocations:       $ALLOCATIONS"
+
+fail()
+{
+	echo "wayland-bench: $1" >&2
+	cat "$TMPDIR/log" >&2
+	exit 1
+}
+if [ "$FRAMES" -eq 0 ] ; then
+	fail "no frame was mirrored"
+fi
+if [ "$BYTES_PER_FRAME" -gt $((FULL_FRAME / 10)) ] ; then
+	fail "the frames are not copied incrementally"
+fi
+if [ "$ALLOCATIONS" -ne 1 ] ; then
+	fail "the capture buffers were allocated $ALLOCATIONS times"
+fi
@@ -0,0 +1,178 @@
+#include "config.h"
+
+#include "squint.h"
+
+//
+// Frame pacing
+//
+// The frames are aligned on the vertical blanks of the destination monitor.
+// A frame requested with pacing_schedule() is produced PACING_MARGIN µs
+// before the next vblank, so that it is ready when the monitor scans it out.
+// All the damages received meanwhile are merged into that frame.
+//
+// The vblank period is given by the refresh rate of the monitor. The phase is
+// adjusted whenever the time of an actual vblank is known (see
+// pacing_vblank()), otherwise the frames are just evenly spaced.
+//
+// The frame rate limit (--limit) is a cap: the frames are produced every N
+// vblanks, N being the smallest interval that does not exceed the limit.
+//
+
+#define PACING_MARGIN		2000	// µs before the vblank
+#define PACING_RESYNC_PERIOD	G_USEC_PER_SEC
+#define PACING_DEFAULT_RATE	60.0
+
+static GSource* source = NULL;
+static void (*frame_func)() = NULL;
+static void (*sync_func)() = NULL;
+
+static double refresh_rate = PACING_DEFAULT_RATE;
+static int    limit = -1;
+static gboolean unpaced = FALSE;
+
+static gint64 vblank_period = G_USEC_PER_SEC / PACING_DEFAULT_RATE;
+static int    frame_interval = 1;	// (in vblanks)
+static gint64 vblank_time = 0;		// time of a known vblank
+static gint64 vblank_requested = 0;	// last call to sync_func
+
+static gint64 target = 0;		// vblank of the scheduled frame
+static gint64 last_target = 0;		// vblank of the previous frame
+
+static gboolean
+pacing_dispatch(GSource* src, GSourceFunc callback, gpointer user_data)
+{
+	g_source_set_ready_time(source, -1);
+
+	trace_begin("frame");
+	frame_func();
+	trace_end("frame");
+
+	gint64 now = g_get_monotonic_time();
+	if (!unpaced) {
+		if (now > target) {
+			stats_missed_deadline();
+		}
+		last_target = target;
+	}
+
+	// sample the vblank regularly (the clocks drift)
+	if (sync_func && (now - vblank_requested > PACING_RESYNC_PERIOD)) {
+		vblank_requested = now;
+		sync_func();
+	}
+	return G_SOURCE_CONTINUE;
+}
+
+static GSourceFuncs pacing_source_funcs = {
+	NULL,
+	NULL,
+	pacing_dispatch,
+	NULL,
+};
+
+static void
+pacing_update()
+{
+	vblank_period = G_USEC_PER_SEC / refresh_rate;
+	frame_interval = 1;
+	if (limit > 0) {
+		// round up (with some tolerance for the 59.94Hz-like rates)
+		double n = refresh_rate / limit - 0.01;
+		frame_interval = MAX(1, (int) n + ((int) n < n));
+	}
+	unpaced = (limit == 0);
+}
+
+// 'frame' is called to produce the scheduled frames (in 'context'), 'sync' (if
+// not NULL) is called when the time of the next vblank should be reported with
+// pacing_vblank()
+void
+pacing_init(GMainContext* context, void (*frame)(), void (*sync)())
+{
+	frame_func = frame;
+	sync_func = sync;
+
+	if (!source) {
+		source = g_source_new(&pacing_source_funcs, sizeof(GSource));
+		g_source_set_priority(source, G_PRIORITY_HIGH);
+		g_source_attach(source, context);
+	}
+	g_source_set_ready_time(source, -1);
+}
+
+// set the maximum frame rate (-1: refresh rate of the monitor, 0: unpaced)
+void
+pacing_set_limit(int fps)
+{
+	limit = fps;
+	pacing_update();
+}
+
+// set the refresh rate of the destination monitor (0 if unknown)
+void
+pacing_set_refresh_rate(double hz)
+{
+	refresh_rate = (hz > 0) ? hz : PACING_DEFAULT_RATE;
+	vblank_time = 0;
+	vblank_requested = 0;
+	last_target = 0;
+	pacing_update();
+}
+
+// report the time of an actual vblank (monotonic time in µs)
+void
+pacing_vblank(gint64 ust)
+{
+	vblank_time = ust;
+}
+
+// request a frame
+//
+// return FALSE if a frame was already scheduled (the caller's damage will be
+// merged into it)
+gboolean
+pacing_schedule()
+{
+	if (g_source_get_ready_time(source) != -1) {
+		return FALSE;
+	}
+
+	if (unpaced) {
+		g_source_set_ready_time(source, 0);
+		return TRUE;
+	}
+
+	gint64 now = g_get_monotonic_time();
+	if (!vblank_time) {
+		// no known vblank
+		vblank_time = now;
+		if (sync_func) {
+			vblank_requested = now;
+			sync_func();
+		}
+	}
+
+	// next vblank that leaves enough time to produce the frame
+	gint64 delta = now + PACING_MARGIN - vblank_time;
+	gint64 n = (delta >= 0) ? (delta / vblank_period + 1) : 0;
+	target = vblank_time + n * vblank_period;
+
+	// honour the limit
+	gint64 min_target = last_target + frame_interval * vblank_period - vblank_period / 2;
+	while (target < min_target) {
+		target += vblank_period;
+	}
+
+	g_source_set_ready_time(source, target - PACING_MARGIN);
+	return TRUE;
+}
+
+// cancel the scheduled frame
+void
+pacing_cancel()
+{
+	if (source) {
+		g_source_set_ready_time(source, -1);
+	}
+	last_target = 0;
+}
@@ -0,0 +1,170 @@
+#include "config.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "squint.h"
+
+//
+// Event recorder
+//
+// The events received by the capture backend (damage, cursor motion, cursor
+// changes, active window changes) are stored into config.record_file as a
+// sequence of fixed-size records (in host byte order), preceded by a magic
+// header.
+//
+// A recording can be loaded with record_load() and fed back into the
+// backend (see --replay).
+//
+
+static const char record_magic[8] = "SQREC02\n";
+
+static FILE* record_fp = NULL;
+static gint64 record_start = 0;
+
+static gboolean
+record_on_idle_error(gpointer msg)
+{
+	squint_error(msg);
+	return G_SOURCE_REMOVE;
+}
+
+// report an error from any thread (the events are recorded and replayed in
+// the capture thread)
+static void
+record_error(const char* msg)
+{
+	g_idle_add_full(G_PRIORITY_DEFAULT_IDLE, record_on_idle_error,
+			g_strdup(msg), g_free);
+}
+
+static void
+record_write(guint8 type, guint32 timestamp, gboolean more, int x, int y, int width, int height)
+{
+	if (!record_fp) {
+		return;
+	}
+
+	struct record rec = {
+		.time      = (g_get_monotonic_time() - record_start) / 1000,
+		.timestamp = timestamp,
+		.type      = type,
+		.more      = more,
+		.x = x, .y = y,
+		.width = width, .height = height,
+	};
+
+	if (fwrite(&rec, sizeof(rec), 1, record_fp) != 1)
+	{
+		char buff[256];
+		g_snprintf(buff, sizeof(buff), "cannot write %s: %s",
+				config.record_file, strerror(errno));
+		record_error(buff);
+
+		fclose(record_fp);
+		record_fp = NULL;
+	}
+}
+
+void
+record_damage(guint32 timestamp, const GdkRectangle* area, gboolean more)
+{
+	record_write(RECORD_DAMAGE, timestamp, more,
+			area->x, area->y, area->width, area->height);
+}
+
+void
+record_motion(const GdkPoint* pos)
+{
+	record_write(RECORD_MOTION, 0, FALSE, pos->x, pos->y, 0, 0);
+}
+
+void
+record_cursor()
+{
+	record_write(RECORD_CURSOR, 0, FALSE, 0, 0, 0, 0);
+}
+
+void
+record_active_window(const GdkRectangle* rect)
+{
+	record_write(RECORD_ACTIVE_WINDOW, 0, FALSE,
+			rect->x, rect->y, rect->width, rect->height);
+}
+
+static void
+record_close()
+{
+	if (record_fp) {
+		fclose(record_fp);
+		record_fp = NULL;
+	}
+}
+
+gboolean
+record_init()
+{
+	if (!config.record_file) {
+		return TRUE;
+	}
+
+	record_fp = fopen(config.record_file, "wb");
+	if (!record_fp
+	    || (fwrite(record_magic, sizeof(record_magic), 1, record_fp) != 1))
+	{
+		char buff[256];
+		g_snprintf(buff, sizeof(buff), "cannot write %s: %s",
+				config.record_file, strerror(errno));
+		squint_error(buff);
+		return FALSE;
+	}
+	record_start = g_get_monotonic_time();
+	atexit(record_close);
+	return TRUE;
+}
+
+// load a recording
+//
+// return an array of records (to be freed with g_free()) or NULL on error
+struct record*
+record_load(const char* path, int* count)
+{
+	char buff[256];
+	char magic[sizeof(record_magic)];
+	struct record* records = NULL;
+	int n = 0, allocated = 0;
+
+	FILE* fp = fopen(path, "rb");
+	if (!fp) {
+		g_snprintf(buff, sizeof(buff), "cannot read %s: %s", path, strerror(errno));
+		record_error(buff);
+		return NULL;
+	}
+
+	if (	(fread(magic, sizeof(magic), 1, fp) != 1)
+	    ||	memcmp(magic, record_magic, sizeof(magic)))
+	{
+		g_snprintf(buff, sizeof(buff), "%s is not a squint recording", path);
+		record_error(buff);
+		fclose(fp);
+		return NULL;
+	}
+
+	for (;;)
+	{
+		if (n == allocated) {
+			allocated = allocated ? 2*allocated : 1024;
+			records = g_renew(struct record, records, allocated);
+		}
+		if (fread(&records[n], sizeof(*records), 1, fp) != 1) {
+			break;
+		}
+		n++;
+	}
+	fclose(fp);
+
+	*count = n;
+	return records;
+}
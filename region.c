@@ -0,0 +1,195 @@
+#include "config.h"
+
+#include <string.h>
+
+#include "squint.h"
+
+//
+// Damage region
+//
+// A region is a small set of disjoint rectangles. Rectangles are merged
+// together only when their union does not waste much area (compared to
+// copying them separately), otherwise they are kept apart (and cut into
+// disjoint pieces if they overlap).
+//
+// When the set is full, the pair of rectangles that wastes the least area is
+// merged.
+//
+
+// extra area tolerated when merging two rectangles (relative to the area
+// actually damaged, in percents)
+#define REGION_MERGE_WASTE	25
+
+// extra area tolerated when merging two rectangles (absolute, in pixels) so
+// that small neighbouring updates (eg: text being typed) are copied in a
+// single request
+#define REGION_MERGE_SLACK	(64*64)
+
+static int
+rect_area(const GdkRectangle* r)
+{
+	return r->width * r->height;
+}
+
+// return the area that would be copied for nothing if rectangles a and b were
+// merged (in *u)
+static int
+rect_merge_waste(const GdkRectangle* a, const GdkRectangle* b, GdkRectangle* u)
+{
+	GdkRectangle inter;
+	int used = rect_area(a) + rect_area(b);
+	if (gdk_rectangle_intersect(a, b, &inter)) {
+		used -= rect_area(&inter);
+	}
+	gdk_rectangle_union(a, b, u);
+	return rect_area(u) - used;
+}
+
+static gboolean
+rect_merge_is_cheap(const GdkRectangle* a, const GdkRectangle* b, GdkRectangle* u)
+{
+	int waste = rect_merge_waste(a, b, u);
+	int used  = rect_area(u) - waste;
+	return waste <= (used * REGION_MERGE_WASTE / 100) + REGION_MERGE_SLACK;
+}
+
+// cut the parts of r that are outside of e (which must intersect r)
+//
+// return the number of pieces stored in out (at most 4)
+static int
+rect_subtract(const GdkRectangle* r, const GdkRectangle* e, GdkRectangle* out)
+{
+	int n = 0;
+	int top    = MAX(r->y, e->y);
+	int bottom = MIN(r->y + r->height, e->y + e->height);
+
+	if (e->y > r->y) {
+		// band above e
+		out[n++] = (GdkRectangle){ r->x, r->y, r->width, e->y - r->y };
+	}
+	if (e->y + e->height < r->y + r->height) {
+		// band below e
+		out[n++] = (GdkRectangle){ r->x, bottom, r->width,
+					r->y + r->height - bottom };
+	}
+	if (e->x > r->x) {
+		// left of e
+		out[n++] = (GdkRectangle){ r->x, top, e->x - r->x, bottom - top };
+	}
+	if (e->x + e->width < r->x + r->width) {
+		// right of e
+		int x = e->x + e->width;
+		out[n++] = (GdkRectangle){ x, top, r->x + r->width - x, bottom - top };
+	}
+	return n;
+}
+
+static void
+region_remove(struct region* rg, int i)
+{
+	rg->rects[i] = rg->rects[--rg->n];
+}
+
+// add rect into the region
+//
+// if merge_overlaps is set, then overlapping rectangles are merged instead of
+// being cut into pieces. It is set once rect has been grown by a merge, so that
+// each restart removes one rectangle from the set (which guarantees the
+// termination)
+static void
+region_add_from(struct region* rg, GdkRectangle rect, gboolean merge_overlaps)
+{
+	int i;
+restart:
+	for (i=0 ; i<rg->n ; i++)
+	{
+		GdkRectangle* e = &rg->rects[i];
+		GdkRectangle u;
+
+		if (rect_merge_is_cheap(e, &rect, &u)
+		    || (merge_overlaps && gdk_rectangle_intersect(e, &rect, NULL)))
+		{
+			// merge e into rect and add it again (it may
+			// now overlap other rectangles)
+			rect = u;
+			region_remove(rg, i);
+			merge_overlaps = TRUE;
+			goto restart;
+		}
+
+		if (gdk_rectangle_intersect(e, &rect, NULL))
+		{
+			// keep only the parts of rect that are outside e
+			GdkRectangle pieces[4];
+			int j, n = rect_subtract(&rect, e, pieces);
+			for (j=0 ; j<n ; j++) {
+				region_add_from(rg, pieces[j], FALSE);
+			}
+			return;
+		}
+	}
+
+	if (rg->n < REGION_MAX_RECTS) {
+		rg->rects[rg->n++] = rect;
+		return;
+	}
+
+	// the region is full
+	// -> merge rect with the rectangle that wastes the least area
+	int best = 0, best_waste = G_MAXINT;
+	GdkRectangle best_union;
+	for (i=0 ; i<rg->n ; i++)
+	{
+		GdkRectangle u;
+		int waste = rect_merge_waste(&rg->rects[i], &rect, &u);
+		if (waste < best_waste) {
+			best = i;
+			best_waste = waste;
+			best_union = u;
+		}
+	}
+	rect = best_union;
+	region_remove(rg, best);
+	merge_overlaps = TRUE;
+	goto restart;
+}
+
+void
+region_clear(struct region* rg)
+{
+	rg->n = 0;
+}
+
+gboolean
+region_is_empty(const struct region* rg)
+{
+	return rg->n == 0;
+}
+
+void
+region_add(struct region* rg, const GdkRectangle* rect)
+{
+	if ((rect->width > 0) && (rect->height > 0)) {
+		region_add_from(rg, *rect, FALSE);
+	}
+}
+
+void
+region_union(struct region* rg, const struct region* other)
+{
+	int i;
+	for (i=0 ; i<other->n ; i++) {
+		region_add_from(rg, other->rects[i], FALSE);
+	}
+}
+
+// total number of pixels in the region
+int
+region_area(const struct region* rg)
+{
+	int i, area = 0;
+	for (i=0 ; i<rg->n ; i++) {
+		area += rect_area(&rg->rects[i]);
+	}
+	return area;
+}
@@ -1,15 +1,20 @@
 #include "config.h"
 
+#include <signal.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 
 #include <gdk-pixbuf/gdk-pixbuf.h>
+#include <glib-unix.h>
 
 #ifdef HAVE_APPINDICATOR
 #include <libayatana-appindicator/app-indicator.h>
 #endif
+#ifdef HAVE_WAYLAND
+#include <gdk/gdkwayland.h>
+#endif
 
 #include "squint.h"
 
@@ -18,17 +23,18 @@ struct config config;
 
 // State
 gboolean enabled = FALSE;
+static guint reconfigure_pending = 0;
 gboolean fullscreen = FALSE;
-gboolean raised = FALSE;
 
-GtkWidget* gtkwin = NULL;
-GdkWindow* gdkwin = NULL;
 GdkDisplay* gdisplay = NULL;
+#ifdef HAVE_WAYLAND
+static gboolean wayland = FALSE;	// running in a Wayland session
+#endif
 
-GdkRectangle src_rect, dst_rect, active_window_rect;
+GdkRectangle active_window_rect;
 
-static GdkMonitor* src_monitor = NULL;
-static GdkMonitor* dst_monitor = NULL;
+struct session sessions[MAX_SESSIONS];
+int n_sessions = 0;
 
 static GApplication* gtkapp = NULL;
 static GdkPixbuf* icon = NULL;
@@ -50,6 +56,7 @@ void refresh_app_indicator();
 #endif
 
 gboolean squint_enable();
+void on_monitors_changed(GdkScreen* screen, gpointer data);
 
 void
 show_about_dialog()
@@ -80,51 +87,86 @@ squint_error(const char* msg)
 }
 
 void
-squint_show()
+show_output(struct output* o)
 {
-	if (!raised)
-	{
-		raised = TRUE;
-		if (fullscreen) {
-			gtk_widget_show(gtkwin);
-		} else if (!config.opt_passive) {
-			gdk_window_raise(gdkwin);
-		}
+	if (fullscreen) {
+		gtk_widget_show(o->gtkwin);
+	} else if (!config.opt_passive) {
+		gdk_window_raise(o->gdkwin);
 	}
 }
 
 void
-do_hide()
+hide_output(struct output* o)
 {
-	raised = FALSE;
 	if (fullscreen) {
-		gtk_widget_hide(gtkwin);
+		gtk_widget_hide(o->gtkwin);
 	} else if (!config.opt_passive) {
-		gdk_window_lower(gdkwin);
+		gdk_window_lower(o->gdkwin);
 	}
 }
 
 void
-squint_hide()
+squint_show(struct session* s)
 {
-	if(raised)
+	if (!s->raised)
 	{
-		do_hide();
+		s->raised = TRUE;
+		int i;
+		for (i=0 ; i<s->n_outputs ; i++) {
+			show_output(&s->outputs[i]);
+		}
+	}
+}
+
+void
+do_hide(struct session* s)
+{
+	s->raised = FALSE;
+	int i;
+	for (i=0 ; i<s->n_outputs ; i++) {
+		hide_output(&s->outputs[i]);
 	}
 }
 
+void
+squint_hide(struct session* s)
+{
+	if(s->raised)
+	{
+		do_hide(s);
+	}
+}
+
+
+void
+squint_quit()
+{
+	g_application_release(gtkapp);
+}
+
+gboolean
+on_terminate_signal(gpointer data)
+{
+	// terminate with exit() so that the atexit() handlers are run (eg: to
+	// write the trace file)
+	exit(0);
+	return G_SOURCE_REMOVE;
+}
 
 gboolean
 on_window_button_press_event(GtkWidget* widget, GdkEvent* event, gpointer data)
 {
 	GdkEventButton* ev = (GdkEventButton*) event;
+	const struct session* s = data;
 
 	if (enabled
 		&& (ev->type == GDK_2BUTTON_PRESS)
 		&& (ev->button = 1)
 	) {
+		GdkWindow* gdkwin = gtk_widget_get_window(widget);
 		gdk_window_unmaximize(gdkwin);
-		gdk_window_resize(gdkwin, src_rect.width, src_rect.height);
+		gdk_window_resize(gdkwin, s->mirror_width, s->mirror_height);
 	}
 	return FALSE;
 }
@@ -136,7 +178,7 @@ on_window_delete_event(GtkWidget* widget, GdkEvent* event, gpointer data)
 	return TRUE;
 }
 
-#define ITEM_MASK		0xffffff00
+#define ITEM_MASK		0x00ffff00
 #define ITEM_ENABLE		(1<<8)
 #define ITEM_FULLSCREEN		(1<<9)
 #define ITEM_QUIT		(1<<10)
@@ -144,20 +186,72 @@ on_window_delete_event(GtkWidget* widget, GdkEvent* event, gpointer data)
 #define ITEM_DST_MONITOR	(1<<12)
 #define ITEM_ABOUT		(1<<13)
 #define ITEM_PASSIVE		(1<<14)
+#define ITEM_ADD_SESSION	(1<<15)
+#define ITEM_REMOVE_SESSION	(1<<16)
 #define ITEM_AUTO		0xff
 
+// index of the session (for the monitor items)
+#define ITEM_SESSION_SHIFT	24
+#define ITEM_SESSION(code)	((code) >> ITEM_SESSION_SHIFT)
+
+// add a new session (with autodetected monitors)
 void
-update_monitor_config(const char** monitor_name, int id)
+add_session()
 {
-	if (*monitor_name) {
-		g_free((gpointer)*monitor_name);
+	if (n_sessions < MAX_SESSIONS) {
+		memset(&sessions[n_sessions], 0, sizeof(struct session));
+		n_sessions++;
 	}
-	*monitor_name = NULL;
+}
 
-	if (id != ITEM_AUTO)
+// remove a session (must not be enabled)
+void
+remove_session(int index)
+{
+	struct session* s = &sessions[index];
+	int i;
+	for (i=0 ; i<s->n_src_monitor_names ; i++) {
+		g_free((gpointer)s->src_monitor_names[i]);
+	}
+	for (i=0 ; i<s->n_dst_monitor_names ; i++) {
+		g_free((gpointer)s->dst_monitor_names[i]);
+	}
+	n_sessions--;
+	memmove(s, s+1, (n_sessions - index) * sizeof(struct session));
+	memset(&sessions[n_sessions], 0, sizeof(struct session));
+}
+
+// add or remove a monitor in a list of requested monitors (or revert to
+// autodetection)
+void
+update_monitor_list_config(const char** names, int* n_names, int max_names, int id)
+{
+	int i;
+	if (id == ITEM_AUTO)
+	{
+		for (i=0 ; i<*n_names ; i++) {
+			g_free((gpointer)names[i]);
+			names[i] = NULL;
+		}
+		*n_names = 0;
+		return;
+	}
+
+	GdkMonitor* monitor = gdk_display_get_monitor(gdisplay, id);
+	const char* name = gdk_monitor_get_model(monitor);
+	for (i=0 ; i<*n_names ; i++)
 	{
-		GdkMonitor* monitor = gdk_display_get_monitor(gdisplay, id);
-		*monitor_name = g_strdup(gdk_monitor_get_model(monitor));
+		if (!strcmp(name, names[i])) {
+			// already selected -> remove it
+			g_free((gpointer)names[i]);
+			(*n_names)--;
+			memmove(&names[i], &names[i+1], (*n_names - i) * sizeof(const char*));
+			names[*n_names] = NULL;
+			return;
+		}
+	}
+	if (*n_names < max_names) {
+		names[(*n_names)++] = g_strdup(name);
 	}
 }
 
@@ -170,6 +264,7 @@ on_menu_item_activate(gpointer pointer, gpointer user_data)
 	}
 
 	intptr_t code = (intptr_t)user_data;
+	struct session* s = &sessions[ITEM_SESSION(code)];
 	switch (code & ITEM_MASK)
 	{
 	case ITEM_ENABLE:
@@ -189,16 +284,39 @@ on_menu_item_activate(gpointer pointer, gpointer user_data)
 		goto reset;
 
 	case ITEM_QUIT:
-		g_application_release(gtkapp);
+		squint_quit();
 		break;
 	
 	case ITEM_SRC_MONITOR:
-		update_monitor_config(&config.src_monitor_name, code & ITEM_AUTO);
+		update_monitor_list_config(s->src_monitor_names, &s->n_src_monitor_names,
+				MAX_SOURCES, code & ITEM_AUTO);
 		goto reset;
 		
 	case ITEM_DST_MONITOR:
-		update_monitor_config(&config.dst_monitor_name, code & ITEM_AUTO);
+		update_monitor_list_config(s->dst_monitor_names, &s->n_dst_monitor_names,
+				MAX_OUTPUTS, code & ITEM_AUTO);
 		goto reset;
+
+	case ITEM_ADD_SESSION:
+	case ITEM_REMOVE_SESSION:
+		// the sessions cannot be changed while running
+		{
+			gboolean was_enabled = enabled;
+			if (enabled) {
+				squint_disable();
+			}
+			if ((code & ITEM_MASK) == ITEM_ADD_SESSION) {
+				add_session();
+			} else {
+				remove_session(ITEM_SESSION(code));
+			}
+			if (was_enabled) {
+				squint_enable();
+			} else {
+				refresh_app_indicator();
+			}
+		}
+		break;
 	
 	case ITEM_ABOUT:
 		show_about_dialog();
@@ -220,7 +338,8 @@ connect_menu_item(GtkWidget* item, intptr_t user_data) {
 }
 
 void
-populate_menu_with_monitors(int index, const char* config_name, GdkMonitor* active_monitor, intptr_t userdata)
+populate_menu_with_monitors(int index, const char* const* config_names, int n_config_names,
+		GdkMonitor* active_monitor, intptr_t userdata)
 {
 	void append(int* index, GtkWidget* item) {
 		if (*index < 0) {
@@ -233,15 +352,15 @@ populate_menu_with_monitors(int index, const char* config_name, GdkMonitor* acti
 	// Auto button
 	GtkWidget* auto_item = gtk_check_menu_item_new_with_label("Auto");
 	{
-		if (config_name == NULL) {
+		if (!n_config_names) {
 			gtk_check_menu_item_set_active(GTK_CHECK_MENU_ITEM(auto_item), TRUE);
 		}
 		connect_menu_item(auto_item, userdata | ITEM_AUTO);
 		append(&index, auto_item);
 	}
 
-	int i, n = gdk_display_get_n_monitors(gdisplay);
-	gboolean found = FALSE;
+	int i, j, n = gdk_display_get_n_monitors(gdisplay);
+	gboolean found[MAX(MAX_OUTPUTS, MAX_SOURCES)] = { FALSE };
 	char buff[64];
 	GtkWidget* item;
 	for (i=0 ; i<n ; i++)
@@ -257,23 +376,28 @@ populate_menu_with_monitors(int index, const char* config_name, GdkMonitor* acti
 		connect_menu_item(item, userdata | (i & 0xff));
 		append(&index, item);
 
-		if (config_name == NULL) {
+		if (!n_config_names) {
 			if (enabled && monitor==active_monitor) {
 				g_snprintf(buff, 64, "Auto (%s)", name);
 				gtk_menu_item_set_label(GTK_MENU_ITEM(auto_item), buff);
 			}
-		} else if (!strcmp(config_name, name)) {
-			found = TRUE;
-			gtk_check_menu_item_set_active(
-					GTK_CHECK_MENU_ITEM(item), TRUE);
+		}
+		for (j=0 ; j<n_config_names ; j++) {
+			if (!strcmp(config_names[j], name)) {
+				found[j] = TRUE;
+				gtk_check_menu_item_set_active(
+						GTK_CHECK_MENU_ITEM(item), TRUE);
+			}
 		}
 	}
-	if (!found && config_name) {
-		// choosen monitor is not active
-		item = gtk_check_menu_item_new_with_label(config_name);
-		gtk_check_menu_item_set_active(
-			GTK_CHECK_MENU_ITEM(item), TRUE);
-		append(&index, item);
+	for (j=0 ; j<n_config_names ; j++) {
+		if (!found[j]) {
+			// choosen monitor is not active
+			item = gtk_check_menu_item_new_with_label(config_names[j]);
+			gtk_check_menu_item_set_active(
+				GTK_CHECK_MENU_ITEM(item), TRUE);
+			append(&index, item);
+		}
 	}
 	gtk_widget_show_all(GTK_WIDGET(menu.shell));
 }
@@ -313,21 +437,7 @@ init_app_indicator()
 	connect_menu_item(item, ITEM_QUIT);
 	gtk_menu_shell_append(menu.shell, item);
 
-
-	// monitors
-	const char*  mon_labels[] = {"Source monitor", "Destination monitor"};
-	const intptr_t mon_data[] = {ITEM_SRC_MONITOR, ITEM_DST_MONITOR};
-	for (int i=0; i<2 ; i++) {
-		gtk_menu_shell_append(menu.shell, gtk_separator_menu_item_new());
-
-		item = gtk_menu_item_new_with_label(mon_labels[i]);
-		gtk_widget_set_sensitive(item, FALSE);
-		gtk_menu_shell_append(menu.shell, item);
-
-		item = gtk_check_menu_item_new_with_label("Auto");
-		connect_menu_item(item, mon_data[i] | ITEM_AUTO);
-		gtk_menu_shell_append(menu.shell, item);
-	}
+	// the sessions are populated by refresh_app_indicator()
 
 	// initialise the app_indicator
 	app_indicator = app_indicator_new_with_path("squint", "",
@@ -361,14 +471,23 @@ refresh_app_indicator()
 			// disable the button if running in fullscreen mode (because it has no effects)
 			gtk_widget_set_sensitive(item, config.opt_window);
 			break;
+		case 3:
+		case 4:
+			// about & quit
+			break;
 		default:
-			// delete all other GtkTypeCheckMenuItem objects
-			if (G_OBJECT_TYPE(item) == GTK_TYPE_CHECK_MENU_ITEM) {
-				gtk_container_remove(GTK_CONTAINER(menu.shell), item);
-			}
+			// delete the sessions
+			gtk_container_remove(GTK_CONTAINER(menu.shell), item);
 		}
 	}
 
+	void append_label(const char* label)
+	{
+		GtkWidget* item = gtk_menu_item_new_with_label(label);
+		gtk_widget_set_sensitive(item, FALSE);
+		gtk_menu_shell_append(menu.shell, item);
+	}
+
 	if (enabled) {
 		app_indicator_set_icon_full(app_indicator, "squint",          "squint enabled");
 	} else {
@@ -377,8 +496,45 @@ refresh_app_indicator()
 
 	menu.update_index = 0;
 	gtk_container_foreach(GTK_CONTAINER(menu.shell), each_menu_item, NULL);
-	populate_menu_with_monitors(-1, config.dst_monitor_name, dst_monitor, ITEM_DST_MONITOR);
-	populate_menu_with_monitors(6,  config.src_monitor_name, src_monitor, ITEM_SRC_MONITOR);
+
+	int i;
+	char buff[64];
+	GtkWidget* item;
+	for (i=0 ; i<n_sessions ; i++)
+	{
+		const struct session* s = &sessions[i];
+		intptr_t session_data = (intptr_t)i << ITEM_SESSION_SHIFT;
+
+		gtk_menu_shell_append(menu.shell, gtk_separator_menu_item_new());
+		if (n_sessions > 1) {
+			g_snprintf(buff, 64, "Session %d: source monitor", i + 1);
+			append_label(buff);
+		} else {
+			append_label("Source monitor");
+		}
+		populate_menu_with_monitors(-1, s->src_monitor_names, s->n_src_monitor_names,
+				(s->n_sources ? s->sources[0].monitor : NULL),
+				session_data | ITEM_SRC_MONITOR);
+
+		gtk_menu_shell_append(menu.shell, gtk_separator_menu_item_new());
+		append_label("Destination monitor");
+		populate_menu_with_monitors(-1, s->dst_monitor_names, s->n_dst_monitor_names,
+				(s->n_outputs ? s->outputs[0].monitor : NULL),
+				session_data | ITEM_DST_MONITOR);
+
+		if (n_sessions > 1) {
+			item = gtk_menu_item_new_with_label("Remove session");
+			connect_menu_item(item, session_data | ITEM_REMOVE_SESSION);
+			gtk_menu_shell_append(menu.shell, item);
+		}
+	}
+	if (n_sessions < MAX_SESSIONS) {
+		gtk_menu_shell_append(menu.shell, gtk_separator_menu_item_new());
+		item = gtk_menu_item_new_with_label("Add session");
+		connect_menu_item(item, ITEM_ADD_SESSION);
+		gtk_menu_shell_append(menu.shell, item);
+	}
+	gtk_widget_show_all(GTK_WIDGET(menu.shell));
 	menu.update_index = -1;
 
 }
@@ -414,7 +570,26 @@ init()
 	}
 	cursor_icon = gdk_cursor_new_for_display(gdisplay, GDK_X_CURSOR);
 
+	stats_init();
+	trace_init();
+	if (!record_init()) {
+		return FALSE;
+	}
+	if (config.trace_file || config.record_file) {
+		g_unix_signal_add(SIGINT,  on_terminate_signal, NULL);
+		g_unix_signal_add(SIGTERM, on_terminate_signal, NULL);
+	}
+
+#ifdef HAVE_WAYLAND
+	wayland = GDK_IS_WAYLAND_DISPLAY(gdisplay);
+	gboolean result = wayland ? wayland_init() : x11_init();
+#else
 	gboolean result = x11_init();
+#endif
+
+	// follow the changes of monitors (plugged, unplugged or reconfigured)
+	g_signal_connect(gdk_display_get_default_screen(gdisplay), "monitors-changed",
+			G_CALLBACK(on_monitors_changed), NULL);
 
 #ifdef HAVE_APPINDICATOR
 	if (result) {
@@ -471,9 +646,22 @@ select_monitor_by_name(GdkDisplay* dsp, const char* name,
 	return FALSE;
 }
 
+// return TRUE if 'rect' is not in the list of rectangles 'others'
+gboolean
+is_other_rect(const GdkRectangle* rect, const GdkRectangle* others, int n_others)
+{
+	int i;
+	for (i=0 ; i<n_others ; i++) {
+		if (!memcmp(rect, &others[i], sizeof(GdkRectangle))) {
+			return FALSE;
+		}
+	}
+	return TRUE;
+}
+
 gboolean
 select_rightmost_monitor_but(GdkDisplay* dsp, GdkMonitor** mon, GdkRectangle* rect,
-		const GdkRectangle* other_rect)
+		const GdkRectangle* other_rects, int n_others)
 {
 	int n = gdk_display_get_n_monitors(dsp);
 	int i;
@@ -484,7 +672,7 @@ select_rightmost_monitor_but(GdkDisplay* dsp, GdkMonitor** mon, GdkRectangle* re
 		GdkRectangle candidate_rect;
 		GdkMonitor* candidate_mon = gdk_display_get_monitor(dsp, i);
 		gdk_monitor_get_geometry(candidate_mon, &candidate_rect);
-		if (!other_rect || memcmp(&candidate_rect, other_rect, sizeof(GdkRectangle)))
+		if (is_other_rect(&candidate_rect, other_rects, n_others))
 		{
 			if ((found_monitor == NULL) ||
 			    (candidate_rect.x+candidate_rect.width > found_rect.x+found_rect.width))
@@ -498,7 +686,8 @@ select_rightmost_monitor_but(GdkDisplay* dsp, GdkMonitor** mon, GdkRectangle* re
 }
 
 gboolean
-select_any_monitor_but(GdkDisplay* dsp, GdkMonitor** mon, GdkRectangle* rect, const GdkRectangle* other_rect)
+select_any_monitor_but(GdkDisplay* dsp, GdkMonitor** mon, GdkRectangle* rect,
+		const GdkRectangle* other_rects, int n_others)
 {
 	int n = gdk_display_get_n_monitors(dsp);
 	int i;
@@ -507,7 +696,7 @@ select_any_monitor_but(GdkDisplay* dsp, GdkMonitor** mon, GdkRectangle* rect, co
 		GdkMonitor*  candidate_mon = gdk_display_get_monitor(dsp, i);
 		GdkRectangle candidate_rect;
 		gdk_monitor_get_geometry(candidate_mon, &candidate_rect);
-		if (!other_rect || memcmp(&candidate_rect, other_rect, sizeof(GdkRectangle)))
+		if (is_other_rect(&candidate_rect, other_rects, n_others))
 		{
 			return select_monitor(mon, rect, candidate_mon);
 		}
@@ -517,77 +706,313 @@ select_any_monitor_but(GdkDisplay* dsp, GdkMonitor** mon, GdkRectangle* rect, co
 
 
 //
-// select which monitor is going to be duplicated
+// select which monitors are going to be duplicated
 //
-// initialises:
-// 	src_rect
-// 	src_monitor
-// 	dst_rect
-// 	dst_monitor
+// initialises (in each session):
+// 	sources (monitor, rect & tile)
+// 	n_sources
+// 	mirror_width & mirror_height
+// 	outputs (monitor & rect)
+// 	n_outputs
+void
+unselect_monitors(struct session* sel)
+{
+	int i;
+	for (i=0 ; i<n_sessions ; i++)
+	{
+		struct session* s = &sel[i];
+		while (s->n_sources) {
+			s->n_sources--;
+			unselect_monitor(&s->sources[s->n_sources].monitor, &s->sources[s->n_sources].rect);
+			s->sources[s->n_sources].window = 0;
+		}
+		while (s->n_outputs) {
+			s->n_outputs--;
+			unselect_monitor(&s->outputs[s->n_outputs].monitor, &s->outputs[s->n_outputs].rect);
+		}
+	}
+}
+
+// return TRUE if a monitor is already a destination of another session
+gboolean
+is_dst_of_other_session(const struct session* sel, const struct session* s,
+		const GdkRectangle* rect)
+{
+	int i, j;
+	for (i=0 ; i<n_sessions ; i++)
+	{
+		const struct session* other = &sel[i];
+		if (other == s) {
+			continue;
+		}
+		for (j=0 ; j<other->n_outputs ; j++) {
+			if (!memcmp(rect, &other->outputs[j].rect, sizeof(GdkRectangle))) {
+				return TRUE;
+			}
+		}
+	}
+	return FALSE;
+}
+
+// select a source given by name: a monitor, an area of the screen
+// (WIDTHxHEIGHT+X+Y) or a window (@ID)
 gboolean
-select_monitors()
+select_source_by_name(const char* name, struct source* src)
 {
-	int n;
-	unselect_monitor(&src_monitor, &src_rect);
-	unselect_monitor(&dst_monitor, &dst_rect);
+	char buff[128];
+	int width, height, x, y;
+	char c;
 
-	n = gdk_display_get_n_monitors (gdisplay);
-	if ((n < 2) && !config.src_monitor_name) {
-		squint_error("There is only one monitor. What am I supposed to do?");
+	if (name[0] == '@')
+	{
+#ifdef HAVE_WAYLAND
+		if (wayland) {
+			squint_error("Windows cannot be captured on Wayland");
+			return FALSE;
+		}
+#endif
+		char* end;
+		src->window = strtoul(name + 1, &end, 0);
+		if (!*end && src->window && x11_get_window_rect(src->window, &src->rect)) {
+			return TRUE;
+		}
+		src->window = 0;
+		g_snprintf(buff, 128, "Window %s not found", name + 1);
+		squint_error(buff);
 		return FALSE;
 	}
 
-	// first we try to allocate the requested monitors
-	if (config.src_monitor_name
-		&& !select_monitor_by_name(gdisplay, config.src_monitor_name, &src_monitor, &src_rect)) {
+	if (sscanf(name, "%dx%d+%d+%d%c", &width, &height, &x, &y, &c) == 4)
+	{
+		if ((width <= 0) || (height <= 0)) {
+			g_snprintf(buff, 128, "Invalid area %s", name);
+			squint_error(buff);
 			return FALSE;
+		}
+		src->rect = (GdkRectangle){ x, y, width, height };
+		return TRUE;
+	}
+
+	return select_monitor_by_name(gdisplay, name, &src->monitor, &src->rect);
+}
+
+// get the geometry of the monitor of a source (the monitor that contains
+// the centre of an area or a window)
+void
+get_source_monitor_rect(const struct source* src, GdkRectangle* rect)
+{
+	if (src->monitor) {
+		*rect = src->rect;
+	} else {
+		GdkMonitor* monitor = gdk_display_get_monitor_at_point(gdisplay,
+				src->rect.x + src->rect.width / 2,
+				src->rect.y + src->rect.height / 2);
+		gdk_monitor_get_geometry(monitor, rect);
+	}
+}
+
+// size of the insets in the picture-in-picture layout (relative to their
+// source monitor) and margin around them
+#define PIP_RATIO	4
+#define PIP_MARGIN	16
+
+// compute the tiles of the sources of a session and the size of the mirror
+void
+layout_sources(struct session* s)
+{
+	int i;
+	if ((s->n_sources > 1) && (config.opt_layout == LAYOUT_PIP))
+	{
+		// the first source fills the mirror, the others are shrunk and
+		// stacked in its bottom-right corner
+		const GdkRectangle* main_rect = &s->sources[0].rect;
+		int y = main_rect->height;
+		s->sources[0].tile = (GdkRectangle){ 0, 0, main_rect->width, main_rect->height };
+		for (i=1 ; i<s->n_sources ; i++)
+		{
+			GdkRectangle* tile = &s->sources[i].tile;
+			tile->width  = MAX(1, s->sources[i].rect.width  / PIP_RATIO);
+			tile->height = MAX(1, s->sources[i].rect.height / PIP_RATIO);
+			y -= PIP_MARGIN + tile->height;
+			tile->x = main_rect->width - PIP_MARGIN - tile->width;
+			tile->y = MAX(0, y);
+		}
+		s->mirror_width  = main_rect->width;
+		s->mirror_height = main_rect->height;
+		return;
+	}
+
+	// tiles: the sources keep their size and are arranged in a grid whose
+	// cells are as large as the largest source
+	int columns = 1, cell_width = 0, cell_height = 0;
+	while (columns * columns < s->n_sources) {
+		columns++;
 	}
-	if (config.dst_monitor_name
-		&& !select_monitor_by_name(gdisplay, config.dst_monitor_name, &dst_monitor, &dst_rect)) {
+	for (i=0 ; i<s->n_sources ; i++) {
+		cell_width  = MAX(cell_width,  s->sources[i].rect.width);
+		cell_height = MAX(cell_height, s->sources[i].rect.height);
+	}
+	for (i=0 ; i<s->n_sources ; i++) {
+		s->sources[i].tile = (GdkRectangle){
+			(i % columns) * cell_width, (i / columns) * cell_height,
+			s->sources[i].rect.width,   s->sources[i].rect.height };
+	}
+	s->mirror_width  = MIN(columns, s->n_sources) * cell_width;
+	s->mirror_height = ((s->n_sources + columns - 1) / columns) * cell_height;
+}
+
+gboolean
+select_session_monitors(struct session* sel, struct session* s)
+{
+	int i, j, n_used = 0;
+	GdkRectangle used[MAX_SESSIONS * (MAX_SOURCES + MAX_OUTPUTS)];
+	GdkRectangle src_rects[MAX_SOURCES];
+	GdkRectangle* dst_rects;
+
+	// monitors already used by the other sessions (they are not autodetected)
+	for (i=0 ; i<n_sessions ; i++)
+	{
+		const struct session* other = &sel[i];
+		if (other == s) {
+			continue;
+		}
+		for (j=0 ; j<other->n_sources ; j++) {
+			get_source_monitor_rect(&other->sources[j], &used[n_used++]);
+		}
+		for (j=0 ; j<other->n_outputs ; j++) {
+			used[n_used++] = other->outputs[j].rect;
+		}
+	}
+	dst_rects = used + n_used;
+
+	// first we try to allocate the requested monitors
+	for (i=0 ; i<s->n_src_monitor_names ; i++)
+	{
+		struct source* src = &s->sources[s->n_sources];
+		if (!select_source_by_name(s->src_monitor_names[i], src)) {
 			return FALSE;
+		}
+		if (!is_other_rect(&src->rect, src_rects, s->n_sources)) {
+			// same monitor given twice
+			unselect_monitor(&src->monitor, &src->rect);
+			src->window = 0;
+			continue;
+		}
+		src_rects[s->n_sources++] = src->rect;
 	}
-	if (src_monitor && dst_monitor && !memcmp(&src_rect, &dst_rect, sizeof(GdkRectangle)))
+	for (i=0 ; i<s->n_dst_monitor_names ; i++)
 	{
-		squint_error("Source and destination both map the same screen area");
-		return FALSE;
+		struct output* o = &s->outputs[s->n_outputs];
+		if (!select_monitor_by_name(gdisplay, s->dst_monitor_names[i], &o->monitor, &o->rect)) {
+			return FALSE;
+		}
+		if (!is_other_rect(&o->rect, dst_rects, s->n_outputs)) {
+			// same monitor given twice
+			unselect_monitor(&o->monitor, &o->rect);
+			continue;
+		}
+		if (is_dst_of_other_session(sel, s, &o->rect)) {
+			squint_error("A destination monitor cannot be used by several sessions");
+			unselect_monitor(&o->monitor, &o->rect);
+			return FALSE;
+		}
+		dst_rects[s->n_outputs++] = o->rect;
+
+		if (!is_other_rect(&o->rect, src_rects, s->n_sources))
+		{
+			squint_error("Source and destination both map the same screen area");
+			return FALSE;
+		}
 	}
 
 	// if the source monitor is not yet decided, then use the rightmost monitor
-	if (src_monitor == NULL) {
-		select_rightmost_monitor_but(gdisplay, &src_monitor, &src_rect,
-				(dst_monitor ? &dst_rect : NULL));
+	if (!s->n_sources) {
+		if (select_rightmost_monitor_but(gdisplay, &s->sources[0].monitor, &s->sources[0].rect,
+				used, n_used + s->n_outputs)) {
+			s->n_sources = 1;
+		}
 	}
 
 	// if the destination_monitor is not yet decided, then use the first unused monitor
-	if (dst_monitor == NULL) {
-		select_any_monitor_but(gdisplay, &dst_monitor, &dst_rect,
-				(src_monitor ? &src_rect : NULL));
+	if (!s->n_outputs) {
+		for (i=0 ; i<s->n_sources ; i++) {
+			get_source_monitor_rect(&s->sources[i], &used[n_used++]);
+		}
+		if (select_any_monitor_but(gdisplay, &s->outputs[0].monitor, &s->outputs[0].rect,
+				used, n_used)) {
+			s->n_outputs = 1;
+		}
 	}
 
-	if (src_monitor && dst_monitor) {
+	if (s->n_sources && s->n_outputs) {
+		layout_sources(s);
 		return TRUE;
 	} else {
-		unselect_monitor(&src_monitor, &src_rect);
-		unselect_monitor(&dst_monitor, &dst_rect);
-
 		squint_error("Could not find any monitor to be cloned");
 		return FALSE;
 	}
 }
 
+// select the monitors of all sessions into 'sel' (which is either 'sessions'
+// or a scratch copy of it)
+gboolean
+select_monitors(struct session* sel)
+{
+	int n, i;
+	unselect_monitors(sel);
+
+	n = gdk_display_get_n_monitors (gdisplay);
+	if ((n < 2) && (n_sessions == 1) && !sel[0].n_src_monitor_names) {
+		squint_error("There is only one monitor. What am I supposed to do?");
+		return FALSE;
+	}
+
+	for (i=0 ; i<n_sessions ; i++)
+	{
+		if (!select_session_monitors(sel, &sel[i])) {
+			unselect_monitors(sel);
+			return FALSE;
+		}
+	}
+	return TRUE;
+}
+
 //
-// Prepare the window to host the duplicated screen (create the pixmap, subwindow)
+// Prepare the windows to host the duplicated screen (one per destination)
 //
 // initialises:
-// 	gtkwin
-// 	gdkwin
+// 	outputs (gtkwin & gdkwin) in each session
 //	fullscreen
 //
 void
-enable_window()
+enable_output_window(struct session* s, struct output* o)
 {
-	fullscreen = !config.opt_window;
+	const GdkRectangle* dst_rect = &o->rect;
+	GtkWidget* gtkwin;
+	GdkWindow* gdkwin;
+
+#ifdef HAVE_WAYLAND
+	if (fullscreen && wayland)
+	{
+		// popups cannot be positioned on Wayland, the window is made
+		// fullscreen on the destination monitor instead
+		gtkwin = gtk_window_new (GTK_WINDOW_TOPLEVEL);
+		gtk_window_set_decorated(GTK_WINDOW(gtkwin), FALSE);
 
+		int i, index = 0;
+		for (i=0 ; i<gdk_display_get_n_monitors(gdisplay) ; i++) {
+			if (gdk_display_get_monitor(gdisplay, i) == o->monitor) {
+				index = i;
+			}
+		}
+		gtk_window_fullscreen_on_monitor(GTK_WINDOW(gtkwin),
+				gdk_display_get_default_screen(gdisplay), index);
+
+		// create the gdkwindow
+		gtk_widget_realize(gtkwin);
+		gdkwin = gtk_widget_get_window(gtkwin);
+	} else
+#endif
 	if (fullscreen)
 	{
 		// create the window
@@ -595,10 +1020,10 @@ enable_window()
 
 		// resize it to the dimensions of the dst monitor
 		gtk_window_resize(GTK_WINDOW(gtkwin),
-				dst_rect.width, dst_rect.height);
+				dst_rect->width, dst_rect->height);
 
 		// move the window into the cover the destination screen
-		gtk_window_move(GTK_WINDOW(gtkwin), dst_rect.x, dst_rect.y);
+		gtk_window_move(GTK_WINDOW(gtkwin), dst_rect->x, dst_rect->y);
 
 		// create the gdkwindow
 		gtk_widget_realize(gtkwin);
@@ -612,16 +1037,16 @@ enable_window()
 		}
 
 		// resize the window
-		int w = src_rect.width;
-		int max_w = dst_rect.width - 100;
-		int h = src_rect.height;
-		int max_h = dst_rect.height - 100;
+		int w = s->mirror_width;
+		int max_w = dst_rect->width - 100;
+		int h = s->mirror_height;
+		int max_h = dst_rect->height - 100;
 		gtk_window_resize(GTK_WINDOW(gtkwin),
 			((w < max_w) ? w : max_w),
 			((h < max_h) ? h : max_h));
 
 		// move the window into the destination screen
-		gtk_window_move(GTK_WINDOW(gtkwin), dst_rect.x+50, dst_rect.y+50);
+		gtk_window_move(GTK_WINDOW(gtkwin), dst_rect->x+50, dst_rect->y+50);
 
 		// map my window
 		gtk_widget_show (gtkwin);
@@ -632,7 +1057,7 @@ enable_window()
 		g_signal_connect (gtkwin, "delete-event", G_CALLBACK (on_window_delete_event), NULL);
 
 		// - resize the window to src monitor size on double click
-		g_signal_connect (gtkwin, "button-press-event", G_CALLBACK (on_window_button_press_event), NULL);
+		g_signal_connect (gtkwin, "button-press-event", G_CALLBACK (on_window_button_press_event), s);
 		gdk_window_set_events (gdkwin, gdk_window_get_events(gdkwin) | GDK_BUTTON_PRESS_MASK);
 	}
 
@@ -642,16 +1067,45 @@ enable_window()
 	// override the cursor icon
 	gdk_window_set_cursor(gdkwin, cursor_icon);
 
-	// hide the window for the moment
-	do_hide();
+	o->gtkwin = gtkwin;
+	o->gdkwin = gdkwin;
+}
+
+void
+enable_window()
+{
+	fullscreen = !config.opt_window;
+
+	int i, j;
+	for (i=0 ; i<n_sessions ; i++)
+	{
+		struct session* s = &sessions[i];
+		for (j=0 ; j<s->n_outputs ; j++) {
+			enable_output_window(s, &s->outputs[j]);
+#ifdef HAVE_WAYLAND
+			if (!wayland)
+#endif
+			x11_connect_output_window(&s->outputs[j]);
+		}
+
+		// hide the windows for the moment
+		do_hide(s);
+	}
 }
 
 void
 disable_window()
 {
-	gtk_widget_destroy(gtkwin);
-	gdkwin = NULL;
-	gtkwin = NULL;
+	int i, j;
+	for (i=0 ; i<n_sessions ; i++)
+	{
+		struct session* s = &sessions[i];
+		for (j=0 ; j<s->n_outputs ; j++) {
+			gtk_widget_destroy(s->outputs[j].gtkwin);
+			s->outputs[j].gdkwin = NULL;
+			s->outputs[j].gtkwin = NULL;
+		}
+	}
 }
 
 gboolean
@@ -659,13 +1113,24 @@ squint_enable()
 {
 	if (!enabled)
 	{
-		if(select_monitors())
+		if(select_monitors(sessions))
 		{
 			enable_window();
 
-			x11_enable();
+			gboolean result;
+#ifdef HAVE_WAYLAND
+			if (wayland) {
+				result = wayland_enable();
+			} else
+#endif
+			result = x11_enable();
 
-			enabled = TRUE;
+			if (result) {
+				enabled = TRUE;
+			} else {
+				disable_window();
+				unselect_monitors(sessions);
+			}
 		}
 #ifdef HAVE_APPINDICATOR
 		refresh_app_indicator();
@@ -679,6 +1144,11 @@ squint_disable()
 {
 	enabled = FALSE;
 
+#ifdef HAVE_WAYLAND
+	if (wayland) {
+		wayland_disable();
+	} else
+#endif
 	x11_disable();
 
 	disable_window();
@@ -688,12 +1158,311 @@ squint_disable()
 #endif
 }
 
+// return TRUE if two selections of a session have the same sources (and
+// mirror size)
+gboolean
+is_same_sources(const struct session* a, const struct session* b)
+{
+	int i;
+	if (	   (a->n_sources != b->n_sources)
+		|| (a->mirror_width  != b->mirror_width)
+		|| (a->mirror_height != b->mirror_height))
+	{
+		return FALSE;
+	}
+	for (i=0 ; i<a->n_sources ; i++) {
+		if (	   (a->sources[i].window != b->sources[i].window)
+			|| memcmp(&a->sources[i].rect, &b->sources[i].rect, sizeof(GdkRectangle))
+			|| memcmp(&a->sources[i].tile, &b->sources[i].tile, sizeof(GdkRectangle)))
+		{
+			return FALSE;
+		}
+	}
+	return TRUE;
+}
+
+// return TRUE if the output 'index' of two selections of a session is the
+// same monitor (its geometry may differ)
+gboolean
+is_same_output(const struct session* a, const struct session* b, int index)
+{
+	return (index < a->n_outputs) && (index < b->n_outputs)
+		&& (a->outputs[index].monitor == b->outputs[index].monitor);
+}
+
+// return TRUE if two selections of monitors have the same geometry
+gboolean
+is_same_selection(const struct session* a, const struct session* b)
+{
+	int i, j;
+	for (i=0 ; i<n_sessions ; i++)
+	{
+		const struct session* s = &a[i];
+		const struct session* o = &b[i];
+		if (!is_same_sources(s, o) || (s->n_outputs != o->n_outputs)) {
+			return FALSE;
+		}
+		for (j=0 ; j<s->n_outputs ; j++) {
+			if (memcmp(&s->outputs[j].rect, &o->outputs[j].rect, sizeof(GdkRectangle))) {
+				return FALSE;
+			}
+		}
+	}
+	return TRUE;
+}
+
+// exchange the monitors selected in two copies of a session
+//
+// The windows stay with the outputs, except those of the outputs that are
+// the same monitor in both, which stay in 'a'.
+void
+swap_selection(struct session* a, struct session* b)
+{
+	struct session tmp = *a;
+	memcpy(a->sources, b->sources, sizeof(a->sources));
+	a->n_sources = b->n_sources;
+	a->mirror_width  = b->mirror_width;
+	a->mirror_height = b->mirror_height;
+	memcpy(a->outputs, b->outputs, sizeof(a->outputs));
+	a->n_outputs = b->n_outputs;
+
+	memcpy(b->sources, tmp.sources, sizeof(b->sources));
+	b->n_sources = tmp.n_sources;
+	b->mirror_width  = tmp.mirror_width;
+	b->mirror_height = tmp.mirror_height;
+	memcpy(b->outputs, tmp.outputs, sizeof(b->outputs));
+	b->n_outputs = tmp.n_outputs;
+
+	int i;
+	for (i=0 ; i<a->n_outputs ; i++) {
+		if (is_same_output(a, b, i)) {
+			a->outputs[i].gtkwin = b->outputs[i].gtkwin;
+			a->outputs[i].gdkwin = b->outputs[i].gdkwin;
+			b->outputs[i].gtkwin = NULL;
+			b->outputs[i].gdkwin = NULL;
+		}
+	}
+}
+
+// destroy the windows left in a selection
+void
+destroy_output_windows(struct session* sel)
+{
+	int i, j;
+	for (i=0 ; i<n_sessions ; i++) {
+		for (j=0 ; j<sel[i].n_outputs ; j++) {
+			struct output* o = &sel[i].outputs[j];
+			if (o->gtkwin) {
+				gtk_widget_destroy(o->gtkwin);
+				o->gtkwin = NULL;
+				o->gdkwin = NULL;
+			}
+		}
+	}
+}
+
+// apply a new selection of monitors to the running X11 mirror
+//
+// The windows of the new destinations are created first. The capture thread
+// then swaps the selection with 'next' (which receives the previous one) and
+// updates only the outputs that changed. Finally the windows of the removed
+// destinations are destroyed.
+//
+// return FALSE if the mirror must be restarted
+gboolean
+reconfigure_x11(struct session* next)
+{
+	int i, j;
+	for (i=0 ; i<n_sessions ; i++) {
+		for (j=0 ; j<next[i].n_outputs ; j++) {
+			if (!is_same_output(&sessions[i], &next[i], j)) {
+				enable_output_window(&next[i], &next[i].outputs[j]);
+			}
+		}
+	}
+
+	if (!x11_reconfigure(next)) {
+		destroy_output_windows(next);
+		return FALSE;
+	}
+	destroy_output_windows(next);
+
+	for (i=0 ; i<n_sessions ; i++)
+	{
+		struct session* s = &sessions[i];
+		for (j=0 ; j<s->n_outputs ; j++)
+		{
+			struct output* o = &s->outputs[j];
+			if (!is_same_output(s, &next[i], j)) {
+				x11_connect_output_window(o);
+				if (s->raised) {
+					show_output(o);
+				} else {
+					hide_output(o);
+				}
+			} else if (fullscreen && !gdk_rectangle_equal(&o->rect, &next[i].outputs[j].rect)) {
+				// the destination was resized or moved
+				gtk_window_resize(GTK_WINDOW(o->gtkwin), o->rect.width, o->rect.height);
+				gtk_window_move(GTK_WINDOW(o->gtkwin), o->rect.x, o->rect.y);
+			}
+		}
+	}
+	return TRUE;
+}
+
+// the monitors were reconfigured
+//
+// The monitors are selected again into a scratch copy of the sessions (the
+// capture thread is still reading them). With X11, the new selection is
+// applied to the running mirror (only the outputs that changed are
+// recreated). With Wayland, the mirror keeps running if the selection did not
+// change and is restarted otherwise. It is disabled if there is no suitable
+// monitor anymore.
+gboolean
+squint_reconfigure(gpointer data)
+{
+	reconfigure_pending = 0;
+	if (!enabled) {
+#ifdef HAVE_APPINDICATOR
+		refresh_app_indicator();
+#endif
+		return G_SOURCE_REMOVE;
+	}
+
+	struct session next[MAX_SESSIONS];
+	int i;
+	memset(next, 0, sizeof(next));
+	for (i=0 ; i<n_sessions ; i++)
+	{
+		memcpy(next[i].src_monitor_names, sessions[i].src_monitor_names,
+				sizeof(next[i].src_monitor_names));
+		next[i].n_src_monitor_names = sessions[i].n_src_monitor_names;
+		memcpy(next[i].dst_monitor_names, sessions[i].dst_monitor_names,
+				sizeof(next[i].dst_monitor_names));
+		next[i].n_dst_monitor_names = sessions[i].n_dst_monitor_names;
+	}
+
+	gboolean selected = select_monitors(next);
+	gboolean applied = FALSE;
+	if (selected) {
+#ifdef HAVE_WAYLAND
+		// (the viewports follow the size of the windows)
+		if (wayland) {
+			applied = is_same_selection(sessions, next);
+		} else
+#endif
+		applied = reconfigure_x11(next);
+	}
+	unselect_monitors(next);
+
+	if (applied) {
+#ifdef HAVE_APPINDICATOR
+		refresh_app_indicator();
+#endif
+		return G_SOURCE_REMOVE;
+	}
+
+	squint_disable();
+	if (selected) {
+		squint_enable();
+	}
+	return G_SOURCE_REMOVE;
+}
+
+void
+on_monitors_changed(GdkScreen* screen, gpointer data)
+{
+	// (there may be several notifications for a single change)
+	if (!reconfigure_pending) {
+		reconfigure_pending = g_idle_add(squint_reconfigure, NULL);
+	}
+}
+
+
+static gchar* scale_name = NULL;
+static gchar* filter_name = NULL;
+static gchar* flip_name = NULL;
+static gchar* layout_name = NULL;
+static gchar** mirror_specs = NULL;
+
+// return the index of 'name' in 'names' (or -1 if not found)
+int
+parse_keyword(const char* name, const char* const* names)
+{
+	int i;
+	for (i=0 ; names[i] ; i++) {
+		if (!strcmp(name, names[i])) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+// parse a list of monitor names separated by 'separator' ('-' or empty
+// names are ignored)
+gboolean
+parse_monitor_names(const char* list, const char* separator,
+		const char** names, int* n_names, int max_names)
+{
+	gboolean result = TRUE;
+	gchar** items = g_strsplit(list, separator, -1);
+	int i;
+	for (i=0 ; items[i] ; i++)
+	{
+		if (!*items[i] || !strcmp("-", items[i])) {
+			continue;
+		}
+		if (*n_names == max_names) {
+			result = FALSE;
+			break;
+		}
+		names[(*n_names)++] = g_strdup(items[i]);
+	}
+	g_strfreev(items);
+	return result;
+}
+
+// parse a session given as SRC[+SRC...]:DST[,DST...] ('-' or empty for
+// autodetection)
+gboolean
+parse_session(const char* spec, struct session* s)
+{
+	gboolean result = TRUE;
+	gchar** parts = g_strsplit(spec, ":", 2);
+
+	if (parts[0]) {
+		result = parse_monitor_names(parts[0], "+", s->src_monitor_names,
+				&s->n_src_monitor_names, MAX_SOURCES);
+	}
+	if (result && parts[0] && parts[1]) {
+		result = parse_monitor_names(parts[1], ",", s->dst_monitor_names,
+				&s->n_dst_monitor_names, MAX_OUTPUTS);
+	}
+	g_strfreev(parts);
+	return result;
+}
 
 GOptionEntry option_entries[] = {
+  { "direct",	0,	0,	G_OPTION_ARG_NONE,	&config.opt_direct,	"Copy the source monitor straight into the window (without intermediate pixmap)", NULL},
   { "disable",	'd',	0,	G_OPTION_ARG_NONE,	&config.opt_disable,	"Do not enable screen duplication at startup", NULL},
-  { "limit",	'l',	0,	G_OPTION_ARG_INT,	&config.opt_limit,	"Limit refresh rate to N frames per second", "N"},
+  { "filter",	0,	0,	G_OPTION_ARG_STRING,	&filter_name,	"Filter used when scaling or rotating: nearest, bilinear (default) or convolution", "FILTER"},
+  { "flip",	0,	0,	G_OPTION_ARG_STRING,	&flip_name,	"Flip the mirror: horizontal, vertical or both", "DIRECTION"},
+  { "layout",	0,	0,	G_OPTION_ARG_STRING,	&layout_name,	"Layout of the source monitors composited in a mirror: tiles (default) or pip", "LAYOUT"},
+  { "limit",	'l',	0,	G_OPTION_ARG_INT,	&config.opt_limit,	"Limit refresh rate to N frames per second (default: refresh rate of the destination monitor)", "N"},
+  { "mirror",	0,	0,	G_OPTION_ARG_STRING_ARRAY, &mirror_specs,	"Add a mirror session from the monitors SRC to the monitors DST (may be repeated)", "SRC[+SRC...]:DST[,DST...]"},
   { "passive",	'p',	0,	G_OPTION_ARG_NONE,	&config.opt_passive,	"Do not raise the window on user activity (has no effects in fullscreen mode)", NULL},
+  { "present",	0,	0,	G_OPTION_ARG_NONE,	&config.opt_present,	"Double-buffer the window and update it with the Present extension (tear-free, synchronised with the vertical blank)", NULL},
   { "rate",	'r',	0,	G_OPTION_ARG_INT,	&config.opt_rate,	"Use fixed refresh rate of N frames per second", "N"},
+  { "record",	0,	0,	G_OPTION_ARG_FILENAME,	&config.record_file,	"Record the events received from the display server into FILE", "FILE"},
+  { "replay",	0,	0,	G_OPTION_ARG_FILENAME,	&config.replay_file,	"Replay the events recorded in FILE (instead of tracking the display server)", "FILE"},
+  { "replay-fast", 0,	0,	G_OPTION_ARG_NONE,	&config.opt_replay_fast, "Replay the events as fast as possible (instead of the original speed)", NULL},
+  { "rotate",	0,	0,	G_OPTION_ARG_INT,	&config.opt_rotate,	"Rotate the mirror clockwise by N degrees (0, 90, 180 or 270)", "N"},
+  { "scale",	0,	0,	G_OPTION_ARG_STRING,	&scale_name,	"Scale the mirror to the destination: none (default), fit, fill or stretch", "MODE"},
+  { "shm",	0,	0,	G_OPTION_ARG_NONE,	&config.opt_shm,	"Capture the source monitor into shared memory (MIT-SHM) instead of copying it on the server side", NULL},
+  { "stats-fd",	0,	0,	G_OPTION_ARG_INT,	&config.opt_stats_fd,	"Write frame statistics (JSON lines) into file descriptor FD", "FD"},
+  { "stats-interval", 0, 0,	G_OPTION_ARG_INT,	&config.opt_stats_interval, "Write the statistics every N milliseconds (default 1000)", "N"},
+  { "tile-hash", 0,	0,	G_OPTION_ARG_NONE,	&config.opt_tile_hash,	"In fixed-rate mode, refresh only the tiles whose content changed (implies --shm)", NULL},
+  { "trace",	0,	0,	G_OPTION_ARG_FILENAME,	&config.trace_file,	"Record a trace of the capture pipeline, dumped into FILE on SIGUSR1 and at exit", "FILE"},
   { "version",	'v',	0,	G_OPTION_ARG_NONE,	&config.opt_version,	"Display version information and exit", NULL},
   { "window",	'w',	0,	G_OPTION_ARG_NONE,	&config.opt_window,	"Run inside a window instead of going fullscreen", NULL},
   { NULL }
@@ -705,14 +1474,22 @@ main (int argc, char *argv[])
 	GError *err = NULL;
 	GOptionContext *context;
 
+	x11_init_threads();
+#ifndef HAVE_WAYLAND
+	// (the X11 backend is the only one supported)
+	gdk_set_allowed_backends("x11");
+#endif
+
 	memset(&config, 0, sizeof(config));
 	config.opt_limit = -1;
+	config.opt_stats_fd = -1;
+	config.opt_stats_interval = 1000;
 
 	context = g_option_context_new (NULL);
 	g_option_context_add_main_entries (context, option_entries, NULL);
 	g_option_context_add_group (context, gtk_get_option_group (TRUE));
 
-	if (!gtk_init_with_args (&argc, &argv, "[SourceMonitor [DestinationMonitor]]", option_entries, NULL, &err))
+	if (!gtk_init_with_args (&argc, &argv, "[SourceMonitor[+SourceMonitor...] [DestinationMonitor...]]", option_entries, NULL, &err))
 	{
 		squint_error(err->message);
 		return 1;
@@ -725,22 +1502,85 @@ main (int argc, char *argv[])
 		return 0;
 	}
 
+	if (config.opt_stats_interval <= 0) {
+		squint_error("invalid statistics interval");
+		return 1;
+	}
+
+	if (scale_name) {
+		static const char* const names[] = {"none", "fit", "fill", "stretch", NULL};
+		config.opt_scale = parse_keyword(scale_name, names);
+		if (config.opt_scale < 0) {
+			squint_error("invalid scaling mode");
+			return 1;
+		}
+	}
+	config.opt_filter = FILTER_BILINEAR;
+	if (filter_name) {
+		static const char* const names[] = {"nearest", "bilinear", "convolution", NULL};
+		config.opt_filter = parse_keyword(filter_name, names);
+		if (config.opt_filter < 0) {
+			squint_error("invalid filter");
+			return 1;
+		}
+	}
+	if (flip_name) {
+		static const char* const names[] = {"horizontal", "vertical", "both", NULL};
+		int flip = parse_keyword(flip_name, names);
+		if (flip < 0) {
+			squint_error("invalid flip direction");
+			return 1;
+		}
+		config.opt_flip_h = (flip != 1);
+		config.opt_flip_v = (flip != 0);
+	}
+	if (layout_name) {
+		static const char* const names[] = {"tiles", "pip", NULL};
+		config.opt_layout = parse_keyword(layout_name, names);
+		if (config.opt_layout < 0) {
+			squint_error("invalid layout");
+			return 1;
+		}
+	}
+	if ((config.opt_rotate % 90) || (config.opt_rotate < 0) || (config.opt_rotate >= 360)) {
+		squint_error("invalid rotation");
+		return 1;
+	}
+
 	// TODO: manage args w/ GApplication
-	switch (argc)
+	if (argc > 2 + MAX_OUTPUTS) {
+		squint_error("invalid arguments");
+		return 1;
+	}
+	int i;
+	if ((argc >= 2) || !mirror_specs)
 	{
-		case 3:
-			if (strcmp("-", argv[2])) {
-				config.dst_monitor_name = g_strdup(argv[2]);
-			}
-		case 2:
-			if (strcmp("-", argv[1])) {
-				config.src_monitor_name = g_strdup(argv[1]);
+		// first session given by the positional arguments
+		struct session* s = &sessions[n_sessions++];
+		if ((argc >= 2) && !parse_monitor_names(argv[1], "+", s->src_monitor_names,
+					&s->n_src_monitor_names, MAX_SOURCES)) {
+			squint_error("too many source monitors");
+			return 1;
+		}
+		for (i=2 ; i<argc ; i++) {
+			// '-' is accepted only as the single destination
+			if (strcmp("-", argv[i])) {
+				s->dst_monitor_names[s->n_dst_monitor_names++] = g_strdup(argv[i]);
+			} else if (argc > 3) {
+				squint_error("invalid arguments");
+				return 1;
 			}
-		case 1:
-			break;
-		default:
-			squint_error("invalid arguments");
+		}
+	}
+	for (i=0 ; mirror_specs && mirror_specs[i] ; i++) {
+		if (n_sessions == MAX_SESSIONS) {
+			squint_error("too many sessions");
+			return 1;
+		}
+		if (!parse_session(mirror_specs[i], &sessions[n_sessions++])) {
+			squint_error("invalid mirror session");
 			return 1;
+		}
 	}
 
 	// initialisation
@@ -748,9 +1588,37 @@ main (int argc, char *argv[])
 		return 1;
 	}
 
+	// windows to be picked with the mouse
+	int j;
+	for (i=0 ; i<n_sessions ; i++) {
+		struct session* s = &sessions[i];
+		for (j=0 ; j<s->n_src_monitor_names ; j++) {
+			if (!strcmp(s->src_monitor_names[j], "@pick")) {
+#ifdef HAVE_WAYLAND
+				if (wayland) {
+					squint_error("Windows cannot be picked on Wayland");
+					return 1;
+				}
+#endif
+				gulong window = x11_pick_window();
+				if (!window) {
+					squint_error("No window was picked");
+					return 1;
+				}
+				g_free((gpointer)s->src_monitor_names[j]);
+				s->src_monitor_names[j] = g_strdup_printf("@0x%lx", window);
+			}
+		}
+	}
+
 	// activation
 	if (!config.opt_disable) {
-		squint_enable();
+		if (!squint_enable() && config.replay_file) {
+			// nothing to replay (the error is reported by an idle
+			// callback)
+			while (g_main_context_iteration(NULL, FALSE));
+			return 1;
+		}
 	}
 
 	return g_application_run(gtkapp, argc, argv);
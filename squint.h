@@ -3,33 +3,189 @@
 
 
 
+// maximum number of destination monitors (per session)
+#define MAX_OUTPUTS 8
+
+// maximum number of mirror sessions
+#define MAX_SESSIONS 4
+
+// maximum number of source monitors composited in a mirror (per session)
+#define MAX_SOURCES 4
+
 // Config
 extern struct config {
-	const char* src_monitor_name;
-	const char* dst_monitor_name;
+	const char* trace_file;
+	const char* record_file;
+	const char* replay_file;
 
 	gboolean opt_version, opt_window, opt_disable, opt_passive;
 	gint opt_limit, opt_rate;
+	gint opt_stats_fd, opt_stats_interval;
+	gboolean opt_replay_fast, opt_shm, opt_tile_hash, opt_present, opt_direct;
+
+	// output transformation
+	gint opt_scale, opt_rotate, opt_filter;
+	gboolean opt_flip_h, opt_flip_v;
+
+	// layout of the composited sources
+	gint opt_layout;
 } config;
 
+enum {
+	SCALE_NONE,
+	SCALE_FIT,
+	SCALE_FILL,
+	SCALE_STRETCH,
+};
+
+enum {
+	LAYOUT_TILES,
+	LAYOUT_PIP,
+};
+
+enum {
+	FILTER_NEAREST,
+	FILTER_BILINEAR,
+	FILTER_CONVOLUTION,
+};
+
 
 // State
 extern gboolean enabled;
 extern gboolean fullscreen;
-extern gboolean raised;
 
-extern GtkWidget* gtkwin;
-extern GdkWindow* gdkwin;
 extern GdkDisplay* gdisplay;
 
-extern GdkRectangle src_rect, dst_rect, active_window_rect;
+extern GdkRectangle active_window_rect;
+
+// Destination of a mirror
+struct output {
+	GdkMonitor* monitor;
+	GdkRectangle rect;	// geometry of the monitor (not of the window)
+	GtkWidget* gtkwin;
+	GdkWindow* gdkwin;
+};
+
+// Source of a mirror: a monitor, an arbitrary area or a window
+struct source {
+	GdkMonitor* monitor;	// (NULL if not a monitor)
+	gulong window;		// tracked window (0 if not a window)
+	GdkRectangle rect;	// captured area (root window coordinates)
+	GdkRectangle tile;	// area where it is drawn (mirror coordinates)
+};
+
+// Mirror session: one or more source monitors (composited according to
+// config.opt_layout) displayed in one or more destination monitors (the
+// sources are captured once)
+struct session {
+	// requested monitors (empty for autodetection)
+	const char* src_monitor_names[MAX_SOURCES];
+	int n_src_monitor_names;
+	const char* dst_monitor_names[MAX_OUTPUTS];
+	int n_dst_monitor_names;
 
-void squint_show();
-void squint_hide();
+	struct source sources[MAX_SOURCES];
+	int n_sources;
+	int mirror_width, mirror_height;	// (bounding box of the tiles)
+	struct output outputs[MAX_OUTPUTS];
+	int n_outputs;
+	gboolean raised;
+};
+extern struct session sessions[MAX_SESSIONS];
+extern int n_sessions;
+
+void squint_show(struct session* s);
+void squint_hide(struct session* s);
+gboolean squint_enable();
 void squint_disable();
+void squint_quit();
 
 void squint_error(const char* msg);
+gboolean is_same_sources(const struct session* a, const struct session* b);
+gboolean is_same_output(const struct session* a, const struct session* b, int index);
+gboolean is_same_selection(const struct session* a, const struct session* b);
+void swap_selection(struct session* a, struct session* b);
+
+// Damage region (set of disjoint rectangles)
+#define REGION_MAX_RECTS 16
+struct region {
+	int n;
+	GdkRectangle rects[REGION_MAX_RECTS];
+};
+
+void region_clear(struct region* rg);
+gboolean region_is_empty(const struct region* rg);
+void region_add(struct region* rg, const GdkRectangle* rect);
+void region_union(struct region* rg, const struct region* other);
+int  region_area(const struct region* rg);
+
+// Statistics
+void stats_init();
+void stats_frame(guint64 bytes);
+void stats_coalesced();
+void stats_missed_deadline();
+void stats_cursor(guint64 bytes);
+void stats_allocation();
+void stats_latency(int ms);
+void stats_set_request_counter(guint64 (*counter)());
+void stats_watch_context(GMainContext* context);
+
+// Frame pacing
+void pacing_init(GMainContext* context, void (*frame)(), void (*sync)());
+void pacing_set_limit(int fps);
+void pacing_set_refresh_rate(double hz);
+void pacing_vblank(gint64 ust);
+gboolean pacing_schedule();
+void pacing_cancel();
+
+// Tile-hash change detection
+void tiles_init(int width, int height);
+void tiles_update(const char* data, int stride, int bytes_per_pixel,
+		int origin_x, int origin_y, struct region* changed);
+void tiles_free();
 
+// Tracer
+void trace_init();
+void trace_begin(const char* name);
+void trace_end(const char* name);
+void trace_dump();
+
+// Event recorder
+enum {
+	RECORD_DAMAGE = 1,
+	RECORD_MOTION,
+	RECORD_CURSOR,
+	RECORD_ACTIVE_WINDOW,
+};
+
+struct record {
+	guint32	time;		// ms since the start of the recording
+	guint32	timestamp;	// display server timestamp (damage only)
+	guint8	type;
+	guint8	more;		// more damage events follow (damage only)
+	guint8	pad[2];
+	gint32	x, y;		// (32-bit: the root window may exceed 32767 px)
+	guint32	width, height;
+};
+
+gboolean record_init();
+void record_damage(guint32 timestamp, const GdkRectangle* area, gboolean more);
+void record_motion(const GdkPoint* pos);
+void record_cursor();
+void record_active_window(const GdkRectangle* rect);
+struct record* record_load(const char* path, int* count);
+
+void x11_init_threads();
 gboolean x11_init();
-void x11_enable();
+gboolean x11_enable();
 void x11_disable();
+void x11_connect_output_window(struct output* out);
+gboolean x11_reconfigure(struct session* selection);
+gboolean x11_get_window_rect(gulong window, GdkRectangle* r);
+gulong x11_pick_window();
+
+#ifdef HAVE_WAYLAND
+gboolean wayland_init();
+gboolean wayland_enable();
+void wayland_disable();
+#endif
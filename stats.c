@@ -0,0 +1,264 @@
+#include "config.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+#include "squint.h"
+
+//
+// Frame statistics
+//
+// Counters are accumulated over an interval of config.opt_stats_interval
+// milliseconds, then written as a JSON line into config.opt_stats_fd and
+// reset.
+//
+
+// upper bounds (inclusive) of the latency histogram buckets (in ms), the last
+// bucket counts all the frames above the last bound
+static const int latency_bounds[] = { 1, 2, 4, 8, 16, 32, 64, 128, 256, 512 };
+#define LATENCY_BUCKETS (G_N_ELEMENTS(latency_bounds) + 1)
+
+static struct stats {
+	guint64 frames;
+	guint64 coalesced;
+	guint64 missed;
+	guint64 bytes;
+	guint64 cursor_updates;
+	guint64 allocations;
+	guint64 wakeups;
+	guint64 latency[LATENCY_BUCKETS];
+	int     latency_max;
+} stats;
+
+// (updated by the capture thread, reported by the GTK thread)
+G_LOCK_DEFINE_STATIC(stats);
+
+static gint64 stats_start = 0;
+static guint  stats_timer = 0;
+
+static guint64 (*request_counter)() = NULL;
+static guint64 last_requests = 0;
+static guint64 last_cpu_usec = 0;
+
+// cpu time (user+system) consumed by the process (in µs)
+static guint64
+stats_cpu_usec()
+{
+	struct rusage ru;
+	if (getrusage(RUSAGE_SELF, &ru)) {
+		return 0;
+	}
+	return    (guint64)(ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * G_USEC_PER_SEC
+		+ ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+}
+
+// register the function returning the number of requests sent to the display
+// server
+void
+stats_set_request_counter(guint64 (*counter)())
+{
+	request_counter = counter;
+	last_requests = counter();
+}
+
+void
+stats_frame(guint64 bytes)
+{
+	G_LOCK(stats);
+	stats.frames++;
+	stats.bytes += bytes;
+	G_UNLOCK(stats);
+}
+
+void
+stats_coalesced()
+{
+	G_LOCK(stats);
+	stats.coalesced++;
+	G_UNLOCK(stats);
+}
+
+// a frame was not ready before the vertical blank it was scheduled for
+void
+stats_missed_deadline()
+{
+	G_LOCK(stats);
+	stats.missed++;
+	G_UNLOCK(stats);
+}
+
+void
+stats_cursor(guint64 bytes)
+{
+	G_LOCK(stats);
+	stats.cursor_updates++;
+	stats.bytes += bytes;
+	G_UNLOCK(stats);
+}
+
+// the capture buffers were (re)allocated
+void
+stats_allocation()
+{
+	G_LOCK(stats);
+	stats.allocations++;
+	G_UNLOCK(stats);
+}
+
+void
+stats_latency(int ms)
+{
+	unsigned int i;
+	for (i=0 ; i<G_N_ELEMENTS(latency_bounds) ; i++) {
+		if (ms <= latency_bounds[i]) {
+			break;
+		}
+	}
+	G_LOCK(stats);
+	stats.latency[i]++;
+	stats.latency_max = MAX(stats.latency_max, ms);
+	G_UNLOCK(stats);
+}
+
+//
+// Main loop wakeups
+//
+// a dummy source whose check() function is called once per iteration of the
+// main loop (after each poll)
+//
+static gboolean
+wakeup_source_prepare(GSource* source, gint* timeout)
+{
+	*timeout = -1;
+	return FALSE;
+}
+
+static gboolean
+wakeup_source_check(GSource* source)
+{
+	G_LOCK(stats);
+	stats.wakeups++;
+	G_UNLOCK(stats);
+	return FALSE;
+}
+
+static gboolean
+wakeup_source_dispatch(GSource* source, GSourceFunc callback, gpointer user_data)
+{
+	return G_SOURCE_CONTINUE;
+}
+
+static GSourceFuncs wakeup_source_funcs = {
+	wakeup_source_prepare,
+	wakeup_source_check,
+	wakeup_source_dispatch,
+	NULL,
+};
+
+gboolean
+stats_report(gpointer data)
+{
+	gint64 now = g_get_monotonic_time();
+	double elapsed = (now - stats_start) / (double) G_USEC_PER_SEC;
+	char buff[1024];
+	int len;
+	unsigned int i;
+
+	if (elapsed <= 0) {
+		return G_SOURCE_CONTINUE;
+	}
+
+	guint64 requests = request_counter ? request_counter() : 0;
+	guint64 cpu_usec = stats_cpu_usec();
+
+	// take the counters of the interval
+	struct stats cur;
+	G_LOCK(stats);
+	cur = stats;
+	memset(&stats, 0, sizeof(stats));
+	G_UNLOCK(stats);
+
+	len = g_snprintf(buff, sizeof(buff),
+		"{\"time\":%" G_GINT64_FORMAT ",\"interval\":%.3f"
+		",\"frames\":%" G_GUINT64_FORMAT ",\"fps\":%.2f"
+		",\"coalesced\":%" G_GUINT64_FORMAT
+		",\"missed_deadlines\":%" G_GUINT64_FORMAT
+		",\"bytes\":%" G_GUINT64_FORMAT
+		",\"cursor_updates\":%" G_GUINT64_FORMAT
+		",\"allocations\":%" G_GUINT64_FORMAT
+		",\"wakeups\":%" G_GUINT64_FORMAT ",\"wakeups_per_sec\":%.2f"
+		",\"requests\":%" G_GUINT64_FORMAT
+		",\"cpu_ms\":%.3f"
+		",\"latency_ms\":{\"max\":%d,\"le\":[",
+		g_get_real_time() / 1000, elapsed,
+		cur.frames, cur.frames / elapsed,
+		cur.coalesced,
+		cur.missed,
+		cur.bytes,
+		cur.cursor_updates,
+		cur.allocations,
+		cur.wakeups, cur.wakeups / elapsed,
+		requests - last_requests,
+		(cpu_usec - last_cpu_usec) / 1000.0,
+		cur.latency_max);
+
+	for (i=0 ; i<G_N_ELEMENTS(latency_bounds) ; i++) {
+		len += g_snprintf(buff+len, sizeof(buff)-len, "%s%d",
+				(i ? "," : ""), latency_bounds[i]);
+	}
+	len += g_snprintf(buff+len, sizeof(buff)-len, "],\"count\":[");
+	for (i=0 ; i<LATENCY_BUCKETS ; i++) {
+		len += g_snprintf(buff+len, sizeof(buff)-len, "%s%" G_GUINT64_FORMAT,
+				(i ? "," : ""), cur.latency[i]);
+	}
+	len += g_snprintf(buff+len, sizeof(buff)-len, "]}}\n");
+
+	if (write(config.opt_stats_fd, buff, len) < 0)
+	{
+		char msg[128];
+		g_snprintf(msg, sizeof(msg), "cannot write statistics: %s", strerror(errno));
+		squint_error(msg);
+		stats_timer = 0;
+		return G_SOURCE_REMOVE;
+	}
+
+	stats_start = now;
+	last_requests = requests;
+	last_cpu_usec = cpu_usec;
+	return G_SOURCE_CONTINUE;
+}
+
+// count the wakeups of a main context (NULL for the default one)
+void
+stats_watch_context(GMainContext* context)
+{
+	if (config.opt_stats_fd < 0) {
+		return;
+	}
+
+	GSource* source = g_source_new(&wakeup_source_funcs, sizeof(GSource));
+	g_source_attach(source, context);
+	g_source_unref(source);
+}
+
+void
+stats_init()
+{
+	if (config.opt_stats_fd < 0) {
+		return;
+	}
+
+	// do not get killed if the reader goes away (write() will fail with
+	// EPIPE instead)
+	signal(SIGPIPE, SIG_IGN);
+
+	stats_watch_context(NULL);
+
+	stats_start = g_get_monotonic_time();
+	last_cpu_usec = stats_cpu_usec();
+	stats_timer = g_timeout_add(config.opt_stats_interval, stats_report, NULL);
+}
@@ -0,0 +1,226 @@
+#include "config.h"
+
+#include <string.h>
+
+#include "squint.h"
+
+//
+// Tile-hash change detection
+//
+// The frame is split into tiles of TILE_SIZE×TILE_SIZE pixels. Each tile is
+// hashed and compared with its hash in the previous frame, so that only the
+// tiles that actually changed are pushed to the window.
+//
+// On large frames the tile rows are hashed in parallel by a thread pool.
+//
+
+#define TILE_SIZE	64
+
+// frames larger than this (in pixels) are hashed by the thread pool
+#define TILES_PARALLEL_THRESHOLD	(1920*1080)
+
+static int tiles_x = 0, tiles_y = 0;
+static int frame_width = 0, frame_height = 0;
+static guint64* tile_hashes = NULL;
+static guint8*  tile_changed = NULL;
+static gboolean tile_hashes_valid = FALSE;
+
+static GThreadPool* pool = NULL;
+static int n_jobs = 1;
+
+// frame being processed by the workers
+static struct {
+	const char* data;
+	int stride;
+	int bytes_per_pixel;
+
+	volatile gint pending;
+	GMutex mutex;
+	GCond  done;
+} job;
+
+#define HASH_PRIME1	0x9e3779b185ebca87ULL
+#define HASH_PRIME2	0xc2b2ae3d27d4eb4fULL
+
+// hash a rectangle of pixels
+//
+// the rows are processed as 64-bit words in four independent lanes so that
+// the compiler can vectorise the inner loop
+static guint64
+tile_hash(const char* data, int stride, int width_bytes, int height)
+{
+	guint64 h0 = HASH_PRIME1, h1 = HASH_PRIME2, h2 = ~HASH_PRIME1, h3 = ~HASH_PRIME2;
+	int y;
+
+	for (y=0 ; y<height ; y++)
+	{
+		const char* row = data + y * stride;
+		int n = width_bytes / 8;
+		int i;
+		guint64 w[4];
+
+		for (i=0 ; i+4<=n ; i+=4)
+		{
+			memcpy(w, row + i*8, sizeof(w));
+			h0 = (h0 ^ w[0]) * HASH_PRIME1;
+			h1 = (h1 ^ w[1]) * HASH_PRIME1;
+			h2 = (h2 ^ w[2]) * HASH_PRIME1;
+			h3 = (h3 ^ w[3]) * HASH_PRIME1;
+		}
+		for ( ; i<n ; i++)
+		{
+			memcpy(w, row + i*8, 8);
+			h0 = (h0 ^ w[0]) * HASH_PRIME2;
+		}
+		if (width_bytes % 8)
+		{
+			w[0] = 0;
+			memcpy(w, row + n*8, width_bytes % 8);
+			h1 = (h1 ^ w[0]) * HASH_PRIME2;
+		}
+	}
+
+	guint64 h = h0 ^ (h1 << 1 | h1 >> 63) ^ (h2 << 7 | h2 >> 57) ^ (h3 << 13 | h3 >> 51);
+	h ^= h >> 33;
+	h *= HASH_PRIME2;
+	h ^= h >> 29;
+	return h;
+}
+
+// hash the tile rows [first, last[ and flag the tiles that changed
+static void
+tiles_hash_rows(int first, int last)
+{
+	int tx, ty;
+	for (ty=first ; ty<last ; ty++)
+	{
+		int y = ty * TILE_SIZE;
+		int h = MIN(TILE_SIZE, frame_height - y);
+
+		for (tx=0 ; tx<tiles_x ; tx++)
+		{
+			int x = tx * TILE_SIZE;
+			int w = MIN(TILE_SIZE, frame_width - x);
+			int i = ty * tiles_x + tx;
+
+			guint64 hash = tile_hash(
+				job.data + y * job.stride + x * job.bytes_per_pixel,
+				job.stride, w * job.bytes_per_pixel, h);
+
+			tile_changed[i] = !tile_hashes_valid || (hash != tile_hashes[i]);
+			tile_hashes[i] = hash;
+		}
+	}
+}
+
+static void
+tiles_worker(gpointer data, gpointer user_data)
+{
+	int index = GPOINTER_TO_INT(data) - 1;
+	int first = tiles_y *  index      / n_jobs;
+	int last  = tiles_y * (index + 1) / n_jobs;
+
+	tiles_hash_rows(first, last);
+
+	if (g_atomic_int_dec_and_test(&job.pending)) {
+		g_mutex_lock(&job.mutex);
+		g_cond_signal(&job.done);
+		g_mutex_unlock(&job.mutex);
+	}
+}
+
+void
+tiles_free()
+{
+	if (pool) {
+		g_thread_pool_free(pool, TRUE, TRUE);
+		pool = NULL;
+		g_mutex_clear(&job.mutex);
+		g_cond_clear(&job.done);
+	}
+	g_free(tile_hashes);
+	g_free(tile_changed);
+	tile_hashes = NULL;
+	tile_changed = NULL;
+	tiles_x = tiles_y = 0;
+}
+
+// prepare the detection for frames of width×height pixels
+void
+tiles_init(int width, int height)
+{
+	tiles_free();
+
+	frame_width  = width;
+	frame_height = height;
+	tiles_x = (width  + TILE_SIZE - 1) / TILE_SIZE;
+	tiles_y = (height + TILE_SIZE - 1) / TILE_SIZE;
+	tile_hashes  = g_new(guint64, tiles_x * tiles_y);
+	tile_changed = g_new(guint8,  tiles_x * tiles_y);
+	tile_hashes_valid = FALSE;
+
+	n_jobs = 1;
+	if (width * height > TILES_PARALLEL_THRESHOLD) {
+		n_jobs = MIN((int) g_get_num_processors(), tiles_y);
+	}
+	if (n_jobs > 1) {
+		g_mutex_init(&job.mutex);
+		g_cond_init(&job.done);
+		pool = g_thread_pool_new(tiles_worker, NULL, n_jobs, TRUE, NULL);
+	}
+}
+
+// detect the tiles that changed since the previous frame
+//
+// the changed areas are added into 'changed' (translated by origin_x,
+// origin_y)
+void
+tiles_update(const char* data, int stride, int bytes_per_pixel,
+		int origin_x, int origin_y, struct region* changed)
+{
+	job.data = data;
+	job.stride = stride;
+	job.bytes_per_pixel = bytes_per_pixel;
+
+	if (pool) {
+		int i;
+		g_atomic_int_set(&job.pending, n_jobs);
+		for (i=0 ; i<n_jobs ; i++) {
+			// (index+1 because NULL cannot be pushed)
+			g_thread_pool_push(pool, GINT_TO_POINTER(i+1), NULL);
+		}
+		g_mutex_lock(&job.mutex);
+		while (g_atomic_int_get(&job.pending)) {
+			g_cond_wait(&job.done, &job.mutex);
+		}
+		g_mutex_unlock(&job.mutex);
+	} else {
+		tiles_hash_rows(0, tiles_y);
+	}
+	tile_hashes_valid = TRUE;
+
+	// add the runs of changed tiles into the region
+	int tx, ty;
+	for (ty=0 ; ty<tiles_y ; ty++)
+	{
+		for (tx=0 ; tx<tiles_x ; tx++)
+		{
+			if (!tile_changed[ty * tiles_x + tx]) {
+				continue;
+			}
+			int start = tx;
+			while ((tx+1 < tiles_x) && tile_changed[ty * tiles_x + tx + 1]) {
+				tx++;
+			}
+
+			GdkRectangle r;
+			r.x = start * TILE_SIZE;
+			r.y = ty * TILE_SIZE;
+			r.width  = MIN((tx+1) * TILE_SIZE, frame_width) - r.x;
+			r.height = MIN(TILE_SIZE, frame_height - r.y);
+			r.x += origin_x;
+			r.y += origin_y;
+			region_add(changed, &r);
+		}
+	}
+}
@@ -0,0 +1,132 @@
+#include "config.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <glib-unix.h>
+
+#include "squint.h"
+
+//
+// Tracer
+//
+// Spans are recorded into an in-memory ring (the oldest events are
+// overwritten). Slots are reserved with an atomic increment, so that events
+// can be recorded without locking.
+//
+// The ring is dumped in the Chrome trace event format (readable by
+// chrome://tracing and ui.perfetto.dev) into config.trace_file when SIGUSR1 is
+// received and when the program exits.
+//
+
+#define TRACE_RING_SIZE	(1<<16)	// must be a power of two
+
+struct trace_event {
+	const char* name;
+	gint64	ts;
+	guint32	tid;
+	char	phase;
+};
+
+static struct trace_event* ring = NULL;
+static volatile gint ring_head = 0;
+static volatile gint next_tid = 0;
+
+static guint32
+trace_tid()
+{
+	static __thread guint32 tid = 0;
+	if (!tid) {
+		tid = g_atomic_int_add(&next_tid, 1) + 1;
+	}
+	return tid;
+}
+
+static void
+trace_event(const char* name, char phase)
+{
+	if (!ring) {
+		return;
+	}
+
+	guint i = ((guint) g_atomic_int_add(&ring_head, 1)) & (TRACE_RING_SIZE-1);
+	struct trace_event* ev = &ring[i];
+	ev->name  = name;
+	ev->ts    = g_get_monotonic_time();
+	ev->tid   = trace_tid();
+	ev->phase = phase;
+}
+
+void
+trace_begin(const char* name)
+{
+	trace_event(name, 'B');
+}
+
+void
+trace_end(const char* name)
+{
+	trace_event(name, 'E');
+}
+
+void
+trace_dump()
+{
+	if (!ring) {
+		return;
+	}
+
+	FILE* fp = fopen(config.trace_file, "w");
+	if (!fp) {
+		char buff[256];
+		g_snprintf(buff, sizeof(buff), "cannot write %s: %s",
+				config.trace_file, strerror(errno));
+		squint_error(buff);
+		return;
+	}
+
+	guint head = g_atomic_int_get(&ring_head);
+	guint i = (head > TRACE_RING_SIZE) ? (head - TRACE_RING_SIZE) : 0;
+	int pid = getpid();
+	const char* sep = "";
+
+	fputs("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n", fp);
+	for ( ; i != head ; i++)
+	{
+		const struct trace_event* ev = &ring[i & (TRACE_RING_SIZE-1)];
+		if (!ev->name) {
+			continue;
+		}
+		fprintf(fp, "%s{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%" G_GINT64_FORMAT
+				",\"pid\":%d,\"tid\":%u}",
+				sep, ev->name, ev->phase, ev->ts, pid, ev->tid);
+		sep = ",\n";
+	}
+	fputs("\n]}\n", fp);
+	fclose(fp);
+}
+
+static gboolean
+trace_on_sigusr1(gpointer data)
+{
+	trace_dump();
+	return G_SOURCE_CONTINUE;
+}
+
+
+void
+trace_init()
+{
+	if (!config.trace_file) {
+		return;
+	}
+
+	ring = g_new0(struct trace_event, TRACE_RING_SIZE);
+
+	g_unix_signal_add(SIGUSR1, trace_on_sigusr1, NULL);
+	atexit(trace_dump);
+}
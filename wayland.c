@@ -0,0 +1,878 @@
+#include "config.h"
+
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <glib-unix.h>
+#include <gdk/gdkwayland.h>
+
+#include "squint.h"
+
+#include <wayland-client.h>
+#include "viewporter-client-protocol.h"
+#include "xdg-output-unstable-v1-client-protocol.h"
+#include "ext-image-capture-source-v1-client-protocol.h"
+#include "ext-image-copy-capture-v1-client-protocol.h"
+
+//
+// Wayland backend
+//
+// The source monitors are captured with the ext-image-copy-capture protocol
+// on a private connection to the compositor (so that its events are not mixed
+// with the ones of GDK). The compositor copies the frames of the source
+// monitor into a shm buffer and reports the damaged areas. The same memory is
+// wrapped into another wl_buffer on the GDK connection, which is attached to
+// a subsurface of each destination window (scaled with wp_viewporter). The
+// pixels are never touched by squint.
+//
+// Two buffers are used per session: a frame is captured into one while the
+// other is displayed. The damage that was not yet copied into a buffer is
+// tracked, so that the compositor only has to update these areas.
+//
+// The compositor delivers a frame when the source is damaged, thus the next
+// frame is requested as soon as the previous one is ready. Everything runs in
+// the GTK thread.
+//
+// Limitations: the sources must be monitors (no areas nor windows) and there
+// is a single source per session. The location of the pointer is unknown,
+// thus the windows are always shown (the cursor is painted into the frames
+// by the compositor). The mirror is not rotated nor flipped.
+//
+
+#define MAX_WAYLAND_MONITORS 16
+
+// wl_output advertised on the capture connection
+struct wayland_monitor {
+	uint32_t name;		// (0 if the entry is free)
+	struct wl_output* output;
+	struct zxdg_output_v1* xdg_output;
+	GdkRectangle rect;	// logical geometry (as reported to GDK)
+};
+
+struct wayland_session;
+
+struct wayland_buffer {
+	struct wayland_session* owner;
+	struct wl_buffer* capture_buffer;	// (on the capture connection)
+	struct wl_buffer* display_buffer;	// (on the GDK connection)
+	gboolean busy;		// attached to the outputs (until released)
+	gboolean full_damage;	// never captured
+	struct region damage;	// not yet copied into it
+};
+
+struct wayland_output {
+	struct wayland_session* owner;
+	struct output* output;
+	struct wl_surface* surface;
+	struct wl_subsurface* subsurface;
+	struct wp_viewport* viewport;
+	int window_width, window_height;	// (when the viewport was set)
+	int buffer_width, buffer_height;
+};
+
+struct wayland_session {
+	struct session* session;
+	struct ext_image_capture_source_v1* source;
+	struct ext_image_copy_capture_session_v1* capture;
+	struct ext_image_copy_capture_frame_v1* frame;
+
+	// buffer constraints
+	int width, height;
+	uint32_t format;
+	gboolean has_format;
+
+	struct wayland_buffer buffers[2];
+	int buffer_width, buffer_height;	// (when they were allocated)
+	struct wayland_buffer* target;		// being captured
+	struct wayland_buffer* displayed;
+	gboolean waiting;	// no buffer is available for the next frame
+
+	struct region frame_damage;
+	gint64 frame_time;	// presentation time of the frame (µs)
+
+	struct wayland_output outputs[MAX_OUTPUTS];
+	int n_outputs;
+};
+
+// capture connection
+static struct wl_display* capture_display = NULL;
+static guint capture_watch = 0;
+static struct wl_shm* capture_shm = NULL;
+static struct zxdg_output_manager_v1* xdg_output_manager = NULL;
+static struct ext_output_image_capture_source_manager_v1* source_manager = NULL;
+static struct ext_image_copy_capture_manager_v1* copy_manager = NULL;
+static struct wayland_monitor monitors[MAX_WAYLAND_MONITORS];
+
+// GDK connection (the globals are bound on a private queue)
+static struct wl_display* gdk_wl_display = NULL;
+static struct wl_event_queue* queue = NULL;
+static struct wl_compositor* compositor = NULL;
+static struct wl_subcompositor* subcompositor = NULL;
+static struct wl_shm* shm = NULL;
+static struct wp_viewporter* viewporter = NULL;
+
+static struct wayland_session wayland_sessions[MAX_SESSIONS];
+static int n_wayland_sessions = 0;
+
+void wayland_capture(struct wayland_session* ws);
+
+
+//
+// Monitors
+//
+
+static void
+wayland_on_xdg_output_logical_position(void* data, struct zxdg_output_v1* xdg_output,
+		int32_t x, int32_t y)
+{
+	struct wayland_monitor* m = data;
+	m->rect.x = x;
+	m->rect.y = y;
+}
+
+static void
+wayland_on_xdg_output_logical_size(void* data, struct zxdg_output_v1* xdg_output,
+		int32_t width, int32_t height)
+{
+	struct wayland_monitor* m = data;
+	m->rect.width  = width;
+	m->rect.height = height;
+}
+
+static void
+wayland_on_xdg_output_done(void* data, struct zxdg_output_v1* xdg_output)
+{
+}
+
+static void
+wayland_on_xdg_output_name(void* data, struct zxdg_output_v1* xdg_output,
+		const char* name)
+{
+}
+
+static void
+wayland_on_xdg_output_description(void* data, struct zxdg_output_v1* xdg_output,
+		const char* description)
+{
+}
+
+static const struct zxdg_output_v1_listener xdg_output_listener = {
+	wayland_on_xdg_output_logical_position,
+	wayland_on_xdg_output_logical_size,
+	wayland_on_xdg_output_done,
+	wayland_on_xdg_output_name,
+	wayland_on_xdg_output_description,
+};
+
+void
+wayland_watch_monitor(struct wayland_monitor* m)
+{
+	if (xdg_output_manager && !m->xdg_output) {
+		m->xdg_output = zxdg_output_manager_v1_get_xdg_output(xdg_output_manager, m->output);
+		zxdg_output_v1_add_listener(m->xdg_output, &xdg_output_listener, m);
+	}
+}
+
+// find the wl_output displaying a GDK monitor (they are matched by their
+// logical geometry since the objects are not shared between the connections)
+struct wl_output*
+wayland_find_output(const GdkRectangle* rect)
+{
+	int i;
+	for (i=0 ; i<MAX_WAYLAND_MONITORS ; i++) {
+		if (monitors[i].name && !memcmp(&monitors[i].rect, rect, sizeof(GdkRectangle))) {
+			return monitors[i].output;
+		}
+	}
+	return NULL;
+}
+
+static void
+wayland_on_capture_global(void* data, struct wl_registry* registry, uint32_t name,
+		const char* interface, uint32_t version)
+{
+	if (!strcmp(interface, wl_shm_interface.name)) {
+		capture_shm = wl_registry_bind(registry, name, &wl_shm_interface, 1);
+	} else if (!strcmp(interface, zxdg_output_manager_v1_interface.name)) {
+		xdg_output_manager = wl_registry_bind(registry, name,
+				&zxdg_output_manager_v1_interface, MIN(version, 2));
+	} else if (!strcmp(interface, ext_output_image_capture_source_manager_v1_interface.name)) {
+		source_manager = wl_registry_bind(registry, name,
+				&ext_output_image_capture_source_manager_v1_interface, 1);
+	} else if (!strcmp(interface, ext_image_copy_capture_manager_v1_interface.name)) {
+		copy_manager = wl_registry_bind(registry, name,
+				&ext_image_copy_capture_manager_v1_interface, 1);
+	} else if (!strcmp(interface, wl_output_interface.name)) {
+		int i;
+		for (i=0 ; i<MAX_WAYLAND_MONITORS ; i++) {
+			struct wayland_monitor* m = &monitors[i];
+			if (!m->name) {
+				m->name = name;
+				m->output = wl_registry_bind(registry, name, &wl_output_interface, 1);
+				wayland_watch_monitor(m);
+				break;
+			}
+		}
+	}
+}
+
+static void
+wayland_on_capture_global_remove(void* data, struct wl_registry* registry, uint32_t name)
+{
+	// (the mirror is reconfigured when GDK notices that the monitor is gone)
+	int i;
+	for (i=0 ; i<MAX_WAYLAND_MONITORS ; i++) {
+		struct wayland_monitor* m = &monitors[i];
+		if (m->name == name) {
+			if (m->xdg_output) {
+				zxdg_output_v1_destroy(m->xdg_output);
+			}
+			wl_output_destroy(m->output);
+			memset(m, 0, sizeof(*m));
+		}
+	}
+}
+
+static const struct wl_registry_listener capture_registry_listener = {
+	wayland_on_capture_global,
+	wayland_on_capture_global_remove,
+};
+
+
+//
+// GDK connection
+//
+
+static void
+wayland_on_gdk_global(void* data, struct wl_registry* registry, uint32_t name,
+		const char* interface, uint32_t version)
+{
+	if (!strcmp(interface, wl_compositor_interface.name) && (version >= 4)) {
+		// (version 4 for wl_surface.damage_buffer)
+		compositor = wl_registry_bind(registry, name, &wl_compositor_interface, 4);
+	} else if (!strcmp(interface, wl_subcompositor_interface.name)) {
+		subcompositor = wl_registry_bind(registry, name, &wl_subcompositor_interface, 1);
+	} else if (!strcmp(interface, wl_shm_interface.name)) {
+		shm = wl_registry_bind(registry, name, &wl_shm_interface, 1);
+	} else if (!strcmp(interface, wp_viewporter_interface.name)) {
+		viewporter = wl_registry_bind(registry, name, &wp_viewporter_interface, 1);
+	}
+}
+
+static void
+wayland_on_gdk_global_remove(void* data, struct wl_registry* registry, uint32_t name)
+{
+}
+
+static const struct wl_registry_listener gdk_registry_listener = {
+	wayland_on_gdk_global,
+	wayland_on_gdk_global_remove,
+};
+
+
+//
+// Buffers
+//
+
+static void
+wayland_on_buffer_release(void* data, struct wl_buffer* buffer)
+{
+	struct wayland_buffer* b = data;
+	b->busy = FALSE;
+
+	struct wayland_session* ws = b->owner;
+	if (ws->waiting) {
+		ws->waiting = FALSE;
+		wayland_capture(ws);
+	}
+}
+
+static const struct wl_buffer_listener buffer_listener = {
+	wayland_on_buffer_release,
+};
+
+void
+wayland_free_buffer(struct wayland_buffer* b)
+{
+	if (b->capture_buffer) {
+		wl_buffer_destroy(b->capture_buffer);
+		b->capture_buffer = NULL;
+	}
+	if (b->display_buffer) {
+		wl_buffer_destroy(b->display_buffer);
+		b->display_buffer = NULL;
+	}
+	b->busy = FALSE;
+}
+
+// allocate a buffer matching the constraints of the capture session
+//
+// The memory is shared by a wl_buffer on each connection.
+gboolean
+wayland_alloc_buffer(struct wayland_session* ws, struct wayland_buffer* b)
+{
+	int stride = ws->width * 4;
+	int size = stride * ws->height;
+	int fd = memfd_create("squint", MFD_CLOEXEC);
+	if (fd < 0) {
+		return FALSE;
+	}
+	if (ftruncate(fd, size) < 0) {
+		close(fd);
+		return FALSE;
+	}
+
+	struct wl_shm_pool* pool = wl_shm_create_pool(capture_shm, fd, size);
+	b->capture_buffer = wl_shm_pool_create_buffer(pool, 0, ws->width, ws->height,
+			stride, ws->format);
+	wl_shm_pool_destroy(pool);
+
+	pool = wl_shm_create_pool(shm, fd, size);
+	b->display_buffer = wl_shm_pool_create_buffer(pool, 0, ws->width, ws->height,
+			stride, ws->format);
+	wl_shm_pool_destroy(pool);
+	close(fd);
+
+	wl_buffer_add_listener(b->display_buffer, &buffer_listener, b);
+	b->owner = ws;
+	b->busy = FALSE;
+	b->full_damage = TRUE;
+	region_clear(&b->damage);
+	return TRUE;
+}
+
+
+//
+// Outputs
+//
+
+// adjust the viewport of an output to the size of its window
+//
+// return TRUE if it was changed
+gboolean
+wayland_update_viewport(struct wayland_session* ws, struct wayland_output* wo)
+{
+	int win_w = gdk_window_get_width(wo->output->gdkwin);
+	int win_h = gdk_window_get_height(wo->output->gdkwin);
+	if (	   (win_w == wo->window_width) && (win_h == wo->window_height)
+		&& (ws->width == wo->buffer_width) && (ws->height == wo->buffer_height))
+	{
+		return FALSE;
+	}
+	wo->window_width  = win_w;
+	wo->window_height = win_h;
+	wo->buffer_width  = ws->width;
+	wo->buffer_height = ws->height;
+
+	double w = ws->width, h = ws->height;
+	double sx = win_w / w, sy = win_h / h;
+	double src_x = 0, src_y = 0, src_w = w, src_h = h;
+	double dst_w, dst_h;
+	switch (config.opt_scale)
+	{
+	case SCALE_FIT:
+		dst_w = w * MIN(sx, sy);
+		dst_h = h * MIN(sx, sy);
+		break;
+	case SCALE_FILL:
+		src_w = win_w / MAX(sx, sy);
+		src_h = win_h / MAX(sx, sy);
+		src_x = (w - src_w) / 2;
+		src_y = (h - src_h) / 2;
+		dst_w = win_w;
+		dst_h = win_h;
+		break;
+	case SCALE_STRETCH:
+		dst_w = win_w;
+		dst_h = win_h;
+		break;
+	default:
+		// top-left corner (the cursor cannot be followed)
+		src_w = dst_w = MIN(w, win_w);
+		src_h = dst_h = MIN(h, win_h);
+	}
+
+	wp_viewport_set_source(wo->viewport,
+			wl_fixed_from_double(src_x), wl_fixed_from_double(src_y),
+			wl_fixed_from_double(src_w), wl_fixed_from_double(src_h));
+	wp_viewport_set_destination(wo->viewport, MAX(1, (int) dst_w), MAX(1, (int) dst_h));
+
+	// centre it (the position is applied on the next commit of the window)
+	wl_subsurface_set_position(wo->subsurface,
+			(win_w - (int) dst_w) / 2, (win_h - (int) dst_h) / 2);
+	gdk_window_invalidate_rect(wo->output->gdkwin, NULL, FALSE);
+	return TRUE;
+}
+
+// the window of an output was resized
+void
+wayland_on_window_size_allocate(GtkWidget* widget, GdkRectangle* allocation, gpointer data)
+{
+	struct wayland_output* wo = data;
+	struct wayland_session* ws = wo->owner;
+
+	// (the viewport is set when the first frame is displayed)
+	if (ws->displayed && wayland_update_viewport(ws, wo)) {
+		wl_surface_commit(wo->surface);
+		wl_display_flush(gdk_wl_display);
+	}
+}
+
+void
+wayland_enable_output(struct wayland_session* ws, struct wayland_output* wo,
+		struct output* out)
+{
+	wo->owner = ws;
+	wo->output = out;
+	wo->surface = wl_compositor_create_surface(compositor);
+	wo->subsurface = wl_subcompositor_get_subsurface(subcompositor, wo->surface,
+			gdk_wayland_window_get_wl_surface(out->gdkwin));
+	wl_subsurface_set_desync(wo->subsurface);
+	wo->viewport = wp_viewporter_get_viewport(viewporter, wo->surface);
+	wo->window_width = wo->window_height = 0;
+
+	// let the clicks go through to the window
+	struct wl_region* region = wl_compositor_create_region(compositor);
+	wl_surface_set_input_region(wo->surface, region);
+	wl_region_destroy(region);
+
+	// the viewport follows the size of the window (even if the source is
+	// not damaged)
+	g_signal_connect(out->gtkwin, "size-allocate",
+			G_CALLBACK(wayland_on_window_size_allocate), wo);
+}
+
+void
+wayland_disable_output(struct wayland_output* wo)
+{
+	g_signal_handlers_disconnect_by_data(wo->output->gtkwin, wo);
+	wp_viewport_destroy(wo->viewport);
+	wl_subsurface_destroy(wo->subsurface);
+	wl_surface_destroy(wo->surface);
+	memset(wo, 0, sizeof(*wo));
+}
+
+// display the frame that was just captured into 'b'
+void
+wayland_present(struct wayland_session* ws, struct wayland_buffer* b)
+{
+	trace_begin("present");
+	int i, j;
+	for (i=0 ; i<ws->n_outputs ; i++)
+	{
+		struct wayland_output* wo = &ws->outputs[i];
+		gboolean full = wayland_update_viewport(ws, wo) || !ws->displayed;
+
+		wl_surface_attach(wo->surface, b->display_buffer, 0, 0);
+		if (full) {
+			wl_surface_damage_buffer(wo->surface, 0, 0, INT32_MAX, INT32_MAX);
+		} else {
+			for (j=0 ; j<ws->frame_damage.n ; j++) {
+				const GdkRectangle* r = &ws->frame_damage.rects[j];
+				wl_surface_damage_buffer(wo->surface, r->x, r->y, r->width, r->height);
+			}
+		}
+		wl_surface_commit(wo->surface);
+	}
+	b->busy = TRUE;
+	ws->displayed = b;
+	wl_display_flush(gdk_wl_display);
+	trace_end("present");
+}
+
+
+//
+// Capture
+//
+
+static void
+wayland_on_frame_transform(void* data, struct ext_image_copy_capture_frame_v1* frame,
+		uint32_t transform)
+{
+}
+
+static void
+wayland_on_frame_damage(void* data, struct ext_image_copy_capture_frame_v1* frame,
+		int32_t x, int32_t y, int32_t width, int32_t height)
+{
+	struct wayland_session* ws = data;
+	GdkRectangle r = { x, y, width, height };
+	region_add(&ws->frame_damage, &r);
+}
+
+static void
+wayland_on_frame_presentation_time(void* data, struct ext_image_copy_capture_frame_v1* frame,
+		uint32_t tv_sec_hi, uint32_t tv_sec_lo, uint32_t tv_nsec)
+{
+	// (CLOCK_MONOTONIC, like g_get_monotonic_time())
+	struct wayland_session* ws = data;
+	ws->frame_time = ((((gint64) tv_sec_hi) << 32) | tv_sec_lo) * G_USEC_PER_SEC
+		+ tv_nsec / 1000;
+}
+
+static void
+wayland_on_frame_ready(void* data, struct ext_image_copy_capture_frame_v1* frame)
+{
+	struct wayland_session* ws = data;
+	struct wayland_buffer* b = ws->target;
+	struct wayland_buffer* other = &ws->buffers[b == ws->buffers];
+
+	ext_image_copy_capture_frame_v1_destroy(ws->frame);
+	ws->frame = NULL;
+	ws->target = NULL;
+
+	// the buffer is up to date, the other one misses this frame
+	b->full_damage = FALSE;
+	region_clear(&b->damage);
+	region_union(&other->damage, &ws->frame_damage);
+
+	wayland_present(ws, b);
+	stats_frame((guint64) region_area(&ws->frame_damage) * 4);
+	if (ws->frame_time) {
+		stats_latency((g_get_monotonic_time() - ws->frame_time) / 1000);
+	}
+
+	// request the next frame (delivered when the source is damaged again)
+	wayland_capture(ws);
+}
+
+gboolean
+wayland_on_retry_timer(gpointer data)
+{
+	wayland_capture(data);
+	return G_SOURCE_REMOVE;
+}
+
+static void
+wayland_on_frame_failed(void* data, struct ext_image_copy_capture_frame_v1* frame,
+		uint32_t reason)
+{
+	struct wayland_session* ws = data;
+	ext_image_copy_capture_frame_v1_destroy(ws->frame);
+	ws->frame = NULL;
+	ws->target = NULL;
+
+	switch (reason)
+	{
+	case EXT_IMAGE_COPY_CAPTURE_FRAME_V1_FAILURE_REASON_BUFFER_CONSTRAINTS:
+		// the new constraints will be sent, followed by 'done'
+		break;
+	case EXT_IMAGE_COPY_CAPTURE_FRAME_V1_FAILURE_REASON_STOPPED:
+		break;
+	default:
+		g_timeout_add(100, wayland_on_retry_timer, ws);
+	}
+}
+
+static const struct ext_image_copy_capture_frame_v1_listener frame_listener = {
+	wayland_on_frame_transform,
+	wayland_on_frame_damage,
+	wayland_on_frame_presentation_time,
+	wayland_on_frame_ready,
+	wayland_on_frame_failed,
+};
+
+// request the next frame of a session
+void
+wayland_capture(struct wayland_session* ws)
+{
+	if (ws->frame || !ws->capture || !ws->buffers[0].capture_buffer) {
+		return;
+	}
+
+	// capture into the buffer that is not displayed (if it was released)
+	struct wayland_buffer* b = &ws->buffers[ws->displayed == ws->buffers];
+	if (b->busy) {
+		ws->waiting = TRUE;
+		return;
+	}
+
+	trace_begin("capture");
+	ws->frame = ext_image_copy_capture_session_v1_create_frame(ws->capture);
+	ext_image_copy_capture_frame_v1_add_listener(ws->frame, &frame_listener, ws);
+	ext_image_copy_capture_frame_v1_attach_buffer(ws->frame, b->capture_buffer);
+	if (b->full_damage) {
+		ext_image_copy_capture_frame_v1_damage_buffer(ws->frame, 0, 0,
+				ws->width, ws->height);
+	} else {
+		int i;
+		for (i=0 ; i<b->damage.n ; i++) {
+			const GdkRectangle* r = &b->damage.rects[i];
+			ext_image_copy_capture_frame_v1_damage_buffer(ws->frame,
+					r->x, r->y, r->width, r->height);
+		}
+	}
+	ext_image_copy_capture_frame_v1_capture(ws->frame);
+	wl_display_flush(capture_display);
+	trace_end("capture");
+
+	ws->target = b;
+	ws->frame_time = 0;
+	region_clear(&ws->frame_damage);
+}
+
+static void
+wayland_on_session_buffer_size(void* data, struct ext_image_copy_capture_session_v1* session,
+		uint32_t width, uint32_t height)
+{
+	struct wayland_session* ws = data;
+	ws->width  = width;
+	ws->height = height;
+}
+
+static void
+wayland_on_session_shm_format(void* data, struct ext_image_copy_capture_session_v1* session,
+		uint32_t format)
+{
+	// (the 32-bit formats that all compositors support)
+	struct wayland_session* ws = data;
+	if (!ws->has_format
+	    && ((format == WL_SHM_FORMAT_XRGB8888) || (format == WL_SHM_FORMAT_ARGB8888)))
+	{
+		ws->format = format;
+		ws->has_format = TRUE;
+	}
+}
+
+static void
+wayland_on_session_dmabuf_device(void* data, struct ext_image_copy_capture_session_v1* session,
+		struct wl_array* device)
+{
+}
+
+static void
+wayland_on_session_dmabuf_format(void* data, struct ext_image_copy_capture_session_v1* session,
+		uint32_t format, struct wl_array* modifiers)
+{
+}
+
+// the buffer constraints are known
+static void
+wayland_on_session_done(void* data, struct ext_image_copy_capture_session_v1* session)
+{
+	struct wayland_session* ws = data;
+	if (!ws->has_format) {
+		squint_error("No supported buffer format for the Wayland capture");
+		return;
+	}
+
+	if ((ws->width != ws->buffer_width) || (ws->height != ws->buffer_height))
+	{
+		int i;
+		// the old buffers must not be in use when they are destroyed: the
+		// pending frame is dropped and the surfaces are detached
+		if (ws->frame) {
+			ext_image_copy_capture_frame_v1_destroy(ws->frame);
+			ws->frame = NULL;
+		}
+		if (ws->displayed) {
+			for (i=0 ; i<ws->n_outputs ; i++) {
+				wl_surface_attach(ws->outputs[i].surface, NULL, 0, 0);
+				wl_surface_commit(ws->outputs[i].surface);
+			}
+		}
+
+		// (re)allocate the buffers
+		for (i=0 ; i<2 ; i++) {
+			wayland_free_buffer(&ws->buffers[i]);
+		}
+		ws->buffer_width  = 0;
+		ws->buffer_height = 0;
+		ws->target = NULL;
+		ws->displayed = NULL;
+		ws->waiting = FALSE;
+		for (i=0 ; i<2 ; i++) {
+			if (!wayland_alloc_buffer(ws, &ws->buffers[i])) {
+				squint_error("Cannot allocate the Wayland capture buffers");
+				wayland_free_buffer(&ws->buffers[0]);
+				wl_display_flush(gdk_wl_display);
+				return;
+			}
+		}
+		ws->buffer_width  = ws->width;
+		ws->buffer_height = ws->height;
+		wl_display_flush(gdk_wl_display);
+		stats_allocation();
+	}
+	wayland_capture(ws);
+}
+
+static void
+wayland_on_session_stopped(void* data, struct ext_image_copy_capture_session_v1* session)
+{
+	// the source monitor is gone (the mirror is reconfigured when GDK
+	// notices it)
+	struct wayland_session* ws = data;
+	if (ws->frame) {
+		ext_image_copy_capture_frame_v1_destroy(ws->frame);
+		ws->frame = NULL;
+	}
+	ext_image_copy_capture_session_v1_destroy(ws->capture);
+	ws->capture = NULL;
+}
+
+static const struct ext_image_copy_capture_session_v1_listener session_listener = {
+	wayland_on_session_buffer_size,
+	wayland_on_session_shm_format,
+	wayland_on_session_dmabuf_device,
+	wayland_on_session_dmabuf_format,
+	wayland_on_session_done,
+	wayland_on_session_stopped,
+};
+
+gboolean
+wayland_on_capture_events(gint fd, GIOCondition condition, gpointer data)
+{
+	if ((condition & (G_IO_ERR | G_IO_HUP)) || (wl_display_dispatch(capture_display) < 0))
+	{
+		squint_error("Lost the connection to the Wayland compositor");
+		capture_watch = 0;
+		if (enabled) {
+			squint_disable();
+		}
+		return G_SOURCE_REMOVE;
+	}
+	return G_SOURCE_CONTINUE;
+}
+
+
+//
+// Backend
+//
+
+gboolean
+wayland_init()
+{
+	// GDK connection
+	gdk_wl_display = gdk_wayland_display_get_wl_display(gdisplay);
+	queue = wl_display_create_queue(gdk_wl_display);
+
+	struct wl_display* wrapper = wl_proxy_create_wrapper(gdk_wl_display);
+	wl_proxy_set_queue((struct wl_proxy*) wrapper, queue);
+	struct wl_registry* registry = wl_display_get_registry(wrapper);
+	wl_proxy_wrapper_destroy(wrapper);
+	wl_registry_add_listener(registry, &gdk_registry_listener, NULL);
+	wl_display_roundtrip_queue(gdk_wl_display, queue);
+
+	if (!compositor || !subcompositor || !shm || !viewporter) {
+		squint_error("The Wayland compositor does not support subsurfaces and viewports");
+		return FALSE;
+	}
+
+	// the objects created from now on are on the default queue (their
+	// events are dispatched by GDK)
+	wl_proxy_set_queue((struct wl_proxy*) compositor, NULL);
+	wl_proxy_set_queue((struct wl_proxy*) subcompositor, NULL);
+	wl_proxy_set_queue((struct wl_proxy*) shm, NULL);
+	wl_proxy_set_queue((struct wl_proxy*) viewporter, NULL);
+
+	// capture connection
+	capture_display = wl_display_connect(NULL);
+	if (!capture_display) {
+		squint_error("Cannot connect to the Wayland compositor");
+		return FALSE;
+	}
+	registry = wl_display_get_registry(capture_display);
+	wl_registry_add_listener(registry, &capture_registry_listener, NULL);
+	wl_display_roundtrip(capture_display);
+
+	if (!capture_shm || !xdg_output_manager || !source_manager || !copy_manager) {
+		squint_error("The Wayland compositor does not support screen capture "
+				"(ext-image-copy-capture-v1)");
+		return FALSE;
+	}
+
+	// get the geometry of the outputs
+	int i;
+	for (i=0 ; i<MAX_WAYLAND_MONITORS ; i++) {
+		if (monitors[i].name) {
+			wayland_watch_monitor(&monitors[i]);
+		}
+	}
+	wl_display_roundtrip(capture_display);
+
+	capture_watch = g_unix_fd_add(wl_display_get_fd(capture_display),
+			G_IO_IN | G_IO_ERR | G_IO_HUP, wayland_on_capture_events, NULL);
+	return TRUE;
+}
+
+// return FALSE if the selected sources cannot be captured
+gboolean
+wayland_enable()
+{
+	int i, j;
+	for (i=0 ; i<n_sessions ; i++)
+	{
+		struct session* s = &sessions[i];
+		const struct source* src = &s->sources[0];
+		if ((s->n_sources != 1) || !src->monitor) {
+			squint_error("Only a single monitor per mirror can be captured on Wayland");
+			return FALSE;
+		}
+		if (!wayland_find_output(&src->rect)) {
+			squint_error("The source monitor is not known to the Wayland compositor");
+			return FALSE;
+		}
+	}
+
+	for (i=0 ; i<n_sessions ; i++)
+	{
+		struct session* s = &sessions[i];
+		struct wayland_session* ws = &wayland_sessions[i];
+		memset(ws, 0, sizeof(*ws));
+		ws->session = s;
+
+		for (j=0 ; j<s->n_outputs ; j++) {
+			wayland_enable_output(ws, &ws->outputs[j], &s->outputs[j]);
+		}
+		ws->n_outputs = s->n_outputs;
+
+		ws->source = ext_output_image_capture_source_manager_v1_create_source(
+				source_manager, wayland_find_output(&s->sources[0].rect));
+		ws->capture = ext_image_copy_capture_manager_v1_create_session(copy_manager,
+				ws->source,
+				EXT_IMAGE_COPY_CAPTURE_MANAGER_V1_OPTIONS_PAINT_CURSORS);
+		ext_image_copy_capture_session_v1_add_listener(ws->capture, &session_listener, ws);
+
+		// the location of the pointer is unknown
+		squint_show(s);
+	}
+	n_wayland_sessions = n_sessions;
+
+	wl_display_flush(capture_display);
+	wl_display_flush(gdk_wl_display);
+	return TRUE;
+}
+
+void
+wayland_disable()
+{
+	int i, j;
+	for (i=0 ; i<n_wayland_sessions ; i++)
+	{
+		struct wayland_session* ws = &wayland_sessions[i];
+		g_source_remove_by_user_data(ws);
+		if (ws->frame) {
+			ext_image_copy_capture_frame_v1_destroy(ws->frame);
+		}
+		if (ws->capture) {
+			ext_image_copy_capture_session_v1_destroy(ws->capture);
+		}
+		ext_image_capture_source_v1_destroy(ws->source);
+		// (the surfaces go first, so that no buffer is attached when freed)
+		for (j=0 ; j<ws->n_outputs ; j++) {
+			wayland_disable_output(&ws->outputs[j]);
+		}
+		for (j=0 ; j<2 ; j++) {
+			wayland_free_buffer(&ws->buffers[j]);
+		}
+		memset(ws, 0, sizeof(*ws));
+	}
+	n_wayland_sessions = 0;
+
+	wl_display_flush(capture_display);
+	wl_display_flush(gdk_wl_display);
+}
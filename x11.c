@@ -1,17 +1,30 @@
 #include "config.h"
 
 #include <stdint.h>
+#include <stdio.h>
 
 #include <gdk/gdkx.h>
 
 #include "squint.h"
 
 #include <X11/Xlib.h>
+#include <X11/cursorfont.h>
+#include <X11/keysym.h>
+#include <X11/XKBlib.h>
+#ifdef HAVE_XCB
+#include <X11/Xlib-xcb.h>
+#include <xcb/xcbext.h>
+#endif
+#if defined(ASYNC_CURSOR) || defined(ASYNC_DAMAGE)
+#include <xcb/xfixes.h>
+#endif
 #ifdef HAVE_XI
 #include <X11/extensions/XInput2.h>
 #endif
-#ifdef COPY_CURSOR
+#ifdef HAVE_XFIXES
 #include <X11/extensions/Xfixes.h>
+#endif
+#ifdef HAVE_XRENDER
 #include <X11/extensions/Xrender.h>
 #endif
 #ifdef HAVE_XDAMAGE
@@ -20,69 +33,642 @@
 #ifdef HAVE_XRANDR
 #include <X11/extensions/Xrandr.h>
 #endif
+#ifdef HAVE_XPRESENT
+#include <X11/extensions/Xpresent.h>
+#endif
+#ifdef HAVE_XCOMPOSITE
+#include <X11/extensions/Xcomposite.h>
+#endif
+#ifdef OVERLAY_CURSOR
+#include <X11/extensions/shape.h>
+#endif
+#ifdef HAVE_XSHM
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <X11/extensions/XShm.h>
+#endif
 
 static Window root_window = 0;
 static GdkRectangle root_window_rect;
-static Window window = 0;
-static Pixmap pixmap = -1;
 static int depth = -1, screen = -1;
 static GC gc = NULL;
 static GC gc_white = NULL;
 static Display* display = NULL;
+#ifdef HAVE_XCB
+// XCB connection underlying 'display'
+//
+// It is used to pipeline the requests whose replies are not needed at once:
+// the location of the pointer is requested at the beginning of the frame and
+// read after fetching the damage (a single round trip), while the active
+// window, the frame and geometry of the active window and the image of a new
+// cursor are read asynchronously by the event source.
+static xcb_connection_t* xcb = NULL;
+static xcb_query_pointer_cookie_t pointer_cookie;
+static gboolean pointer_requested = FALSE;
+static xcb_get_property_cookie_t active_window_cookie;
+static gboolean active_window_requested = FALSE;
+static xcb_get_property_reply_t* active_window_reply = NULL;
+
+// lookup of the frame of a new active window: the window tree is walked up
+// with QueryTree requests (unless the frame is in the cache), then the
+// geometry of the frame is requested
+enum {
+	FRAME_REQUEST_NONE,
+	FRAME_REQUEST_TREE,
+	FRAME_REQUEST_GEOMETRY,
+};
+static int frame_request = FRAME_REQUEST_NONE;
+static unsigned int frame_request_sequence;
+static Window frame_request_client = 0;	// the new active window
+static Window frame_request_window = 0;	// the window being queried
+static gboolean frame_reply_received = FALSE;
+static void* frame_reply = NULL;	// (NULL on error)
+#endif
 static gint refresh_timer = 0;
 static Atom net_active_window_atom = 0;
 
-static GdkPoint backup;
-static Pixmap   backup_pixmap = 0;
+//
+// Capture thread
+//
+// The capture engine (damage and cursor tracking, copies, flushes and frame
+// pacing) runs in a dedicated thread with its own connection to the X server
+// ('display') and its own main context, so that the mirror is not stalled
+// when the GTK main loop is busy (menus, dialogs, layout). x11_enable() and
+// x11_disable() are executed in this thread and so are the handlers of all
+// the X events received on the connection.
+//
+// The GTK thread sends its requests by invoking functions in the context of
+// the capture thread (see x11_capture_run()). Conversely, the GTK functions
+// (squint_show(), squint_hide(), squint_error()...) are deferred to the GTK
+// thread with g_idle_add().
+//
+// While squint is disabled, the capture thread is idle and the connection may
+// be used by the GTK thread (eg: x11_pick_window()).
+//
+static GMainContext* capture_context = NULL;
+static GSource* event_source = NULL;	// (NULL while disabled)
+
+// X errors on the capture connection (not trapped by GDK)
+static int (*gdk_error_handler)(Display*, XErrorEvent*) = NULL;
+static int error_trap_depth = 0;
+static unsigned long error_trap_serial = 0;
+static int error_trap_code = 0;
+
 #define CURSOR_CROSSHAIR_LEN 3
-#define CURSOR_SIZE 9
+#define CURSOR_CROSSHAIR_SIZE (2*CURSOR_CROSSHAIR_LEN + 4)
 
-static Window active_window = 0;
+// maximum size of the area saved below the cursor
+#define CURSOR_SIZE CURSOR_CROSSHAIR_SIZE
+
+// Active window
+//
+// The geometry of the active window is the one of its frame (the top-level
+// window created by the window manager). The frame is monitored while the
+// window is active: its ConfigureNotify events give its location in root
+// window coordinates, thus moving the window does not cost any request.
+//
+// The frames of the recently active windows are cached, so that the window
+// tree is not walked again when the focus comes back to them. The cached
+// client windows are monitored to invalidate their entry when they are
+// reparented or destroyed.
+#define FRAME_CACHE_SIZE 16
+struct frame_cache_entry {
+	Window client;	// (0 if the entry is free)
+	Window frame;	// (0 if unknown)
+};
+static struct frame_cache_entry frame_cache[FRAME_CACHE_SIZE];
+static int frame_cache_next = 0;
 
-static GdkPoint offset;
-static GdkPoint cursor;
+static Window active_window = 0;
+static Window active_frame  = 0;
 
 #ifdef HAVE_XI
 static gboolean can_track_cursor = FALSE;
 static int xi_opcode = 0;
+
+// Pointer motions
+//
+// The motions are coalesced until the next frame (or for
+// CURSOR_MOTION_PERIOD when the frames are not paced). The location is taken
+// from the XI_Motion events when they reach the root window, the pointer is
+// only queried when a raw motion was not followed by such an event (i.e. when
+// the pointer is over a window that selected the motion events).
+#define CURSOR_MOTION_PERIOD 16	// ms
+static gboolean motion_pending = FALSE;	// a motion is not applied yet
+static gboolean motion_queried = FALSE;	// ...and its location is unknown
+static GdkPoint motion_location;
+static guint motion_timer = 0;
 #endif
 
 #ifdef HAVE_XDAMAGE
 static gboolean can_use_xdamage = FALSE;
 static int xdamage_event_base;
 static Damage damage = 0;
-static int min_refresh_period=0;
-static Time next_refresh=0;
-static gint refresh_timeout=0;
 
-gboolean x11_compute_damaged_rect(GdkRectangle* rect);
+// time of the damages to be refreshed by the next frame (see pacing.c)
+static Time frame_damage_timestamp = 0;
+
+// oldest damage not yet flushed (server time and reception time)
+static Time   frame_damage_time = 0;
+static gint64 frame_damage_received = 0;
+
+#endif
+
+#ifdef ADAPTIVE_DAMAGE
+// Under heavy damage (eg: fullscreen video) the damage object is switched
+// from XDamageReportRawRectangles (one event per rectangle) to
+// XDamageReportNonEmpty (one event per frame) and the damaged region is
+// fetched with XDamageSubtract when the frame is refreshed.
+//
+// The storm is detected on the rate of damaged rectangles. In NonEmpty mode
+// the number of rectangles is bounded by the frame rate, thus the calm is
+// detected on the rate of damage events (i.e. of damaged frames) and only
+// after DAMAGE_HOLD_TIME, so that a sustained storm does not switch back and
+// forth.
+#define DAMAGE_STORM_RATE	500	// rectangles per second
+#define DAMAGE_CALM_RATE	10	// events per second
+#define DAMAGE_HOLD_TIME	5000	// ms
+
+static int damage_level = XDamageReportRawRectangles;
+static XserverRegion damage_parts = 0;
+static gboolean damage_pending = FALSE;
+static Time damage_rate_start = 0;
+static int  damage_rate_count = 0;
+static Time damage_level_start = 0;
+
+void x11_update_damage_rate(Time timestamp, int count);
+void x11_fetch_damage(Time timestamp);
+
+#ifdef ASYNC_DAMAGE
+// In NonEmpty mode, the damaged region is requested over XCB together with
+// the location of the pointer (a single flush) and the frame is produced when
+// the reply is received by the event source. The frames scheduled meanwhile
+// are deferred until then.
+static xcb_xfixes_fetch_region_cookie_t damage_region_cookie;
+static gboolean damage_region_requested = FALSE;
+static gboolean damage_region_received = FALSE;
+static xcb_xfixes_fetch_region_reply_t* damage_region_reply = NULL;
+static Time damage_region_timestamp = 0;
+static gboolean frame_deferred = FALSE;
+
+void x11_request_damage_region(Time timestamp);
+gboolean x11_poll_damage_region();
+void x11_on_damage_region_reply();
+void x11_cancel_damage_region_request();
+#endif
 #endif
 
 #ifdef COPY_CURSOR
+// (large enough for the HiDPI cursors, larger cursors are clipped)
 #undef  CURSOR_SIZE
-#define CURSOR_SIZE 32
+#define CURSOR_SIZE 128
 static int xfixes_event_base;
 static int copy_cursor = 0;
-static Pixmap  cursor_pixmap = 0;
-static Picture cursor_picture = 0;
 static XImage* cursor_image = NULL;
 static GC      cursor_gc = NULL;
-static Picture pixmap_picture = 0;
-
-static int cursor_xhot=0;
-static int cursor_yhot=0;
 static uint32_t* cursor_pixels;
 #define CURSOR_PIXELS_SIZE (sizeof(*cursor_pixels) * CURSOR_SIZE * CURSOR_SIZE)
+
+// Cursor cache
+//
+// The cursor images are uploaded once into ARGB pictures (of the size of the
+// cursor) and looked up by serial (or by name) when the cursor changes, thus
+// switching back to a known cursor costs no round trip and no upload. The
+// least recently used entry is evicted when the cache is full.
+#define CURSOR_CACHE_SIZE 16
+
+struct cursor {
+	unsigned long serial;	// (0 if the entry is free)
+	Atom	name;
+	Pixmap	pixmap;
+	Picture	picture;
+#ifdef OVERLAY_CURSOR
+	Pixmap	mask;		// (the pixmap is opaque)
+#endif
+	int	width, height;
+	int	xhot, yhot;
+	guint64	last_use;
+};
+static struct cursor cursor_cache[CURSOR_CACHE_SIZE];
+static guint64 cursor_use_count = 0;
+
+static const struct cursor* current_cursor = NULL;
+
+#ifdef ASYNC_CURSOR
+// The image of a new cursor is requested over XCB and uploaded when the reply
+// is received by the event source (the cursor notification is handled
+// without a round trip).
+static xcb_xfixes_get_cursor_image_and_name_cookie_t cursor_image_cookie;
+static gboolean cursor_image_requested = FALSE;
+static xcb_xfixes_get_cursor_image_and_name_reply_t* cursor_image_reply = NULL;
+#endif
+#endif
+
+#ifdef OVERLAY_CURSOR
+// Overlay cursor
+//
+// The cursor is displayed in a small shaped window stacked above the window
+// of each output (thus it is never drawn into the mirror): a motion costs a
+// single XMoveWindow and the frames are copied without clearing and redrawing
+// the cursor. The shape is taken from the alpha channel of the cursor (the
+// translucent pixels are dropped, so that it works without a compositing
+// manager) and the cursor is not scaled with the mirror.
+static gboolean overlay_cursor = FALSE;
 #endif
 
 #ifdef HAVE_XRANDR
 static int xrandr_event_base = 0;
 #endif
 
-gboolean x11_draw_cursor();
-gboolean x11_clear_cursor();
-void x11_redraw_cursor(gboolean do_clear);
+#ifdef HAVE_XSHM
+// Client-side capture
+//
+// The damaged rectangles are fetched with XShmGetImage into a scratch area,
+// copied into shm_frame (client-side copy of the source monitor) and
+// uploaded into the pixmap with XShmPutImage.
+//
+// Each session has its own shared memory segment, which holds both shm_frame
+// and the scratch area (both sized from its source monitor, shared memory is
+// used only for the sessions with a single source).
+static gboolean can_use_shm = FALSE;
+
+// Tile-hash change detection (--tile-hash, fixed-rate mode only)
+//
+// The whole source monitor is fetched into shm_frame at every tick and only
+// the tiles that changed are uploaded into the pixmap (with a single session
+// only).
+static gboolean shm_tiles = FALSE;
+#endif
+
+#ifdef HAVE_XRENDER
+// Transformed output (--scale, --rotate, --flip)
+//
+// The pixmap is rendered with XRenderComposite into the output_pixmap of each
+// output (sized from its rect), which is the background of its window. The
+// transform is evaluated by the X server, the pixels never go through squint.
+static gboolean can_transform = FALSE;
+static gboolean transformed = FALSE;
+
+// Composited sources (--layout pip)
+//
+// The insets are drawn by XRenderComposite from the root window into the
+// pixmap (shrunk by the X server), the other tiles are copied with XCopyArea.
+static gboolean can_composite = FALSE;
+#endif
+
+#ifdef WINDOW_PIXMAP
+// Window pixmaps (sources given as @ID)
+//
+// The tracked windows are redirected with XComposite and read from their
+// named pixmap instead of the root window, thus the mirror is not affected by
+// the windows on top of them (or by the parts that are off screen). Their
+// damages are taken from a damage object created on the window only (the
+// damages reported by the root window are ignored in their area).
+static gboolean can_name_pixmap = FALSE;
+#endif
+
+#ifdef HAVE_XPRESENT
+// Double-buffered output (--present)
+//
+// The windows have no background. The areas updated in the pixmap are copied
+// into the back buffer of each output, which is then presented with
+// XPresentPixmap (flipped at the next vblank when possible). Only one frame is
+// in flight at a time, the updates received meanwhile are merged into the
+// next frame.
+static gboolean can_present = FALSE;
+static gboolean present = FALSE;
+static int present_opcode = 0;
+#endif
+
+// Destination windows
+//
+// The source monitor is captured once into the pixmap, which is shared by all
+// the outputs. Each output has its own window (a child of the gtk window of
+// the destination monitor) repainted from the pixmap with its own offset (or
+// transform).
+struct x11_output {
+	struct x11_session* owner;
+	struct output* out;	// destination monitor (rect & gtk window)
+	GdkRectangle rect;	// geometry of the gtk window (the monitor in
+				// fullscreen mode, updated when it is configured)
+	Window window;
+	GdkPoint offset;
+	gboolean moved;		// offset updated by x11_fix_offset()
+
+#ifdef OVERLAY_CURSOR
+	Window cursor_window;
+	gboolean cursor_mapped;
+#endif
+
+#ifdef HAVE_XRENDER
+	Pixmap  output_pixmap;
+	Picture source_picture;	// (holds the transform)
+	Picture output_picture;
+	int output_width, output_height;
+
+	// affine transform from the pixmap to output_pixmap
+	// x' = m[0]*x + m[1]*y + m[2]
+	// y' = m[3]*x + m[4]*y + m[5]
+	double output_transform[6];
+#endif
+
+#ifdef HAVE_XPRESENT
+	XID present_eid;
+	int present_width, present_height;
+	Pixmap   present_buffers[2];
+#ifdef HAVE_XRENDER
+	Picture  present_pictures[2];
+#endif
+	gboolean present_busy[2];		// not yet released by the server
+	struct region present_stale[2];		// out-of-date areas of each buffer
+	struct region present_update;		// areas updated since the last frame
+	int present_back;
+	guint32 present_serial;
+	gboolean present_in_flight;
+
+#ifdef HAVE_XDAMAGE
+	// oldest damage of the next frame and of the frame in flight
+	Time   present_damage_time;
+	gint64 present_damage_received;
+	Time   present_flight_damage_time;
+	gint64 present_flight_damage_received;
+#endif
+#endif
+};
+
+// Mirror sessions
+//
+// All the sessions share the X connection, the damage object, the XI2
+// selection and the event filter. The damaged areas are split between the
+// sessions (according to their sources) and the sessions that were damaged
+// are refreshed together in the next frame.
+struct x11_session {
+	struct session* session;	// source monitor & destinations
+	Pixmap pixmap;
+	Drawable canvas;	// where the mirror is drawn (pixmap or window)
+
+	// Direct output (--direct)
+	//
+	// The damaged areas are copied from the root window straight into the
+	// window (which has no background pixmap) and the cursor is drawn on
+	// top of them. The exposed areas are copied again from the root
+	// window.
+	//
+	// There is no shared pixmap in this mode, thus it is used only with a
+	// single output.
+	gboolean direct;
+
+	// location of the cursor (in the mirror) and saved area below it
+	GdkPoint cursor;
+	GdkRectangle backup;
+	gboolean backed_up;
+	Pixmap   backup_pixmap;
+#ifdef COPY_CURSOR
+	Picture pixmap_picture;
+#endif
+
+	// the tiles of the sources overlap (the ones that come next are drawn
+	// on top)
+	gboolean overlapping;
+
+	// top-level windows (frames) of the tracked windows
+	Window frames[MAX_SOURCES];
+#ifdef WINDOW_PIXMAP
+	// named pixmaps and damage objects of the tracked windows (0 if the
+	// source is captured from the root window)
+	Pixmap window_pixmaps[MAX_SOURCES];
+	Damage window_damages[MAX_SOURCES];
+#endif
+#ifdef HAVE_XRENDER
+	// root window pictures of the scaled tiles (0 if not scaled)
+	Picture tile_pictures[MAX_SOURCES];
+	Picture canvas_picture;
+#endif
+
+#ifdef HAVE_XDAMAGE
+	// damages received and damages to be refreshed by the next frame
+	struct region damage_acc;
+	struct region frame_damage;
+#endif
+
+#ifdef HAVE_XSHM
+	XShmSegmentInfo shm_info;
+	XImage* shm_frame;
+	char*   shm_scratch;
+#endif
+
+	struct x11_output outputs[MAX_OUTPUTS];
+	int n_outputs;
+
+	// last raise/lower request (applied in the GTK thread)
+	gint show_request;
+	gint show_pending;
+};
+static struct x11_session x11_sessions[MAX_SESSIONS];
+
+#ifdef HAVE_XPRESENT
+void x11_alloc_present_buffers(struct x11_output* o, int width, int height);
+void x11_present_frame(struct x11_output* o);
+#endif
+
+static struct record* replay_records = NULL;
+static int replay_count = 0;
+static int replay_index = 0;
+static gint64 replay_start = 0;
+static guint replay_timer = 0;
+
+gboolean x11_draw_cursor(struct x11_session* s);
+gboolean x11_clear_cursor(struct x11_session* s);
+void x11_backup_cursor_area(struct x11_session* s);
+void x11_redraw_cursor(struct x11_session* s, gboolean do_clear);
+void x11_update_output_area(struct x11_output* o, int x, int y, int width, int height);
+void x11_update_window_area(struct x11_session* s, int x, int y, int width, int height);
+void x11_commit_window(struct x11_session* s);
+#ifdef HAVE_XDAMAGE
+gboolean x11_compute_damaged_rect(struct x11_session* s, const GdkRectangle* area,
+		struct region* rg);
+#endif
+
+
+// the errors on the capture connection are ignored unless they are trapped
+int
+x11_on_error(Display* d, XErrorEvent* e)
+{
+	if (d != display) {
+		return gdk_error_handler(d, e);
+	}
+	if (error_trap_depth && (e->serial >= error_trap_serial) && !error_trap_code) {
+		error_trap_code = e->error_code;
+	}
+	return 0;
+}
+
+void
+x11_error_trap_push()
+{
+	if (!error_trap_depth++) {
+		error_trap_serial = NextRequest(display);
+		error_trap_code = 0;
+	}
+}
+
+void
+x11_error_trap_pop_ignored()
+{
+	error_trap_depth--;
+}
+
+// return the code of the first error caught since x11_error_trap_push() (0 if
+// none)
+int
+x11_error_trap_pop()
+{
+	XSync(display, False);
+	x11_error_trap_pop_ignored();
+	return error_trap_code;
+}
+
+struct capture_call {
+	GSourceFunc func;
+	gpointer data;
+	GMutex mutex;
+	GCond cond;
+	gboolean done;
+};
+
+gboolean
+x11_on_capture_call(gpointer data)
+{
+	struct capture_call* call = data;
+	call->func(call->data);
+
+	g_mutex_lock(&call->mutex);
+	call->done = TRUE;
+	g_cond_signal(&call->cond);
+	g_mutex_unlock(&call->mutex);
+	return G_SOURCE_REMOVE;
+}
+
+// run a function in the capture thread and wait until it returns
+void
+x11_capture_run(GSourceFunc func, gpointer data)
+{
+	struct capture_call call = { func, data };
+	g_mutex_init(&call.mutex);
+	g_cond_init(&call.cond);
+
+	// (called directly if already in the capture thread)
+	g_main_context_invoke(capture_context, x11_on_capture_call, &call);
+
+	g_mutex_lock(&call.mutex);
+	while (!call.done) {
+		g_cond_wait(&call.cond, &call.mutex);
+	}
+	g_mutex_unlock(&call.mutex);
+	g_mutex_clear(&call.mutex);
+	g_cond_clear(&call.cond);
+}
+
+// add a timeout (or an idle function if 'ms' is 0) to the capture thread
+guint
+x11_capture_add(guint ms, GSourceFunc func, gpointer data)
+{
+	GSource* src = ms ? g_timeout_source_new(ms) : g_idle_source_new();
+	g_source_set_callback(src, func, data, NULL);
+	guint id = g_source_attach(src, capture_context);
+	g_source_unref(src);
+	return id;
+}
+
+void
+x11_capture_remove(guint id)
+{
+	GSource* src = g_main_context_find_source_by_id(capture_context, id);
+	if (src) {
+		g_source_destroy(src);
+	}
+}
+
+gboolean
+x11_on_idle_error(gpointer msg)
+{
+	squint_error(msg);
+	return G_SOURCE_REMOVE;
+}
+
+// report an error from the capture thread ('msg' must be a static string)
+void
+x11_error(const char* msg)
+{
+	g_idle_add(x11_on_idle_error, (gpointer) msg);
+}
+
+gboolean
+x11_on_idle_quit(gpointer data)
+{
+	squint_quit();
+	return G_SOURCE_REMOVE;
+}
+
+gboolean
+x11_on_show_request(gpointer data)
+{
+	struct x11_session* s = data;
+	g_atomic_int_set(&s->show_pending, FALSE);
+	if (!enabled) {
+		return G_SOURCE_REMOVE;
+	}
+	if (g_atomic_int_get(&s->show_request)) {
+		squint_show(s->session);
+	} else {
+		squint_hide(s->session);
+	}
+	return G_SOURCE_REMOVE;
+}
+
+// raise or lower the windows of a session
+//
+// (only the last request is applied when the GTK thread is busy)
+void
+x11_show_session(struct x11_session* s, gboolean show)
+{
+	g_atomic_int_set(&s->show_request, show);
+	if (g_atomic_int_compare_and_exchange(&s->show_pending, FALSE, TRUE)) {
+		g_idle_add(x11_on_show_request, s);
+	}
+}
+
+// find the output displayed in a window
+struct x11_output*
+x11_find_output(Window w)
+{
+	struct x11_session* s;
+	struct x11_output* o;
+	for (s=x11_sessions ; s<x11_sessions+n_sessions ; s++) {
+		for (o=s->outputs ; o<s->outputs+s->n_outputs ; o++) {
+			if (o->window == w) {
+				return o;
+			}
+		}
+	}
+	return NULL;
+}
 
+// find the x11 counterpart of an output
+struct x11_output*
+x11_get_output(const struct output* out)
+{
+	struct x11_session* s;
+	struct x11_output* o;
+	for (s=x11_sessions ; s<x11_sessions+n_sessions ; s++) {
+		for (o=s->outputs ; o<s->outputs+s->n_outputs ; o++) {
+			if (o->out == out) {
+				return o;
+			}
+		}
+	}
+	return NULL;
+}
 
 void
 x11_adjust_offset_value(gint* offset, gint src, gint dst, gint cursor)
@@ -118,719 +704,3428 @@ x11_adjust_offset_value(gint* offset, gint src, gint dst, gint cursor)
 	}
 }
 
-// return true if offset was updated
+// return true if the offset of the output was updated
 // NOTE: must clear the window if it returns true
 gboolean
-x11_fix_offset()
+x11_fix_offset(struct x11_output* o)
 {
-	GdkPoint offset_bak = {offset.x, offset.y};
+	GdkPoint* offset = &o->offset;
+	GdkPoint offset_bak = {offset->x, offset->y};
+	const struct session* session = o->owner->session;
+	const GdkRectangle* dst_rect = &o->rect;
+	const GdkPoint* cursor = &o->owner->cursor;
+
+#ifdef HAVE_XRENDER
+	if (transformed) {
+		// the whole source is always visible
+		return FALSE;
+	}
+#endif
 
 	// Adjust the offsets
-	x11_adjust_offset_value(&offset.x, src_rect.width,  dst_rect.width,  cursor.x);
-	x11_adjust_offset_value(&offset.y, src_rect.height, dst_rect.height, cursor.y);
+	x11_adjust_offset_value(&offset->x, session->mirror_width,  dst_rect->width,  cursor->x);
+	x11_adjust_offset_value(&offset->y, session->mirror_height, dst_rect->height, cursor->y);
 	
-	gboolean updated = memcmp(&offset, &offset_bak, sizeof(offset));
+	gboolean updated = memcmp(offset, &offset_bak, sizeof(*offset));
 	if (updated) {
 		// offset was updated
 		// -> move the windows
-		XMoveWindow(display, window, offset.x, offset.y);
+		XMoveWindow(display, o->window, offset->x, offset->y);
 	}
 	return updated;
 }
 
 
+#ifdef HAVE_XCB
+// send a request for the location of the pointer (the reply is read by the
+// next call to x11_query_cursor_location())
 void
-x11_refresh_cursor_location(gboolean force)
+x11_request_cursor_location()
+{
+	if (!pointer_requested) {
+		pointer_cookie = xcb_query_pointer(xcb, root_window);
+		pointer_requested = TRUE;
+	}
+}
+
+// discard the reply to x11_request_cursor_location() if it was not used
+void
+x11_discard_cursor_location()
 {
+	if (pointer_requested) {
+		xcb_discard_reply(xcb, pointer_cookie.sequence);
+		pointer_requested = FALSE;
+	}
+}
+#endif
+
+// get the location of the pointer (in root window coordinates)
+void
+x11_query_cursor_location(GdkPoint* c)
+{
+#ifdef HAVE_XCB
+	x11_request_cursor_location();
+	pointer_requested = FALSE;
+
+	xcb_query_pointer_reply_t* r = xcb_query_pointer_reply(xcb, pointer_cookie, NULL);
+	if (r) {
+		c->x = r->root_x;
+		c->y = r->root_y;
+		free(r);
+	} else {
+		c->x = c->y = -1;
+	}
+#else
 	Window root_return, w;
 	int wx, wy;
 	unsigned int mask;
-	GdkPoint c;
 	XQueryPointer(display, root_window, &root_return, &w,
-			&c.x, &c.y, &wx, &wy, &mask);
+			&c->x, &c->y, &wx, &wy, &mask);
+#endif
+}
 
-	c.x -= src_rect.x;
-	c.y -= src_rect.y;
+// update the location of the cursor in a session (given in root window
+// coordinates)
+void
+x11_move_session_cursor(struct x11_session* s, GdkPoint c)
+{
+	// cursor is outside the duplicated screens (unless found in a source)
+	GdkPoint m = { -1, -1 };
 
-	if ((c.x<0) | (c.y<0) | (c.x>=src_rect.width) | (c.y>=src_rect.height))
+	int i;
+	for (i=0 ; i<s->session->n_sources ; i++)
 	{
-		// cursor is outside the duplicated screen
-		c.x = c.y = -1;
+		const struct source* src = &s->session->sources[i];
+		int x = c.x - src->rect.x;
+		int y = c.y - src->rect.y;
+		if ((x>=0) & (y>=0) & (x<src->rect.width) & (y<src->rect.height))
+		{
+			// location in the tile
+			m.x = src->tile.x + x * src->tile.width  / src->rect.width;
+			m.y = src->tile.y + y * src->tile.height / src->rect.height;
+			break;
+		}
 	}
 
 	// cursor was really moved
-	cursor = c;
+	s->cursor = m;
 
-	if (cursor.x >= 0) {
+	if (m.x >= 0) {
 		/* raise the window when the pointer enters the duplicated screen */
-		squint_show();
+		x11_show_session(s, TRUE);
 	} else {
 		/* lower the window when the pointer leaves the duplicated screen */
-		squint_hide();
+		x11_show_session(s, FALSE);
 	}
 
 	// update the offsets and redraw the cursor
-	gboolean updated = x11_fix_offset();
-	x11_redraw_cursor(!updated);
-	if (updated) {
-		XClearWindow(display, window);
+	struct x11_output* o;
+	for (o=s->outputs ; o<s->outputs+s->n_outputs ; o++) {
+		o->moved = x11_fix_offset(o);
 	}
+	x11_redraw_cursor(s, TRUE);
+}
+
+// update the location of the cursor (given in root window coordinates)
+void
+x11_move_cursor(GdkPoint c)
+{
+	struct x11_session* s;
+	for (s=x11_sessions ; s<x11_sessions+n_sessions ; s++) {
+		x11_move_session_cursor(s, c);
+	}
+}
+
+void
+x11_refresh_cursor_location(gboolean force)
+{
+	GdkPoint c;
+	x11_query_cursor_location(&c);
+	x11_move_cursor(c);
 }
 
+// return TRUE if the location of the cursor must be polled (because it
+// cannot be tracked)
 gboolean
-x11_refresh_image(const GdkRectangle* damaged_rect)
+x11_must_poll_cursor()
 {
+	return !replay_records
 #ifdef HAVE_XI
-	if (!can_track_cursor)
+	    && !can_track_cursor
 #endif
-	{
+	;
+}
+
+// poll the location of the cursor (if it cannot be tracked)
+void
+x11_poll_cursor_location()
+{
+	if (x11_must_poll_cursor()) {
 		x11_refresh_cursor_location(FALSE);
 	}
-
-	// location of the damaged area relative to the source rect
-	int x = damaged_rect->x - src_rect.x;
-	int y = damaged_rect->y - src_rect.y;
-
-	x11_clear_cursor();
-
-	XCopyArea (display, root_window, pixmap, gc,
-			damaged_rect->x,     damaged_rect->y,
-			damaged_rect->width , damaged_rect->height,
-			x, y);
-
-	x11_draw_cursor();
-
-	// redraw the damaged area
-	XClearArea(display, window, x, y, damaged_rect->width, damaged_rect->height, FALSE);
-
-	XFlush (display);
-
-	return TRUE;
 }
 
-#ifdef HAVE_XDAMAGE
-void x11_try_refresh_image (Time timestamp, const GdkRectangle* damaged_rect);
-
-gboolean 
-x11_try_refresh_image_timeout (gpointer data)
+#ifdef HAVE_XI
+// apply the pending pointer motion
+void
+x11_flush_cursor_motion()
 {
-	refresh_timeout=0;
+	if (!motion_pending) {
+		return;
+	}
+	motion_pending = FALSE;
+	if (motion_timer) {
+		x11_capture_remove(motion_timer);
+		motion_timer = 0;
+	}
 
-	if ((Time)data == next_refresh)
-	{
-		x11_try_refresh_image(next_refresh, NULL);
+	GdkPoint c = motion_location;
+	if (motion_queried) {
+		motion_queried = FALSE;
+		x11_query_cursor_location(&c);
 	}
-	return FALSE;
+	record_motion(&c);
+	x11_move_cursor(c);
+}
+
+gboolean
+x11_on_motion_timer(gpointer data)
+{
+	motion_timer = 0;
+	x11_flush_cursor_motion();
+	return G_SOURCE_REMOVE;
 }
 
+// the pointer was moved (to 'location', or to an unknown location if NULL)
 void
-x11_try_refresh_image (Time timestamp, const GdkRectangle* damaged_rect)
+x11_on_cursor_motion(const GdkPoint* location)
 {
-	static GdkRectangle acc = { 0, 0, 0, 0 };
-	if (damaged_rect != NULL) {
-		if (acc.width == 0) {
-			acc = *damaged_rect;
-		} else {
-			gdk_rectangle_union(damaged_rect, &acc, &acc);
-		}
+	if (location) {
+		motion_location = *location;
+		motion_queried = FALSE;
+	} else {
+		motion_queried = TRUE;
 	}
 
-	if ((timestamp >= next_refresh) || (timestamp < next_refresh - 1000)) {
-		if (refresh_timeout) {
-			g_source_remove(refresh_timeout);
-			refresh_timeout=0;
-		}
-		next_refresh = timestamp + min_refresh_period;
-		if (acc.width) {
-			x11_refresh_image(&acc);
-			acc.width = 0;
-		}
-
-	} else if (!refresh_timeout) {
-		refresh_timeout = g_timeout_add (next_refresh - timestamp, x11_try_refresh_image_timeout, (gpointer)next_refresh);
+	if (motion_pending) {
+		// (already scheduled)
+		return;
+	}
+	motion_pending = TRUE;
+#ifdef HAVE_XDAMAGE
+	if (damage) {
+		// applied at the beginning of the next frame
+		pacing_schedule();
+		return;
 	}
+#endif
+	motion_timer = x11_capture_add(CURSOR_MOTION_PERIOD, x11_on_motion_timer, NULL);
 }
 #endif
 
-
-
-#ifdef COPY_CURSOR
+#ifdef HAVE_XSHM
+// capture a rectangle of the source screen (in root window coordinates) into
+// the shm_frame of a session and upload it into its pixmap
 void
-x11_refresh_cursor_image()
+x11_shm_capture(struct x11_session* s, const GdkRectangle* r)
 {
-	XFixesCursorImage* img = XFixesGetCursorImage (display);
-	if (!img)
-		return;
-
-	int width  = (img->width  < CURSOR_SIZE) ? img->width  : CURSOR_SIZE;
-	int height = (img->height < CURSOR_SIZE) ? img->height : CURSOR_SIZE;
-
-	int x, y;
-	// copy the cursor image
-	for(y=0 ; y<height ; y++)
+	// (a single source, drawn at 0,0)
+	const GdkRectangle* src_rect = &s->session->sources[0].rect;
+	XImage* shm_frame = s->shm_frame;
+	int x = r->x - src_rect->x;
+	int y = r->y - src_rect->y;
+	int bpp = shm_frame->bits_per_pixel / 8;
+
+	// fetch the rectangle into the scratch area
+	XImage img = *shm_frame;
+	img.width  = r->width;
+	img.height = r->height;
+	img.bytes_per_line = ((r->width * shm_frame->bits_per_pixel + 31) / 32) * 4;
+	img.data = s->shm_scratch;
+	XShmGetImage(display, root_window, &img, r->x, r->y, AllPlanes);
+
+	// copy it into the frame
+	int row;
+	for (row=0 ; row<r->height ; row++)
 	{
-		for(x=0 ; x<width ; x++)
-		{
-			cursor_pixels[y*CURSOR_SIZE + x] = img->pixels[y*img->width + x];
-		}
+		memcpy(shm_frame->data + (y+row) * shm_frame->bytes_per_line + x * bpp,
+			s->shm_scratch + row * img.bytes_per_line,
+			r->width * bpp);
 	}
 
-	// clear the cursor_pixmap and upload the new image
-	XFillRectangle(display, cursor_pixmap, cursor_gc, 0, 0, CURSOR_SIZE, CURSOR_SIZE);
-	XPutImage(display, cursor_pixmap, cursor_gc, cursor_image,
-			0, 0, 0, 0, width, height);
-	cursor_xhot = img->xhot;
-	cursor_yhot = img->yhot;
-
-	XFree(img);
-
-	x11_redraw_cursor(TRUE);
+	XShmPutImage(display, s->pixmap, gc, shm_frame, x, y, x, y,
+			r->width, r->height, False);
 }
+#endif
 
-void
-x11_init_copy_cursor()
+// compute the area of the tile of a source covered by a rectangle of the
+// source monitor (in root window coordinates)
+//
+// return FALSE if they do not intersect
+gboolean
+x11_source_to_tile(const struct source* src, const GdkRectangle* in, GdkRectangle* out)
 {
-	// ensure we are in true color
-	if (XDefaultDepth(display, screen) != 24) {
+	GdkRectangle r;
+	if (!gdk_rectangle_intersect(in, &src->rect, &r)) {
+		return FALSE;
+	}
+	r.x -= src->rect.x;
+	r.y -= src->rect.y;
+
+	// (rounded outwards when the tile is scaled)
+	int x0 = r.x * src->tile.width  / src->rect.width;
+	int y0 = r.y * src->tile.height / src->rect.height;
+	int x1 = ((r.x + r.width)  * src->tile.width  + src->rect.width  - 1) / src->rect.width;
+	int y1 = ((r.y + r.height) * src->tile.height + src->rect.height - 1) / src->rect.height;
+
+	out->x = src->tile.x + x0;
+	out->y = src->tile.y + y0;
+	out->width  = x1 - x0;
+	out->height = y1 - y0;
+	return TRUE;
+}
+
+// draw an area of the tile of a source (in mirror coordinates)
+void
+x11_draw_tile_area(struct x11_session* s, int index, const GdkRectangle* area)
+{
+	const struct source* src = &s->session->sources[index];
+#ifdef HAVE_XRENDER
+	if (s->tile_pictures[index]) {
+		XRenderComposite(display, PictOpSrc, s->tile_pictures[index], None,
+				s->canvas_picture,
+				area->x, area->y, 0, 0,
+				area->x, area->y, area->width, area->height);
 		return;
 	}
+#endif
+#ifdef WINDOW_PIXMAP
+	if (s->window_pixmaps[index]) {
+		XCopyArea (display, s->window_pixmaps[index], s->canvas, gc,
+				area->x - src->tile.x,
+				area->y - src->tile.y,
+				area->width, area->height,
+				area->x, area->y);
+		return;
+	}
+#endif
+	XCopyArea (display, root_window, s->canvas, gc,
+			area->x - src->tile.x + src->rect.x,
+			area->y - src->tile.y + src->rect.y,
+			area->width, area->height,
+			area->x, area->y);
+}
 
-	// ensure the screen supports 32 bit depth
+// copy the damaged area of the source screens of a session into its windows
+//
+// 'damaged' is given in root window coordinates, every rectangle is copied
+// into the tiles it covers (in a single pass), then the updated areas are
+// redrawn in the windows
+void
+x11_refresh_region(struct x11_session* s, const struct region* damaged)
+{
+	const struct session* session = s->session;
+	struct region painted;	// (mirror coordinates)
+	GdkRectangle t;
+	int i, j;
+	region_clear(&painted);
+
+	trace_begin("refresh");
+	x11_clear_cursor(s);
+
+	trace_begin("copy");
+	for (i=0 ; i<damaged->n ; i++)
 	{
-		int depth_count = 0;
-		int* depths = XListDepths(display, screen, &depth_count);
-		if (depths == NULL) {
-			return;
-		}
-		int i;
-		for (i=depth_count-1 ; i>=0 ; i--) {
-			if (depths[i] == 32) {
-				break;
+		const GdkRectangle* r = &damaged->rects[i];
+#ifdef HAVE_XSHM
+		if (s->shm_frame) {
+			// (a single source, drawn at 0,0)
+			const GdkRectangle* src_rect = &session->sources[0].rect;
+			if (shm_tiles) {
+				// already fetched by x11_refresh_tiles()
+				XShmPutImage(display, s->pixmap, gc, s->shm_frame,
+						r->x - src_rect->x, r->y - src_rect->y,
+						r->x - src_rect->x, r->y - src_rect->y,
+						r->width, r->height, False);
+			} else {
+				x11_shm_capture(s, r);
 			}
+			t = (GdkRectangle){ r->x - src_rect->x, r->y - src_rect->y,
+						r->width, r->height };
+			region_add(&painted, &t);
+			continue;
 		}
-		XFree(depths);
-		if (i < 0) {
-			return;
+#endif
+		for (j=0 ; j<session->n_sources ; j++) {
+			if (x11_source_to_tile(&session->sources[j], r, &t)) {
+				x11_draw_tile_area(s, j, &t);
+				region_add(&painted, &t);
+			}
 		}
 	}
 
-	// check if xfixes and xrender are available on this display
-	int major=1, minor=0, event_base, error_base;
-	if ((	   !XFixesQueryExtension(display, &xfixes_event_base, &error_base)
-		|| !XFixesQueryVersion(display, &major, &minor)
-		|| (major<1)
-		|| !XRenderQueryExtension(display, &event_base, &error_base)
-	)) {
-		return;
+	// the tiles drawn on top of the others are drawn again where they
+	// were overwritten
+	for (j=1 ; s->overlapping && (j<session->n_sources) ; j++) {
+		for (i=0 ; i<painted.n ; i++) {
+			if (gdk_rectangle_intersect(&painted.rects[i], &session->sources[j].tile, &t)) {
+				x11_draw_tile_area(s, j, &t);
+			}
+		}
 	}
+	trace_end("copy");
 
-	// create an image for storing the cursor
-	cursor_pixels = (uint32_t*) malloc(CURSOR_PIXELS_SIZE);
-	cursor_image = XCreateImage(display, NULL, 32, ZPixmap, 0, (char*)cursor_pixels,
-				CURSOR_SIZE, CURSOR_SIZE, 32, 4*CURSOR_SIZE);
-	if (!cursor_image) {
-		squint_error("XCreateImage() failed");
-		return;
+	x11_draw_cursor(s);
+
+	// redraw the damaged area
+	trace_begin("clear");
+	for (i=0 ; i<painted.n ; i++)
+	{
+		const GdkRectangle* r = &painted.rects[i];
+		x11_update_window_area(s, r->x, r->y, r->width, r->height);
 	}
+	x11_commit_window(s);
+	trace_end("clear");
 
-	// create a pixmap for storing the cursor
-	cursor_pixmap = XCreatePixmap(display, root_window,
-				CURSOR_SIZE, CURSOR_SIZE, 32);
+	trace_begin("flush");
+	XFlush (display);
+	trace_end("flush");
+	trace_end("refresh");
 
-	// create a context for manipulating the cursor pixmap (must have 32-bit depth)
-	cursor_gc = XCreateGC(display, cursor_pixmap, 0, NULL);
-	if(!cursor_gc) {
-		squint_error("XCreateGC() failed");
-		return;
+	stats_frame((guint64)region_area(&painted) * 4);
+}
+
+// refresh a rectangle (in root window coordinates) in all the sessions
+gboolean
+x11_refresh_image(const GdkRectangle* damaged_rect)
+{
+	x11_poll_cursor_location();
+
+	struct x11_session* s;
+	for (s=x11_sessions ; s<x11_sessions+n_sessions ; s++)
+	{
+		struct region rg;
+		GdkRectangle r;
+		int i;
+		region_clear(&rg);
+		for (i=0 ; i<s->session->n_sources ; i++) {
+			if (gdk_rectangle_intersect(&s->session->sources[i].rect, damaged_rect, &r)) {
+				region_add(&rg, &r);
+			}
+		}
+		if (!region_is_empty(&rg)) {
+			x11_refresh_region(s, &rg);
+		}
 	}
 
-	// create a picture for the cursor_pixmap
-	cursor_picture = XRenderCreatePicture(display, cursor_pixmap,
-			XRenderFindStandardFormat(display, PictStandardARGB32),
-			0, NULL);
+	return TRUE;
 }
 
-void
-x11_enable_copy_cursor()
+#ifdef HAVE_XSHM
+// fetch the whole source screen and refresh the tiles that changed since the
+// previous call
+gboolean
+x11_refresh_tiles()
 {
-	if (copy_cursor || (cursor_picture == 0)) {
-		return;
+	struct x11_session* s = &x11_sessions[0];
+	const GdkRectangle* src_rect = &s->session->sources[0].rect;
+	struct region rg;
+	region_clear(&rg);
+
+	x11_poll_cursor_location();
+
+	trace_begin("tiles");
+	XShmGetImage(display, root_window, s->shm_frame, src_rect->x, src_rect->y, AllPlanes);
+	tiles_update(s->shm_frame->data, s->shm_frame->bytes_per_line,
+			s->shm_frame->bits_per_pixel / 8,
+			src_rect->x, src_rect->y, &rg);
+	trace_end("tiles");
+
+	if (!region_is_empty(&rg)) {
+		x11_refresh_region(s, &rg);
 	}
 
-	// create a picture for the main pixmap
-	pixmap_picture = XRenderCreatePicture(display, pixmap,
-			XRenderFindStandardFormat(display, PictStandardRGB24),
-			0, NULL);
-
-	copy_cursor = TRUE;
+	return TRUE;
+}
+#endif
 
-	// refresh the cursor
-	x11_refresh_cursor_image();
+#ifdef HAVE_XDAMAGE
+void x11_try_refresh_image (Time timestamp);
 
-	x11_refresh_cursor_location(TRUE);
+// record the time of the oldest damage included in the next frame
+void
+x11_mark_damage_time(Time timestamp)
+{
+	if (!frame_damage_time) {
+		frame_damage_time = timestamp;
+		frame_damage_received = g_get_monotonic_time();
+	}
+}
 
-	// request cursor change notifications
-	XFixesSelectCursorInput(display, gdk_x11_window_get_xid(gdkwin), XFixesCursorNotify);
+// report the latency between a damage (server time and reception time) and
+// the display of the frame (monotonic time in µs)
+void
+x11_report_latency(Time damage_time, gint64 damage_received, gint64 now)
+{
+	gint32 age = (gint32)((guint32)(now / 1000) - (guint32)damage_time);
+	if ((age < 0) || (age > 60000)) {
+		age = (now - damage_received) / 1000;
+	}
+	stats_latency(age);
 }
 
+// report the age of the oldest damage included in the frame that was just
+// flushed
+//
+// X server timestamps are usually taken from CLOCK_MONOTONIC (like
+// g_get_monotonic_time()). If the clocks do not match (eg: remote display),
+// then the latency is measured from the reception of the event.
 void
-x11_disable_copy_cursor()
+x11_report_damage_latency()
 {
-	if (!copy_cursor) {
+	if (!frame_damage_time) {
 		return;
 	}
-	copy_cursor = FALSE;
 
-	if (pixmap_picture) {
-		XRenderFreePicture(display, pixmap_picture);
-		pixmap_picture = 0;
+#ifdef HAVE_XPRESENT
+	if (present) {
+		// reported when the frame is actually displayed (on the first
+		// output of the first session)
+		struct x11_output* o = &x11_sessions[0].outputs[0];
+		if (!o->present_damage_time) {
+			o->present_damage_time     = frame_damage_time;
+			o->present_damage_received = frame_damage_received;
+		}
+		frame_damage_time = 0;
+		return;
 	}
-}
 #endif
 
+	x11_report_latency(frame_damage_time, frame_damage_received,
+			g_get_monotonic_time());
+	frame_damage_time = 0;
+}
 
+// handle a damaged rectangle (in root window coordinates)
+//
+// 'more' is set if other rectangles are following (they are accumulated to
+// be handled at once)
 void
-x11_show_active_window()
+x11_on_damage(Time timestamp, const GdkRectangle* area, gboolean more)
 {
-	if (!active_window)
-		return;
-
-	// check if it overlaps more whith the src or the dst window
-	GdkRectangle inter_src, inter_dst;
-	gdk_rectangle_intersect(&active_window_rect, &src_rect, &inter_src);
-	gdk_rectangle_intersect(&active_window_rect, &dst_rect, &inter_dst);
+	struct x11_session* s;
+	for (s=x11_sessions ; s<x11_sessions+n_sessions ; s++)
+	{
+		if (x11_compute_damaged_rect(s, area, &s->damage_acc)) {
+			// source screen damaged
+			x11_mark_damage_time(timestamp);
+		}
+	}
 
-	if((inter_src.height*inter_src.width) > (inter_dst.height*inter_dst.width))
+	if (!more)
 	{
-		// the active window overlaps more with the source screen
-		squint_show();
-	} else {
-		// the active window overlaps more with the destination screen
-		squint_hide();
+		gboolean damaged = FALSE;
+		for (s=x11_sessions ; s<x11_sessions+n_sessions ; s++) {
+			if (!region_is_empty(&s->damage_acc)) {
+				region_union(&s->frame_damage, &s->damage_acc);
+				region_clear(&s->damage_acc);
+				damaged = TRUE;
+			}
+		}
+		if (damaged) {
+			x11_try_refresh_image(timestamp);
+		}
 	}
 }
 
+#ifdef WINDOW_PIXMAP
+// handle a damage notification of a tracked window
+//
+// return FALSE if it does not come from a tracked window
 gboolean
-x11_get_window_geometry(Window w, GdkRectangle* r)
+x11_on_window_damage(const XDamageNotifyEvent* ev)
 {
-	gboolean result;
-	Window root;
-	int x, y;
-	unsigned int width, height, border_width, depth;
-
-	gdk_x11_display_error_trap_push(gdisplay);
-
-	if (XGetGeometry(display, w, &root, &x, &y, &width, &height,
-			&border_width, &depth))
+	int i, j;
+	for (i=0 ; i<n_sessions ; i++)
 	{
-		r->x = x - border_width;
-		r->y = y - border_width;
-		r->width  = width  + 2*border_width;
-		r->height = height + 2*border_width;
+		struct x11_session* s = &x11_sessions[i];
+		for (j=0 ; j<sessions[i].n_sources ; j++)
+		{
+			if (s->window_damages[j] != ev->damage) {
+				continue;
+			}
 
-		result = TRUE;
-	} else {
-		result = FALSE;
+			// (in window coordinates)
+			const struct source* src = &sessions[i].sources[j];
+			GdkRectangle rect = {
+				ev->area.x + src->rect.x, ev->area.y + src->rect.y,
+				ev->area.width,           ev->area.height
+			};
+			region_add(&s->frame_damage, &rect);
+			x11_mark_damage_time(ev->timestamp);
+			if (!ev->more) {
+				x11_try_refresh_image(ev->timestamp);
+			}
+			return TRUE;
+		}
 	}
-	gdk_x11_display_error_trap_pop_ignored(gdisplay);
+	return FALSE;
+}
+#endif
 
-	return result;
+// refresh all the sessions that were damaged
+void
+x11_produce_frame()
+{
+#ifdef HAVE_XI
+	x11_flush_cursor_motion();
+#endif
+	gboolean refreshed = FALSE;
+	struct x11_session* s;
+	for (s=x11_sessions ; s<x11_sessions+n_sessions ; s++) {
+		if (!region_is_empty(&s->frame_damage)) {
+			if (!refreshed) {
+				x11_poll_cursor_location();
+			}
+			x11_refresh_region(s, &s->frame_damage);
+			region_clear(&s->frame_damage);
+			refreshed = TRUE;
+		}
+	}
+	if (refreshed) {
+		x11_report_damage_latency();
+	}
+	frame_damage_time = 0;
+#ifdef HAVE_XCB
+	x11_discard_cursor_location();
+#endif
 }
 
+// produce a frame (called by the pacing scheduler)
 void
-x11_refresh_active_window_geometry()
+x11_on_frame()
 {
-	if(!active_window)
+#ifdef ASYNC_DAMAGE
+	if (damage_region_requested || damage_region_received) {
+		// (produced after the pending one)
+		frame_deferred = TRUE;
+		return;
+	}
+#endif
+#ifdef HAVE_XCB
+	// (the location is read after fetching the damage)
+	if (x11_must_poll_cursor()
+#ifdef HAVE_XI
+	    || (motion_pending && motion_queried)
+#endif
+	) {
+		x11_request_cursor_location();
+	}
+#endif
+#ifdef ASYNC_DAMAGE
+	if (damage_pending) {
+		// the frame is produced by x11_on_damage_region_reply()
+		x11_request_damage_region(frame_damage_timestamp);
+		xcb_flush(xcb);
 		return;
+	}
+#elif defined(ADAPTIVE_DAMAGE)
+	x11_fetch_damage(frame_damage_timestamp);
+#endif
+	x11_produce_frame();
+}
 
-	// ignore X11 errors (this function can produce BadWindow errors since
-	// it makes queries on windows controlled by other applications)
-	gdk_x11_display_error_trap_push(gdisplay);
+// request the time of the next vblank of the destination monitor (the frames
+// are paced on the first output of the first session)
+void
+x11_sync_vblank()
+{
+#ifdef HAVE_XPRESENT
+	struct x11_output* o = &x11_sessions[0].outputs[0];
+	if (o->present_eid) {
+		XPresentNotifyMSC(display, o->window, 0, 0, 0, 0);
+	}
+#endif
+}
 
-	{
-		Window w = active_window;
-		Window root, parent, *children;
-		unsigned int nchildren;
+// schedule the refresh of the damaged regions
+void
+x11_try_refresh_image (Time timestamp)
+{
+	trace_begin("coalesce");
+	frame_damage_timestamp = timestamp;
 
-		// identify the top-level window
-		parent = w;
-		while(parent != root_window)
-		{
-			w = parent;
-			if(!XQueryTree(display, w, &root, &parent, &children, &nchildren))
-				goto err;
-			XFree(children);
-		}
-		
-		// get its coordinates
-		x11_get_window_geometry(w, &active_window_rect);
+	if (!pacing_schedule()) {
+		// the damage will be merged into the next frame
+		stats_coalesced();
 	}
-err:	
-	gdk_x11_display_error_trap_pop_ignored(gdisplay);
+	trace_end("coalesce");
 }
+#endif
 
-Window
-x11_get_active_window()
-{
-	Window result = 0;
-	Window* w;
-	Atom actual_type_return;
-	int  actual_format_return;
-	unsigned long nitems_return, bytes_after_return;
 
-	if (XGetWindowProperty(display, root_window, net_active_window_atom, 0, 1,
-			FALSE, AnyPropertyType,	&actual_type_return,
-			&actual_format_return, &nitems_return,
-			&bytes_after_return, (unsigned char**)&w)
-		== Success)
+
+#ifdef COPY_CURSOR
+// find a cursor in the cache (by serial, or by name if it has one)
+struct cursor*
+x11_find_cursor(unsigned long serial, Atom name)
+{
+	int i;
+	for (i=0 ; i<CURSOR_CACHE_SIZE ; i++)
 	{
-		result = *w;
-		XFree(w);
+		struct cursor* c = &cursor_cache[i];
+		if (c->serial && ((c->serial == serial) || (name && (c->name == name)))) {
+			return c;
+		}
 	}
-	return result;
+	return NULL;
 }
 
+#ifdef OVERLAY_CURSOR
+// upload the image of a cursor (in cursor_pixels) as an opaque pixmap and a
+// shape mask
 void
-x11_active_window_stop_monitoring()
+x11_load_overlay_cursor(struct cursor* c, XImage* img)
 {
-	if (!gdk_x11_window_lookup_for_display(gdisplay, active_window))
+	int x, y;
+	int stride = (c->width + 7) / 8;
+	char* bits = g_malloc0(stride * c->height);
+	for(y=0 ; y<c->height ; y++)
 	{
-		// ignore X11 errors (this function can produce BadWindow errors since
-		// it makes queries on windows controlled by other applications)
-		gdk_x11_display_error_trap_push(gdisplay);
-
-		XSetWindowAttributes attr;
-		attr.event_mask = 0;
-		XChangeWindowAttributes(display, active_window, CWEventMask, &attr);
+		for(x=0 ; x<c->width ; x++)
+		{
+			uint32_t* p = &cursor_pixels[y*c->width + x];
+			guint a = *p >> 24;
+			if (a < 0x80) {
+				continue;
+			}
 
-		gdk_x11_display_error_trap_pop_ignored(gdisplay);
-	} 
-	active_window = 0;
+			// (the pixels are premultiplied)
+			guint r = (*p >> 16) & 0xff, g = (*p >> 8) & 0xff, b = *p & 0xff;
+			*p = 0xff000000 | (MIN(255, r*255/a) << 16) | (MIN(255, g*255/a) << 8)
+				| MIN(255, b*255/a);
+			bits[y*stride + x/8] |= 1 << (x%8);
+		}
+	}
+	c->mask = XCreateBitmapFromData(display, root_window, bits, c->width, c->height);
+	g_free(bits);
+
+	img->depth = depth;
+	c->pixmap = XCreatePixmap(display, root_window, c->width, c->height, depth);
+	XPutImage(display, c->pixmap, gc, img, 0, 0, 0, 0, c->width, c->height);
+	c->picture = 0;
+	stats_cursor(c->width * c->height * 4);
 }
 
+// move the overlay cursor of an output to the location of the cursor
 void
-x11_active_window_start_monitoring()
+x11_move_overlay_cursor(struct x11_output* o)
 {
-	if (active_window)
-		x11_active_window_stop_monitoring();
-
-	if (config.opt_passive)
+	const GdkPoint cursor = o->owner->cursor;
+	const struct cursor* c = current_cursor;
+	if (!o->cursor_window) {
 		return;
-
-	active_window = x11_get_active_window();
-	if (!active_window)
+	}
+	if ((cursor.x < 0) || !c) {
+		if (o->cursor_mapped) {
+			XUnmapWindow(display, o->cursor_window);
+			o->cursor_mapped = FALSE;
+		}
 		return;
+	}
 
-	x11_refresh_active_window_geometry();
-	if (!memcmp(&active_window_rect, &root_window_rect, sizeof(GdkRectangle))) {
-		// same geometry as the root window
-		// -> ignore it
-		// TODO: make the match more loose
-		active_window = 0;
+	// location of the hotspot in the parent of the output window
+	int x = o->offset.x + cursor.x;
+	int y = o->offset.y + cursor.y;
+#ifdef HAVE_XRENDER
+	if (transformed) {
+		const double* m = o->output_transform;
+		x = o->offset.x + (int) (m[0] * cursor.x + m[1] * cursor.y + m[2]);
+		y = o->offset.y + (int) (m[3] * cursor.x + m[4] * cursor.y + m[5]);
+	}
+#endif
+	XMoveWindow(display, o->cursor_window, x - c->xhot, y - c->yhot);
+	if (!o->cursor_mapped) {
+		XMapRaised(display, o->cursor_window);
+		o->cursor_mapped = TRUE;
+	}
+}
+
+// display the current cursor in the overlay of an output
+void
+x11_set_overlay_cursor(struct x11_output* o)
+{
+	const struct cursor* c = current_cursor;
+	if (!o->cursor_window) {
 		return;
 	}
+	XResizeWindow(display, o->cursor_window, c->width, c->height);
+	XSetWindowBackgroundPixmap(display, o->cursor_window, c->pixmap);
+	XShapeCombineMask(display, o->cursor_window, ShapeBounding, 0, 0, c->mask, ShapeSet);
+	XClearWindow(display, o->cursor_window);
+	x11_move_overlay_cursor(o);
+}
+#endif
 
-	if (!gdk_x11_window_lookup_for_display(gdisplay, active_window))
-	{
-		// this is a foreign window
-		// -> we need to monitor it explicitely
-		
-		 
-		// ignore X11 errors (this function can produce BadWindow errors since
-		// it makes queries on windows controlled by other applications)
-		gdk_x11_display_error_trap_push(gdisplay);
+// allocate an entry of the cache for a new cursor (its pixels are to be
+// stored into cursor_pixels, then uploaded with x11_upload_cursor())
+struct cursor*
+x11_alloc_cursor(unsigned long serial, Atom name, int width, int height, int xhot, int yhot)
+{
+	// evict the least recently used entry
+	int i;
+	struct cursor* c = &cursor_cache[0];
+	for (i=1 ; (i<CURSOR_CACHE_SIZE) && c->serial ; i++) {
+		if (!cursor_cache[i].serial || (cursor_cache[i].last_use < c->last_use)) {
+			c = &cursor_cache[i];
+		}
+	}
+	if (c->serial) {
+		if (c->picture) {
+			XRenderFreePicture(display, c->picture);
+		}
+#ifdef OVERLAY_CURSOR
+		if (c->mask) {
+			XFreePixmap(display, c->mask);
+		}
+#endif
+		XFreePixmap(display, c->pixmap);
+	}
 
-		XSetWindowAttributes attr;
-		attr.event_mask = StructureNotifyMask;
-		XChangeWindowAttributes(display, active_window, CWEventMask, &attr);
+	c->serial = serial;
+	c->name   = name;
+	c->width  = MAX(1, MIN(width,  CURSOR_SIZE));
+	c->height = MAX(1, MIN(height, CURSOR_SIZE));
+	c->xhot   = xhot;
+	c->yhot   = yhot;
+	return c;
+}
 
-		gdk_x11_display_error_trap_pop_ignored(gdisplay);
+// upload the image of a cursor (in cursor_pixels) into a pixmap of its size
+void
+x11_upload_cursor(struct cursor* c)
+{
+	XImage tmp = *cursor_image;
+	tmp.width  = c->width;
+	tmp.height = c->height;
+	tmp.bytes_per_line = 4 * c->width;
+
+#ifdef OVERLAY_CURSOR
+	if (overlay_cursor) {
+		x11_load_overlay_cursor(c, &tmp);
+		return;
 	}
+#endif
+	c->pixmap = XCreatePixmap(display, root_window, c->width, c->height, 32);
+	XPutImage(display, c->pixmap, cursor_gc, &tmp,
+			0, 0, 0, 0, c->width, c->height);
+	c->picture = XRenderCreatePicture(display, c->pixmap,
+			XRenderFindStandardFormat(display, PictStandardARGB32),
+			0, NULL);
+	stats_cursor(c->width * c->height * 4);
 }
 
-GdkFilterReturn
-x11_on_x11_event (GdkXEvent *xevent, GdkEvent *event, gpointer data)
+void x11_set_current_cursor(struct cursor* c);
+
+#ifdef ASYNC_CURSOR
+// request the image of the current cursor (the reply is handled by the event
+// source)
+void
+x11_request_cursor_image()
 {
-	XEvent* ev = (XEvent*)xevent;
+	if (cursor_image_requested) {
+		// (superseded)
+		xcb_discard_reply(xcb, cursor_image_cookie.sequence);
+	}
+	cursor_image_cookie = xcb_xfixes_get_cursor_image_and_name(xcb);
+	cursor_image_requested = TRUE;
+	xcb_flush(xcb);
+}
 
-	if (ev->type == PropertyNotify)
-	{
-		XPropertyEvent* pn_ev = (XPropertyEvent*) ev;
-		if ((pn_ev->window == root_window) && (pn_ev->atom == net_active_window_atom))
+// return TRUE if the reply to x11_request_cursor_image() was received
+gboolean
+x11_poll_cursor_image()
+{
+	if (cursor_image_requested) {
+		xcb_generic_error_t* error = NULL;
+		if (xcb_poll_for_reply(xcb, cursor_image_cookie.sequence,
+				(void**) &cursor_image_reply, &error))
 		{
-			// property _NET_ACTIVE_WINDOW was changed
-			x11_active_window_start_monitoring();
-			x11_show_active_window();
-			return GDK_FILTER_REMOVE;
+			cursor_image_requested = FALSE;
+			free(error);
 		}
-		
 	}
+	return cursor_image_reply != NULL;
+}
 
-	if (ev->type == ConfigureNotify)
-	{
-		XConfigureEvent* c_ev = (XConfigureEvent*) ev;
-		if (c_ev->window == active_window)
+// handle the reply to x11_request_cursor_image(): upload the cursor into the
+// cache and display it
+void
+x11_on_cursor_image_reply()
+{
+	xcb_xfixes_get_cursor_image_and_name_reply_t* r = cursor_image_reply;
+	cursor_image_reply = NULL;
+
+	// (may be known by name)
+	struct cursor* c = x11_find_cursor(r->cursor_serial, r->cursor_atom);
+	if (c) {
+		c->serial = r->cursor_serial;
+	} else {
+		c = x11_alloc_cursor(r->cursor_serial, r->cursor_atom,
+				r->width, r->height, r->xhot, r->yhot);
+
+		if (r->width && r->height) {
+			int x, y;
+			const uint32_t* pixels = xcb_xfixes_get_cursor_image_and_name_cursor_image(r);
+			for(y=0 ; y<c->height ; y++)
+			{
+				for(x=0 ; x<c->width ; x++)
+				{
+					cursor_pixels[y*c->width + x] = pixels[y*r->width + x];
+				}
+			}
+		} else {
+			// empty cursor (no pixels sent): a transparent 1x1 image
+			cursor_pixels[0] = 0;
+		}
+		x11_upload_cursor(c);
+	}
+	free(r);
+	x11_set_current_cursor(c);
+}
+
+void
+x11_cancel_cursor_image_request()
+{
+	if (cursor_image_requested) {
+		xcb_discard_reply(xcb, cursor_image_cookie.sequence);
+		cursor_image_requested = FALSE;
+	}
+	free(cursor_image_reply);
+	cursor_image_reply = NULL;
+}
+#else
+// upload the current cursor image into the cache
+//
+// return NULL on failure
+struct cursor*
+x11_load_cursor()
+{
+	XFixesCursorImage* img = XFixesGetCursorImage (display);
+	if (!img)
+		return NULL;
+
+	// (may be known by name)
+	struct cursor* c = x11_find_cursor(img->cursor_serial, img->atom);
+	if (c) {
+		c->serial = img->cursor_serial;
+		XFree(img);
+		return c;
+	}
+
+	c = x11_alloc_cursor(img->cursor_serial, img->atom,
+			img->width, img->height, img->xhot, img->yhot);
+
+	if (img->width && img->height) {
+		int x, y;
+		// copy the cursor image (the pixels are longs)
+		for(y=0 ; y<c->height ; y++)
+		{
+			for(x=0 ; x<c->width ; x++)
+			{
+				cursor_pixels[y*c->width + x] = img->pixels[y*img->width + x];
+			}
+		}
+	} else {
+		// empty cursor (no pixels sent): a transparent 1x1 image
+		cursor_pixels[0] = 0;
+	}
+	XFree(img);
+
+	x11_upload_cursor(c);
+	return c;
+}
+#endif
+
+// the cursor was changed (to the cursor identified by 'serial' and 'name', or
+// to an unknown cursor if 'serial' is 0)
+void
+x11_refresh_cursor_image(unsigned long serial, Atom name)
+{
+	struct cursor* c = serial ? x11_find_cursor(serial, name) : NULL;
+	if (c) {
+		stats_cursor(0);
+#ifdef ASYNC_CURSOR
+		x11_cancel_cursor_image_request();
+#endif
+	} else {
+#ifdef ASYNC_CURSOR
+		// (displayed when the image is received)
+		x11_request_cursor_image();
+		return;
+#else
+		c = x11_load_cursor();
+		if (!c)
+			return;
+#endif
+	}
+	x11_set_current_cursor(c);
+}
+
+// display a cursor of the cache
+void
+x11_set_current_cursor(struct cursor* c)
+{
+	c->last_use = ++cursor_use_count;
+	current_cursor = c;
+
+	struct x11_session* s;
+#ifdef OVERLAY_CURSOR
+	if (overlay_cursor) {
+		struct x11_output* o;
+		for (s=x11_sessions ; s<x11_sessions+n_sessions ; s++) {
+			for (o=s->outputs ; o<s->outputs+s->n_outputs ; o++) {
+				x11_set_overlay_cursor(o);
+			}
+		}
+		return;
+	}
+#endif
+	for (s=x11_sessions ; s<x11_sessions+n_sessions ; s++) {
+		x11_redraw_cursor(s, TRUE);
+	}
+}
+
+void
+x11_init_copy_cursor()
+{
+	// ensure we are in true color
+	if (XDefaultDepth(display, screen) != 24) {
+		return;
+	}
+
+	// ensure the screen supports 32 bit depth
+	{
+		int depth_count = 0;
+		int* depths = XListDepths(display, screen, &depth_count);
+		if (depths == NULL) {
+			return;
+		}
+		int i;
+		for (i=depth_count-1 ; i>=0 ; i--) {
+			if (depths[i] == 32) {
+				break;
+			}
+		}
+		XFree(depths);
+		if (i < 0) {
+			return;
+		}
+	}
+
+	// check if xfixes and xrender are available on this display
+	int major=1, minor=0, event_base, error_base;
+	if ((	   !XFixesQueryExtension(display, &xfixes_event_base, &error_base)
+		|| !XFixesQueryVersion(display, &major, &minor)
+		|| (major<1)
+		|| !XRenderQueryExtension(display, &event_base, &error_base)
+	)) {
+		return;
+	}
+
+	// create an image for uploading the cursors (resized for each cursor)
+	cursor_pixels = (uint32_t*) malloc(CURSOR_PIXELS_SIZE);
+	cursor_image = XCreateImage(display, NULL, 32, ZPixmap, 0, (char*)cursor_pixels,
+				CURSOR_SIZE, CURSOR_SIZE, 32, 4*CURSOR_SIZE);
+	if (!cursor_image) {
+		squint_error("XCreateImage() failed");
+		return;
+	}
+
+	// create a context for manipulating the cursor pixmaps (must have 32-bit depth)
+	Pixmap pixmap = XCreatePixmap(display, root_window, 1, 1, 32);
+	cursor_gc = XCreateGC(display, pixmap, 0, NULL);
+	XFreePixmap(display, pixmap);
+	if(!cursor_gc) {
+		squint_error("XCreateGC() failed");
+		return;
+	}
+}
+
+#ifdef OVERLAY_CURSOR
+void
+x11_init_overlay_cursor()
+{
+	int event_base, error_base;
+	if (cursor_gc && XShapeQueryExtension(display, &event_base, &error_base)) {
+		overlay_cursor = TRUE;
+	}
+}
+#endif
+
+void
+x11_enable_copy_cursor()
+{
+	if (copy_cursor || (cursor_gc == NULL)) {
+		return;
+	}
+
+	// create a picture for the main pixmap (or the window) of each session
+	struct x11_session* s;
+	for (s=x11_sessions ; s<x11_sessions+n_sessions ; s++) {
+		s->pixmap_picture = XRenderCreatePicture(display, s->canvas,
+				s->direct ? XRenderFindVisualFormat(display, DefaultVisual(display, screen))
+					  : XRenderFindStandardFormat(display, PictStandardRGB24),
+				0, NULL);
+	}
+
+	copy_cursor = TRUE;
+
+	// refresh the cursor
+	x11_refresh_cursor_image(0, None);
+
+	x11_refresh_cursor_location(TRUE);
+
+	// request cursor change notifications
+	XFixesSelectCursorInput(display, gdk_x11_window_get_xid(sessions[0].outputs[0].gdkwin), XFixesCursorNotify);
+}
+
+void
+x11_disable_copy_cursor()
+{
+	if (!copy_cursor) {
+		return;
+	}
+	copy_cursor = FALSE;
+#ifdef ASYNC_CURSOR
+	x11_cancel_cursor_image_request();
+#endif
+
+	struct x11_session* s;
+	for (s=x11_sessions ; s<x11_sessions+n_sessions ; s++) {
+		if (s->pixmap_picture) {
+			XRenderFreePicture(display, s->pixmap_picture);
+			s->pixmap_picture = 0;
+		}
+	}
+}
+#endif
+
+#ifdef HAVE_XRENDER
+// return TRUE if the X server supports picture transforms (XRender 0.6)
+gboolean
+x11_query_render_transforms()
+{
+	int major=0, minor=0, event_base, error_base;
+	return     XRenderQueryExtension(display, &event_base, &error_base)
+		&& XRenderQueryVersion(display, &major, &minor)
+		&& ((major > 0) || (minor >= 6));
+}
+
+void
+x11_init_transform()
+{
+	if ((config.opt_scale == SCALE_NONE) && !config.opt_rotate
+	    && !config.opt_flip_h && !config.opt_flip_v) {
+		return;
+	}
+
+	if (!x11_query_render_transforms()) {
+		squint_error("The XRender extension is not available, the mirror cannot be scaled or rotated");
+		return;
+	}
+	can_transform = TRUE;
+}
+
+#ifdef WINDOW_PIXMAP
+void
+x11_init_window_pixmaps()
+{
+	// named window pixmaps require Composite 0.2
+	int major=0, minor=2, event_base, error_base;
+	if (	   !XCompositeQueryExtension(display, &event_base, &error_base)
+		|| !XCompositeQueryVersion(display, &major, &minor)
+		|| ((major == 0) && (minor < 2))
+	) {
+		return;
+	}
+	can_name_pixmap = TRUE;
+}
+#endif
+
+void
+x11_init_composite()
+{
+	if (config.opt_layout != LAYOUT_PIP) {
+		return;
+	}
+
+	if (!x11_query_render_transforms()) {
+		squint_error("The XRender extension is not available, falling back to the tiles layout");
+		config.opt_layout = LAYOUT_TILES;
+		return;
+	}
+	can_composite = TRUE;
+}
+
+// compute the transform of an output for its current size
+void
+x11_compute_transform(struct x11_output* o)
+{
+	double w = o->owner->session->mirror_width, h = o->owner->session->mirror_height;
+	double output_width = o->output_width, output_height = o->output_height;
+	double* m = o->output_transform;
+
+	// flips
+	double sx = config.opt_flip_h ? -1 : 1;
+	double sy = config.opt_flip_v ? -1 : 1;
+	double tx = config.opt_flip_h ? w : 0;
+	double ty = config.opt_flip_v ? h : 0;
+
+	// rotation (clockwise)
+	double rw = w, rh = h;
+	switch (config.opt_rotate)
+	{
+		case 0:
+			m[0] = sx; m[1] = 0;  m[2] = tx;
+			m[3] = 0;  m[4] = sy; m[5] = ty;
+			break;
+		case 90:
+			// (x,y) -> (h-y, x)
+			m[0] = 0;  m[1] = -sy; m[2] = h - ty;
+			m[3] = sx; m[4] = 0;   m[5] = tx;
+			rw = h; rh = w;
+			break;
+		case 180:
+			// (x,y) -> (w-x, h-y)
+			m[0] = -sx; m[1] = 0;   m[2] = w - tx;
+			m[3] = 0;   m[4] = -sy; m[5] = h - ty;
+			break;
+		case 270:
+			// (x,y) -> (y, w-x)
+			m[0] = 0;   m[1] = sy; m[2] = ty;
+			m[3] = -sx; m[4] = 0;  m[5] = w - tx;
+			rw = h; rh = w;
+			break;
+	}
+
+	// scaling
+	double kx = 1, ky = 1;
+	switch (config.opt_scale)
+	{
+		case SCALE_FIT:
+			kx = ky = MIN(output_width / rw, output_height / rh);
+			break;
+		case SCALE_FILL:
+			kx = ky = MAX(output_width / rw, output_height / rh);
+			break;
+		case SCALE_STRETCH:
+			kx = output_width  / rw;
+			ky = output_height / rh;
+			break;
+	}
+	int i;
+	for (i=0 ; i<3 ; i++) {
+		m[i]   *= kx;
+		m[3+i] *= ky;
+	}
+
+	// center
+	m[2] += (output_width  - rw * kx) / 2;
+	m[5] += (output_height - rh * ky) / 2;
+
+	// XRender needs the inverse transform (from output to source)
+	double det = m[0] * m[4] - m[1] * m[3];
+	XTransform t = {{
+		{ XDoubleToFixed( m[4] / det), XDoubleToFixed(-m[1] / det), XDoubleToFixed((m[1] * m[5] - m[2] * m[4]) / det) },
+		{ XDoubleToFixed(-m[3] / det), XDoubleToFixed( m[0] / det), XDoubleToFixed((m[2] * m[3] - m[0] * m[5]) / det) },
+		{ 0,                           0,                           XDoubleToFixed(1) },
+	}};
+	XRenderSetPictureTransform(display, o->source_picture, &t);
+}
+
+// compute the area of the output_pixmap covered by a rectangle of the pixmap
+void
+x11_transform_rect(struct x11_output* o, const GdkRectangle* in, GdkRectangle* out)
+{
+	const double* m = o->output_transform;
+	double x0 = G_MAXDOUBLE, y0 = G_MAXDOUBLE, x1 = -G_MAXDOUBLE, y1 = -G_MAXDOUBLE;
+	int i;
+	for (i=0 ; i<4 ; i++)
+	{
+		double x = in->x + ((i & 1) ? in->width  : 0);
+		double y = in->y + ((i & 2) ? in->height : 0);
+		double tx = m[0] * x + m[1] * y + m[2];
+		double ty = m[3] * x + m[4] * y + m[5];
+		x0 = MIN(x0, tx); x1 = MAX(x1, tx);
+		y0 = MIN(y0, ty); y1 = MAX(y1, ty);
+	}
+
+	// (one more pixel for the filter)
+	GdkRectangle r;
+	r.x = (int) x0 - 1;
+	r.y = (int) y0 - 1;
+	r.width  = (int) x1 + 2 - r.x;
+	r.height = (int) y1 + 2 - r.y;
+
+	GdkRectangle bounds = {0, 0, o->output_width, o->output_height};
+	if (!gdk_rectangle_intersect(&r, &bounds, out)) {
+		out->width = out->height = 0;
+	}
+}
+
+// (re)create the output pixmap with the size of the destination
+void
+x11_resize_transform(struct x11_output* o)
+{
+	if (o->output_picture) {
+		XRenderFreePicture(display, o->output_picture);
+		XFreePixmap(display, o->output_pixmap);
+	}
+
+	o->output_width  = o->rect.width;
+	o->output_height = o->rect.height;
+	o->output_pixmap = XCreatePixmap(display, root_window, o->output_width, o->output_height, depth);
+	o->output_picture = XRenderCreatePicture(display, o->output_pixmap,
+			XRenderFindVisualFormat(display, DefaultVisual(display, screen)),
+			0, NULL);
+
+	// the areas not covered by the source are black
+	XRenderColor black = {0, 0, 0, 0xffff};
+	XRenderFillRectangle(display, PictOpSrc, o->output_picture, &black,
+			0, 0, o->output_width, o->output_height);
+
+	x11_compute_transform(o);
+
+	if (o->window) {
+		XResizeWindow(display, o->window, o->output_width, o->output_height);
+#ifdef HAVE_XPRESENT
+		if (present) {
+			x11_alloc_present_buffers(o, o->output_width, o->output_height);
+			x11_present_frame(o);
+			return;
+		}
+#endif
+		XSetWindowBackgroundPixmap(display, o->window, o->output_pixmap);
+		x11_update_output_area(o, 0, 0, o->owner->session->mirror_width,
+				o->owner->session->mirror_height);
+		XClearWindow(display, o->window);
+	}
+}
+
+// set the filter used for scaling a picture (--filter)
+void
+x11_set_picture_filter(Picture picture)
+{
+	switch (config.opt_filter)
+	{
+		case FILTER_NEAREST:
+			XRenderSetPictureFilter(display, picture, FilterNearest, NULL, 0);
+			break;
+		case FILTER_BILINEAR:
+			XRenderSetPictureFilter(display, picture, FilterBilinear, NULL, 0);
+			break;
+		case FILTER_CONVOLUTION:
+		{
+			// 3x3 gaussian kernel
+			XFixed kernel[2 + 9];
+			static const int weights[9] = { 1, 2, 1,  2, 4, 2,  1, 2, 1 };
+			int i;
+			kernel[0] = XDoubleToFixed(3);
+			kernel[1] = XDoubleToFixed(3);
+			for (i=0 ; i<9 ; i++) {
+				kernel[2+i] = XDoubleToFixed(weights[i] / 16.0);
+			}
+			XRenderSetPictureFilter(display, picture, FilterConvolution, kernel, 2 + 9);
+			break;
+		}
+	}
+}
+
+// prepare the transformed output (if requested)
+//
+// return TRUE if the window must be backed by the output_pixmap
+gboolean
+x11_enable_transform(struct x11_output* o)
+{
+	if (!can_transform) {
+		return FALSE;
+	}
+
+	XRenderPictureAttributes attr;
+	attr.repeat = RepeatNone;
+	Picture source_picture = XRenderCreatePicture(display, o->owner->pixmap,
+			XRenderFindVisualFormat(display, DefaultVisual(display, screen)),
+			CPRepeat, &attr);
+	o->source_picture = source_picture;
+	x11_set_picture_filter(source_picture);
+
+	transformed = TRUE;
+	x11_resize_transform(o);
+	return TRUE;
+}
+
+void
+x11_disable_transform(struct x11_output* o)
+{
+	if (!o->source_picture) {
+		return;
+	}
+
+	XRenderFreePicture(display, o->source_picture);
+	XRenderFreePicture(display, o->output_picture);
+	XFreePixmap(display, o->output_pixmap);
+	o->source_picture = 0;
+	o->output_picture = 0;
+	o->output_pixmap = 0;
+}
+#endif
+
+#ifdef HAVE_XPRESENT
+void
+x11_init_present()
+{
+	// (also used for the vblank timestamps, see x11_sync_vblank())
+	int event_base, error_base, major=1, minor=0;
+	if (	   !XPresentQueryExtension(display, &present_opcode, &event_base, &error_base)
+		|| !XPresentQueryVersion(display, &major, &minor)
+	) {
+		present_opcode = 0;
+		if (config.opt_present) {
+			squint_error("The Present extension is not available");
+		}
+		return;
+	}
+	can_present = config.opt_present;
+}
+
+void
+x11_free_present_buffers(struct x11_output* o)
+{
+	int i;
+	for (i=0 ; i<2 ; i++) {
+#ifdef HAVE_XRENDER
+		if (o->present_pictures[i]) {
+			XRenderFreePicture(display, o->present_pictures[i]);
+			o->present_pictures[i] = 0;
+		}
+#endif
+		if (o->present_buffers[i]) {
+			XFreePixmap(display, o->present_buffers[i]);
+			o->present_buffers[i] = 0;
+		}
+	}
+}
+
+// (re)create the buffers of an output (with the size of its window)
+void
+x11_alloc_present_buffers(struct x11_output* o, int width, int height)
+{
+	x11_free_present_buffers(o);
+
+	o->present_width  = width;
+	o->present_height = height;
+
+	GdkRectangle all = {0, 0, width, height};
+	int i;
+	for (i=0 ; i<2 ; i++)
+	{
+		o->present_buffers[i] = XCreatePixmap(display, root_window, width, height, depth);
+#ifdef HAVE_XRENDER
+		if (transformed) {
+			o->present_pictures[i] = XRenderCreatePicture(display, o->present_buffers[i],
+					XRenderFindVisualFormat(display, DefaultVisual(display, screen)),
+					0, NULL);
+			// the areas not covered by the source are black
+			XRenderColor black = {0, 0, 0, 0xffff};
+			XRenderFillRectangle(display, PictOpSrc, o->present_pictures[i], &black,
+					0, 0, width, height);
+		}
+#endif
+		o->present_busy[i] = FALSE;
+		region_clear(&o->present_stale[i]);
+		region_add(&o->present_stale[i], &all);
+	}
+	region_clear(&o->present_update);
+	region_add(&o->present_update, &all);
+	o->present_back = 0;
+}
+
+// start presenting into the window of an output
+gboolean
+x11_enable_present(struct x11_output* o, int width, int height)
+{
+	if (present_opcode) {
+		o->present_eid = XPresentSelectInput(display, o->window,
+				PresentCompleteNotifyMask | PresentIdleNotifyMask);
+	}
+	if (!can_present) {
+		return FALSE;
+	}
+
+	present = TRUE;
+	o->present_in_flight = FALSE;
+	x11_alloc_present_buffers(o, width, height);
+
+	// the window has no background, the exposed areas are presented again
+	XSelectInput(display, o->window, ExposureMask);
+	return TRUE;
+}
+
+void
+x11_disable_present(struct x11_output* o)
+{
+	if (o->present_eid) {
+		XPresentFreeInput(display, o->window, o->present_eid);
+		o->present_eid = 0;
+	}
+	if (!present) {
+		return;
+	}
+
+	x11_free_present_buffers(o);
+#ifdef HAVE_XDAMAGE
+	o->present_damage_time = 0;
+	o->present_flight_damage_time = 0;
+#endif
+}
+
+// mark an area of the window of an output (in window coordinates) to be
+// presented
+void
+x11_present_area(struct x11_output* o, const GdkRectangle* r)
+{
+	region_add(&o->present_stale[0], r);
+	region_add(&o->present_stale[1], r);
+	region_add(&o->present_update, r);
+}
+
+// present the pending updates of an output (if the back buffer is available)
+void
+x11_present_frame(struct x11_output* o)
+{
+	int b = o->present_back;
+	if (o->present_in_flight || o->present_busy[b] || region_is_empty(&o->present_update)) {
+		return;
+	}
+
+	trace_begin("present");
+
+	// bring the back buffer up to date
+	int i;
+	for (i=0 ; i<o->present_stale[b].n ; i++)
+	{
+		const GdkRectangle* r = &o->present_stale[b].rects[i];
+#ifdef HAVE_XRENDER
+		if (transformed) {
+			XRenderComposite(display, PictOpSrc, o->source_picture, None, o->present_pictures[b],
+					r->x, r->y, 0, 0, r->x, r->y, r->width, r->height);
+			continue;
+		}
+#endif
+		XCopyArea(display, o->owner->pixmap, o->present_buffers[b], gc,
+				r->x, r->y, r->width, r->height, r->x, r->y);
+	}
+	region_clear(&o->present_stale[b]);
+
+	XRectangle rects[REGION_MAX_RECTS];
+	for (i=0 ; i<o->present_update.n ; i++)
+	{
+		rects[i].x      = o->present_update.rects[i].x;
+		rects[i].y      = o->present_update.rects[i].y;
+		rects[i].width  = o->present_update.rects[i].width;
+		rects[i].height = o->present_update.rects[i].height;
+	}
+	XserverRegion update = XFixesCreateRegion(display, rects, o->present_update.n);
+	region_clear(&o->present_update);
+
+	XPresentPixmap(display, o->window, o->present_buffers[b], ++o->present_serial,
+			None, update, 0, 0, None, None, None,
+			PresentOptionNone, 0, 0, 0, NULL, 0);
+	XFixesDestroyRegion(display, update);
+
+	o->present_busy[b] = TRUE;
+	o->present_in_flight = TRUE;
+	o->present_back = !b;
+
+#ifdef HAVE_XDAMAGE
+	o->present_flight_damage_time     = o->present_damage_time;
+	o->present_flight_damage_received = o->present_damage_received;
+	o->present_damage_time = 0;
+#endif
+	trace_end("present");
+}
+
+void
+x11_on_present_event(XGenericEventCookie* cookie)
+{
+	struct x11_output* o = NULL;
+
+	switch (cookie->evtype)
+	{
+	case PresentCompleteNotify:
+		{
+			XPresentCompleteNotifyEvent* e = cookie->data;
+			o = x11_find_output(e->window);
+			if (!o) {
+				break;
+			}
+			if (e->ust && (o == x11_sessions[0].outputs)) {
+				// ust is taken from CLOCK_MONOTONIC
+				// (the frames are paced on the first output)
+				pacing_vblank(e->ust);
+			}
+			if ((e->kind != PresentCompleteKindPixmap) || (e->serial_number != o->present_serial)) {
+				break;
+			}
+			o->present_in_flight = FALSE;
+#ifdef HAVE_XDAMAGE
+			if (o->present_flight_damage_time) {
+				x11_report_latency(o->present_flight_damage_time,
+						o->present_flight_damage_received,
+						e->ust ? (gint64)e->ust : g_get_monotonic_time());
+				o->present_flight_damage_time = 0;
+			}
+#endif
+			trace_begin("present_complete");
+			trace_end("present_complete");
+		}
+		break;
+
+	case PresentIdleNotify:
+		{
+			XPresentIdleNotifyEvent* e = cookie->data;
+			o = x11_find_output(e->window);
+			if (!o) {
+				break;
+			}
+			int i;
+			for (i=0 ; i<2 ; i++) {
+				if (e->pixmap == o->present_buffers[i]) {
+					o->present_busy[i] = FALSE;
+				}
+			}
+		}
+		break;
+	}
+
+	// the updates received meanwhile can be presented now
+	if (present && o) {
+		x11_present_frame(o);
+		XFlush(display);
+	}
+}
+#endif
+
+// redraw an area of the window of an output (given in pixmap coordinates)
+void
+x11_update_output_area(struct x11_output* o, int x, int y, int width, int height)
+{
+	GdkRectangle r = {x, y, width, height};
+
+	if (o->owner->direct) {
+		// already drawn into the window
+		return;
+	}
+
+#ifdef HAVE_XRENDER
+	if (transformed) {
+		x11_transform_rect(o, &r, &r);
+		if (!r.width || !r.height) {
+			return;
+		}
+	}
+#endif
+#ifdef HAVE_XPRESENT
+	if (present) {
+		x11_present_area(o, &r);
+		return;
+	}
+#endif
+#ifdef HAVE_XRENDER
+	if (transformed) {
+		XRenderComposite(display, PictOpSrc, o->source_picture, None, o->output_picture,
+				r.x, r.y, 0, 0, r.x, r.y, r.width, r.height);
+	}
+#endif
+	XClearArea(display, o->window, r.x, r.y, r.width, r.height, FALSE);
+}
+
+// redraw an area of all the windows of a session (given in pixmap
+// coordinates)
+void
+x11_update_window_area(struct x11_session* s, int x, int y, int width, int height)
+{
+	struct x11_output* o;
+	for (o=s->outputs ; o<s->outputs+s->n_outputs ; o++) {
+		x11_update_output_area(o, x, y, width, height);
+	}
+}
+
+// send the updates of the windows (after calls to x11_update_window_area())
+void
+x11_commit_window(struct x11_session* s)
+{
+#ifdef HAVE_XPRESENT
+	if (present) {
+		struct x11_output* o;
+		for (o=s->outputs ; o<s->outputs+s->n_outputs ; o++) {
+			x11_present_frame(o);
+		}
+	}
+#endif
+}
+
+
+// raise or lower the windows of each session depending on the location of
+// the active window
+void
+x11_show_window_rect(const GdkRectangle* rect)
+{
+	int i, j;
+	for (i=0 ; i<n_sessions ; i++)
+	{
+		struct session* session = &sessions[i];
+
+		// check if it overlaps more whith the src or a dst window
+		GdkRectangle inter_src, inter_dst;
+		int max_src = 0, max_dst = 0;
+		for (j=0 ; j<session->n_sources ; j++) {
+			gdk_rectangle_intersect(rect, &session->sources[j].rect, &inter_src);
+			max_src = MAX(max_src, inter_src.height*inter_src.width);
+		}
+		for (j=0 ; j<session->n_outputs ; j++) {
+			gdk_rectangle_intersect(rect, &x11_sessions[i].outputs[j].rect, &inter_dst);
+			max_dst = MAX(max_dst, inter_dst.height*inter_dst.width);
+		}
+
+		if(max_src > max_dst)
+		{
+			// the active window overlaps more with the source screen
+			x11_show_session(&x11_sessions[i], TRUE);
+		} else {
+			// the active window overlaps more with the destination screen
+			x11_show_session(&x11_sessions[i], FALSE);
+		}
+	}
+}
+
+void
+x11_show_active_window()
+{
+	if (active_window) {
+		x11_show_window_rect(&active_window_rect);
+	}
+}
+
+gboolean
+x11_get_window_geometry(Window w, GdkRectangle* r)
+{
+	gboolean result;
+	Window root;
+	int x, y;
+	unsigned int width, height, border_width, depth;
+
+	x11_error_trap_push();
+
+	if (XGetGeometry(display, w, &root, &x, &y, &width, &height,
+			&border_width, &depth))
+	{
+		r->x = x - border_width;
+		r->y = y - border_width;
+		r->width  = width  + 2*border_width;
+		r->height = height + 2*border_width;
+
+		result = TRUE;
+	} else {
+		result = FALSE;
+	}
+	x11_error_trap_pop_ignored();
+
+	return result;
+}
+
+Window
+x11_get_active_window()
+{
+	Window result = 0;
+	Window* w;
+	Atom actual_type_return;
+	int  actual_format_return;
+	unsigned long nitems_return, bytes_after_return;
+
+	trace_begin("get_active_window");
+	if (XGetWindowProperty(display, root_window, net_active_window_atom, 0, 1,
+			FALSE, AnyPropertyType,	&actual_type_return,
+			&actual_format_return, &nitems_return,
+			&bytes_after_return, (unsigned char**)&w)
+		== Success)
+	{
+		result = *w;
+		XFree(w);
+	}
+	trace_end("get_active_window");
+	return result;
+}
+
+gboolean x11_is_tracked_window(Window w);
+Window x11_get_frame(Window w);
+void x11_select_structure_events(Window w, long mask);
+
+// get the entry of a client window in the frame cache (a new entry is
+// allocated if it is not there)
+struct frame_cache_entry*
+x11_get_frame_cache_entry(Window client)
+{
+	int i;
+	for (i=0 ; i<FRAME_CACHE_SIZE ; i++) {
+		if (frame_cache[i].client == client) {
+			return &frame_cache[i];
+		}
+	}
+
+	// evict the oldest entry
+	struct frame_cache_entry* e = &frame_cache[frame_cache_next];
+	frame_cache_next = (frame_cache_next + 1) % FRAME_CACHE_SIZE;
+	if (e->client && !x11_is_tracked_window(e->client)) {
+		x11_select_structure_events(e->client, 0);
+	}
+
+	// monitor the client (to know when it is reparented or destroyed)
+	e->client = client;
+	e->frame = 0;
+	x11_select_structure_events(client, StructureNotifyMask);
+	return e;
+}
+
+// get the frame of a client window (from the cache if possible)
+Window
+x11_lookup_frame(Window client)
+{
+	struct frame_cache_entry* e = x11_get_frame_cache_entry(client);
+	if (e->frame) {
+		return e->frame;
+	}
+
+	trace_begin("active_window_frame");
+	e->frame = x11_get_frame(client);
+	trace_end("active_window_frame");
+	return e->frame;
+}
+
+// a client window was reparented (or destroyed if 'destroyed' is set)
+//
+// return TRUE if it was in the cache
+gboolean
+x11_forget_frame(Window client, gboolean destroyed)
+{
+	if (!client) {
+		return FALSE;
+	}
+
+	int i;
+	for (i=0 ; i<FRAME_CACHE_SIZE ; i++) {
+		if (frame_cache[i].client == client) {
+			frame_cache[i].frame = 0;
+			if (destroyed) {
+				frame_cache[i].client = 0;
+			}
+			return TRUE;
+		}
+	}
+	return FALSE;
+}
+
+void
+x11_clear_frame_cache()
+{
+	int i;
+	for (i=0 ; i<FRAME_CACHE_SIZE ; i++) {
+		if (frame_cache[i].client && !x11_is_tracked_window(frame_cache[i].client)) {
+			x11_select_structure_events(frame_cache[i].client, 0);
+		}
+		frame_cache[i].client = 0;
+		frame_cache[i].frame = 0;
+	}
+	frame_cache_next = 0;
+}
+
+// monitor the frame of the active window (given its geometry)
+//
+// return FALSE if the active window is to be ignored
+gboolean
+x11_set_active_frame(Window frame, const GdkRectangle* rect)
+{
+	if (!memcmp(rect, &root_window_rect, sizeof(GdkRectangle))) {
+		// same geometry as the root window
+		// -> ignore it
+		// TODO: make the match more loose
+		return FALSE;
+	}
+	active_frame = frame;
+	active_window_rect = *rect;
+
+	// (the event mask is private to our connection, thus it does not
+	// interfere with GDK even if it is one of our windows)
+	if ((active_frame != active_window) && !x11_is_tracked_window(active_frame)) {
+		x11_select_structure_events(active_frame, StructureNotifyMask);
+	}
+	return TRUE;
+}
+
+// monitor the frame of the active window and get its geometry
+//
+// return FALSE if the active window is to be ignored
+gboolean
+x11_enable_active_frame()
+{
+	GdkRectangle rect;
+	Window frame = x11_lookup_frame(active_window);
+	if (!frame || !x11_get_window_geometry(frame, &rect)) {
+		return FALSE;
+	}
+	return x11_set_active_frame(frame, &rect);
+}
+
+#ifdef HAVE_XCB
+void x11_request_active_frame(Window client);
+void x11_cancel_active_frame_request();
+#endif
+
+void
+x11_disable_active_frame()
+{
+	if (active_frame && (active_frame != active_window)
+	    && !x11_is_tracked_window(active_frame)) {
+		x11_select_structure_events(active_frame, 0);
+	}
+	active_frame = 0;
+}
+
+void
+x11_active_window_stop_monitoring()
+{
+	// (the client window stays monitored as long as it is in the cache)
+	x11_disable_active_frame();
+	active_window = 0;
+#ifdef HAVE_XCB
+	x11_cancel_active_frame_request();
+#endif
+}
+
+// monitor a new active window
+void
+x11_active_window_monitor(Window w)
+{
+	if (active_window)
+		x11_active_window_stop_monitoring();
+
+	active_window = w;
+	if (active_window && !x11_enable_active_frame()) {
+		active_window = 0;
+	}
+}
+
+void
+x11_active_window_start_monitoring()
+{
+	if (active_window)
+		x11_active_window_stop_monitoring();
+
+	if (config.opt_passive)
+		return;
+
+	x11_active_window_monitor(x11_get_active_window());
+}
+
+// the active window was changed
+void
+x11_on_active_window_change()
+{
+	if (active_window) {
+		record_active_window(&active_window_rect);
+	}
+	x11_show_active_window();
+}
+
+#ifdef HAVE_XCB
+// request the value of _NET_ACTIVE_WINDOW (the reply is handled by the event
+// source)
+void
+x11_request_active_window()
+{
+	if (active_window_requested) {
+		// (superseded)
+		xcb_discard_reply(xcb, active_window_cookie.sequence);
+	}
+	active_window_cookie = xcb_get_property(xcb, 0, root_window,
+			net_active_window_atom, XCB_ATOM_ANY, 0, 1);
+	active_window_requested = TRUE;
+	xcb_flush(xcb);
+}
+
+// return TRUE if the reply to x11_request_active_window() was received
+gboolean
+x11_poll_active_window()
+{
+	if (active_window_requested) {
+		xcb_generic_error_t* error = NULL;
+		if (xcb_poll_for_reply(xcb, active_window_cookie.sequence,
+				(void**) &active_window_reply, &error))
+		{
+			active_window_requested = FALSE;
+			free(error);
+		}
+	}
+	return active_window_reply != NULL;
+}
+
+// handle the reply to x11_request_active_window()
+void
+x11_on_active_window_reply()
+{
+	xcb_get_property_reply_t* r = active_window_reply;
+	active_window_reply = NULL;
+
+	Window w = 0;
+	if ((r->format == 32) && (xcb_get_property_value_length(r) >= 4)) {
+		w = *(uint32_t*) xcb_get_property_value(r);
+	}
+	free(r);
+
+	x11_active_window_stop_monitoring();
+	if (w) {
+		// (the change is notified when the geometry is known)
+		x11_request_active_frame(w);
+	} else {
+		x11_on_active_window_change();
+	}
+}
+
+void
+x11_cancel_active_window_request()
+{
+	if (active_window_requested) {
+		xcb_discard_reply(xcb, active_window_cookie.sequence);
+		active_window_requested = FALSE;
+	}
+	free(active_window_reply);
+	active_window_reply = NULL;
+}
+
+void
+x11_send_frame_request(int request, Window w)
+{
+	frame_request = request;
+	frame_request_window = w;
+	frame_request_sequence = (request == FRAME_REQUEST_TREE)
+		? xcb_query_tree(xcb, w).sequence
+		: xcb_get_geometry(xcb, w).sequence;
+	xcb_flush(xcb);
+}
+
+// look up the frame of a new active window and its geometry (the replies are
+// handled by the event source, the window becomes active when they are all
+// received)
+void
+x11_request_active_frame(Window client)
+{
+	x11_cancel_active_frame_request();
+	frame_request_client = client;
+
+	Window frame = x11_get_frame_cache_entry(client)->frame;
+	if (frame) {
+		x11_send_frame_request(FRAME_REQUEST_GEOMETRY, frame);
+	} else {
+		x11_send_frame_request(FRAME_REQUEST_TREE, client);
+	}
+}
+
+// return TRUE if the reply to the pending frame request was received
+gboolean
+x11_poll_active_frame()
+{
+	if (frame_request && !frame_reply_received) {
+		xcb_generic_error_t* error = NULL;
+		if (xcb_poll_for_reply(xcb, frame_request_sequence, &frame_reply, &error)) {
+			frame_reply_received = TRUE;
+			free(error);
+		}
+	}
+	return frame_reply_received;
+}
+
+// handle the reply to the pending frame request
+void
+x11_on_active_frame_reply()
+{
+	int request = frame_request;
+	Window w = frame_request_window;
+	void* r = frame_reply;
+	frame_request = FRAME_REQUEST_NONE;
+	frame_reply_received = FALSE;
+	frame_reply = NULL;
+
+	if (r && (request == FRAME_REQUEST_TREE))
+	{
+		xcb_query_tree_reply_t* tree = r;
+		Window parent = tree->parent;
+		free(r);
+		if (parent && (parent != root_window)) {
+			// go up
+			x11_send_frame_request(FRAME_REQUEST_TREE, parent);
+		} else {
+			// 'w' is the top-level window
+			x11_get_frame_cache_entry(frame_request_client)->frame = w;
+			x11_send_frame_request(FRAME_REQUEST_GEOMETRY, w);
+		}
+		return;
+	}
+
+	// (the window may have been destroyed meanwhile)
+	active_window = frame_request_client;
+	frame_request_client = 0;
+	if (r) {
+		xcb_get_geometry_reply_t* g = r;
+		GdkRectangle rect = {
+			g->x - g->border_width,		g->y - g->border_width,
+			g->width + 2*g->border_width,	g->height + 2*g->border_width
+		};
+		free(r);
+		if (!x11_set_active_frame(w, &rect)) {
+			active_window = 0;
+		}
+	} else {
+		active_window = 0;
+	}
+	x11_on_active_window_change();
+}
+
+void
+x11_cancel_active_frame_request()
+{
+	if (frame_request && !frame_reply_received) {
+		xcb_discard_reply(xcb, frame_request_sequence);
+	}
+	free(frame_reply);
+	frame_reply = NULL;
+	frame_reply_received = FALSE;
+	frame_request = FRAME_REQUEST_NONE;
+	frame_request_client = 0;
+}
+
+// return TRUE if a reply to an asynchronous request was received
+gboolean
+x11_poll_replies()
+{
+	gboolean received = x11_poll_active_window();
+	received = x11_poll_active_frame() || received;
+#ifdef ASYNC_CURSOR
+	received = x11_poll_cursor_image() || received;
+#endif
+#ifdef ASYNC_DAMAGE
+	received = x11_poll_damage_region() || received;
+#endif
+	return received;
+}
+
+// handle the replies to the asynchronous requests
+void
+x11_dispatch_replies()
+{
+	if (x11_poll_active_window()) {
+		x11_on_active_window_reply();
+	}
+	if (x11_poll_active_frame()) {
+		x11_on_active_frame_reply();
+	}
+#ifdef ASYNC_CURSOR
+	if (x11_poll_cursor_image()) {
+		x11_on_cursor_image_reply();
+	}
+#endif
+#ifdef ASYNC_DAMAGE
+	if (x11_poll_damage_region()) {
+		x11_on_damage_region_reply();
+	}
+#endif
+}
+#endif
+
+// the active window was moved or resized (its frame is a child of the root
+// window, thus the event gives its location in root window coordinates)
+void
+x11_on_active_frame_configure(const XConfigureEvent* c_ev)
+{
+	trace_begin("active_window_geometry");
+	active_window_rect.x = c_ev->x - c_ev->border_width;
+	active_window_rect.y = c_ev->y - c_ev->border_width;
+	active_window_rect.width  = c_ev->width  + 2*c_ev->border_width;
+	active_window_rect.height = c_ev->height + 2*c_ev->border_width;
+	trace_end("active_window_geometry");
+}
+
+//
+// Tracked windows (sources given as @ID)
+//
+// The window and its frame (the top-level window created by the window
+// manager) are monitored with StructureNotifyMask. When the window is moved,
+// the captured area follows it. When it is resized, squint is reset (the
+// pixmap must be reallocated) and when it is destroyed, squint is disabled.
+//
+
+// get the geometry of a window (in root window coordinates)
+gboolean
+x11_query_window_rect(Window window, GdkRectangle* r)
+{
+	gboolean result = FALSE;
+	Window root, parent, child, *children;
+	unsigned int nchildren;
+
+	x11_error_trap_push();
+	if (x11_get_window_geometry(window, r)
+	    && XQueryTree(display, window, &root, &parent, &children, &nchildren))
+	{
+		if (children) {
+			XFree(children);
+		}
+		result = XTranslateCoordinates(display, parent, root_window,
+				r->x, r->y, &r->x, &r->y, &child);
+	}
+	x11_error_trap_pop_ignored();
+	return result;
+}
+
+struct window_rect_call {
+	Window window;
+	GdkRectangle* rect;
+	gboolean found;
+};
+
+gboolean
+x11_on_get_window_rect(gpointer data)
+{
+	struct window_rect_call* call = data;
+	call->found = x11_query_window_rect(call->window, call->rect);
+	return G_SOURCE_REMOVE;
+}
+
+// get the geometry of a window from the GTK thread
+//
+// (the query is made by the capture thread, which owns the connection while
+// squint is enabled)
+gboolean
+x11_get_window_rect(gulong window, GdkRectangle* r)
+{
+	struct window_rect_call call = { window, r, FALSE };
+	x11_capture_run(x11_on_get_window_rect, &call);
+	return call.found;
+}
+
+// get the top-level window that contains a window
+Window
+x11_get_frame(Window w)
+{
+	Window root, parent = w, *children;
+	unsigned int nchildren;
+
+	x11_error_trap_push();
+	while (parent != root_window)
+	{
+		w = parent;
+		if (!XQueryTree(display, w, &root, &parent, &children, &nchildren)) {
+			w = 0;
+			break;
+		}
+		if (children) {
+			XFree(children);
+		}
+	}
+	x11_error_trap_pop_ignored();
+	return w;
+}
+
+// find the client window (the one that has a WM_STATE property) below a
+// top-level window
+Window
+x11_find_client_window(Window w)
+{
+	Atom wm_state = XInternAtom(display, "WM_STATE", True);
+	Atom type;
+	int format;
+	unsigned long nitems, after;
+	unsigned char* data = NULL;
+	Window root, parent, *children, result = 0;
+	unsigned int i, nchildren;
+
+	if (wm_state && (XGetWindowProperty(display, w, wm_state, 0, 0, False, AnyPropertyType,
+			&type, &format, &nitems, &after, &data) == Success))
+	{
+		if (data) {
+			XFree(data);
+		}
+		if (type != None) {
+			return w;
+		}
+	}
+
+	if (!XQueryTree(display, w, &root, &parent, &children, &nchildren)) {
+		return 0;
+	}
+	for (i=0 ; (i<nchildren) && !result ; i++) {
+		result = x11_find_client_window(children[i]);
+	}
+	if (children) {
+		XFree(children);
+	}
+	return result;
+}
+
+// let the user click on the window to be mirrored
+//
+// return 0 if no window was picked
+gulong
+x11_pick_window()
+{
+	Window w = 0;
+	Cursor crosshair = XCreateFontCursor(display, XC_crosshair);
+
+	fprintf(stderr, "Click on the window to be mirrored\n");
+	if (XGrabPointer(display, root_window, False, ButtonPressMask, GrabModeSync,
+			GrabModeAsync, root_window, crosshair, CurrentTime) == GrabSuccess)
+	{
+		XEvent ev;
+		XAllowEvents(display, SyncPointer, CurrentTime);
+		XWindowEvent(display, root_window, ButtonPressMask, &ev);
+		XUngrabPointer(display, CurrentTime);
+
+		w = ev.xbutton.subwindow;
+		if (w) {
+			Window client = x11_find_client_window(w);
+			if (client) {
+				w = client;
+			}
+		}
+	}
+	XFreeCursor(display, crosshair);
+	XFlush(display);
+	return w;
+}
+
+// return TRUE if a window is a tracked window (or its frame)
+gboolean
+x11_is_tracked_window(Window w)
+{
+	int i, j;
+	for (i=0 ; i<n_sessions ; i++) {
+		for (j=0 ; j<sessions[i].n_sources ; j++) {
+			if (w && ((w == sessions[i].sources[j].window) || (w == x11_sessions[i].frames[j]))) {
+				return TRUE;
+			}
+		}
+	}
+	return FALSE;
+}
+
+void
+x11_select_structure_events(Window w, long mask)
+{
+	// ignore X11 errors (the window belongs to another application)
+	x11_error_trap_push();
+
+	XSetWindowAttributes attr;
+	attr.event_mask = mask;
+	XChangeWindowAttributes(display, w, CWEventMask, &attr);
+
+	x11_error_trap_pop_ignored();
+}
+
+void
+x11_enable_window_tracking()
+{
+	int i, j;
+	for (i=0 ; i<n_sessions ; i++)
+	{
+		for (j=0 ; j<sessions[i].n_sources ; j++)
+		{
+			Window w = sessions[i].sources[j].window;
+			if (!w) {
+				continue;
+			}
+			x11_select_structure_events(w, StructureNotifyMask);
+
+			Window frame = x11_get_frame(w);
+			if (frame && (frame != w)) {
+				x11_sessions[i].frames[j] = frame;
+				x11_select_structure_events(frame, StructureNotifyMask);
+			}
+		}
+	}
+}
+
+void
+x11_disable_window_tracking()
+{
+	int i, j;
+	for (i=0 ; i<n_sessions ; i++)
+	{
+		for (j=0 ; j<sessions[i].n_sources ; j++)
+		{
+			if (sessions[i].sources[j].window) {
+				x11_select_structure_events(sessions[i].sources[j].window, 0);
+			}
+			if (x11_sessions[i].frames[j]) {
+				x11_select_structure_events(x11_sessions[i].frames[j], 0);
+				x11_sessions[i].frames[j] = 0;
+			}
+		}
+	}
+}
+
+static gint reset_pending = FALSE;
+
+// disable squint (and enable it again if 'data' is set)
+//
+// (in the GTK thread)
+gboolean
+x11_reset(gpointer data)
+{
+	g_atomic_int_set(&reset_pending, FALSE);
+	if (enabled) {
+		squint_disable();
+		if (data) {
+			squint_enable();
+		}
+	}
+	return G_SOURCE_REMOVE;
+}
+
+void
+x11_schedule_reset(gboolean enable)
+{
+	if (g_atomic_int_compare_and_exchange(&reset_pending, FALSE, TRUE)) {
+		g_idle_add(x11_reset, GINT_TO_POINTER(enable));
+	}
+}
+
+#ifdef HAVE_XRENDER
+void x11_update_tile_transform(struct x11_session* s, int index);
+#endif
+
+// handle a structure event on a tracked window (or its frame)
+void
+x11_on_tracked_window_event(const XEvent* ev)
+{
+	int i, j;
+	for (i=0 ; i<n_sessions ; i++)
+	{
+		for (j=0 ; j<sessions[i].n_sources ; j++)
+		{
+			struct source* src = &sessions[i].sources[j];
+			if (!src->window || ((ev->xany.window != src->window)
+						&& (ev->xany.window != x11_sessions[i].frames[j]))) {
+				continue;
+			}
+
+#ifdef WINDOW_PIXMAP
+			if ((ev->type == MapNotify) && x11_sessions[i].window_pixmaps[j]) {
+				// the window pixmap is reallocated when the window
+				// is mapped again
+				x11_schedule_reset(TRUE);
+				return;
+			}
+#endif
+
+			GdkRectangle rect;
+			if ((ev->type == DestroyNotify) || !x11_query_window_rect(src->window, &rect))
+			{
+				if (ev->xany.window == src->window) {
+					// the window was closed
+					x11_error("The mirrored window was destroyed");
+					x11_schedule_reset(FALSE);
+				}
+				continue;
+			}
+
+			if ((rect.width != src->rect.width) || (rect.height != src->rect.height)) {
+				// resized -> reallocate the pixmap
+				x11_schedule_reset(TRUE);
+				return;
+			}
+			if ((rect.x != src->rect.x) || (rect.y != src->rect.y)) {
+				// moved -> refresh the whole area
+				src->rect = rect;
+#ifdef HAVE_XRENDER
+				if (x11_sessions[i].tile_pictures[j]) {
+					x11_update_tile_transform(&x11_sessions[i], j);
+				}
+#endif
+				x11_refresh_image(&rect);
+			}
+		}
+	}
+}
+
+// repaint an exposed area of the window of a session (in direct mode)
+void
+x11_on_direct_expose(struct x11_session* s, const XExposeEvent* e)
+{
+	XCopyArea(display, root_window, e->window, gc,
+			e->x + s->session->sources[0].rect.x, e->y + s->session->sources[0].rect.y,
+			e->width, e->height,
+			e->x, e->y);
+
+	// the cursor may have been overwritten
+	x11_clear_cursor(s);
+	x11_draw_cursor(s);
+}
+
+// handle an event received on the capture connection
+void
+x11_on_x11_event(XEvent* ev)
+{
+
+	if (ev->type == PropertyNotify)
+	{
+		XPropertyEvent* pn_ev = (XPropertyEvent*) ev;
+		if ((pn_ev->window == root_window) && (pn_ev->atom == net_active_window_atom))
+		{
+			// property _NET_ACTIVE_WINDOW was changed
+			if (config.opt_passive) {
+				return;
+			}
+#ifdef HAVE_XCB
+			x11_request_active_window();
+#else
+			x11_active_window_start_monitoring();
+			x11_on_active_window_change();
+#endif
+			return;
+		}
+		
+	}
+
+	if (ev->type == ConfigureNotify)
+	{
+		XConfigureEvent* c_ev = (XConfigureEvent*) ev;
+		if (x11_is_tracked_window(c_ev->window)) {
+			x11_on_tracked_window_event(ev);
+		}
+		if (active_frame && (c_ev->window == active_frame))
+		{
+			x11_on_active_frame_configure(c_ev);
+			return;
+		}
+		if (c_ev->window == active_window)
+		{
+			// (the frame is configured as well)
+			return;
+		}
+	}
+
+	if ((ev->type == ReparentNotify) || (ev->type == DestroyNotify))
+	{
+		Window w = (ev->type == ReparentNotify) ? ev->xreparent.window : ev->xdestroywindow.window;
+		gboolean forgotten = x11_forget_frame(w, ev->type == DestroyNotify);
+#ifdef HAVE_XCB
+		if (w == frame_request_client) {
+			// the window was reparented (or destroyed) while its frame
+			// was being looked up
+			x11_cancel_active_frame_request();
+			if (ev->type == ReparentNotify) {
+				x11_request_active_frame(w);
+			}
+		}
+#endif
+		if (forgotten && (w == active_window))
+		{
+			// the active window got another frame (or was destroyed)
+			x11_disable_active_frame();
+#ifdef HAVE_XCB
+			active_window = 0;
+			if (ev->type == ReparentNotify) {
+				x11_request_active_frame(w);
+			}
+#else
+			if ((ev->type == DestroyNotify) || !x11_enable_active_frame()) {
+				active_window = 0;
+			}
+#endif
+		}
+		if (!x11_is_tracked_window(w)) {
+			return;
+		}
+	}
+
+	if (((ev->type == DestroyNotify) || (ev->type == MapNotify))
+	    && x11_is_tracked_window(ev->xany.window))
+	{
+		x11_on_tracked_window_event(ev);
+		return;
+	}
+
+	if (ev->type == Expose)
+	{
+		struct x11_output* o = x11_find_output(ev->xexpose.window);
+		if (o && o->owner->direct) {
+			x11_on_direct_expose(o->owner, &ev->xexpose);
+			return;
+		}
+#ifdef HAVE_XPRESENT
+		if (o && present)
+		{
+			GdkRectangle r = {ev->xexpose.x, ev->xexpose.y,
+				ev->xexpose.width, ev->xexpose.height};
+			region_add(&o->present_update, &r);
+			x11_present_frame(o);
+			return;
+		}
+#endif
+	}
+
+#ifdef HAVE_XPRESENT
+	if (present_opcode)
+	{
+		XGenericEventCookie *cookie = &ev->xcookie;
+		if (	(cookie->type == GenericEvent)
+		    &&	(cookie->extension == present_opcode))
+		{
+			x11_on_present_event(cookie);
+			return;
+		}
+	}
+#endif
+
+#ifdef HAVE_XI
+	if(can_track_cursor)
+	{
+		XGenericEventCookie *cookie = &ev->xcookie;
+
+		if (	(cookie->type == GenericEvent)
+		    &&	(cookie->extension == xi_opcode))
+		{
+			switch (cookie->evtype)
+			{
+			case XI_RawMotion:
+				// cursor was moved
+				// (the location is given by the XI_Motion event that
+				// follows, if any)
+				x11_on_cursor_motion(NULL);
+				return;
+			case XI_Motion:
+				{
+					// (selected on the root window only, thus
+					// root_x/root_y are always valid)
+					XIDeviceEvent* xi_ev = (XIDeviceEvent*) cookie->data;
+					GdkPoint c = { (int) xi_ev->root_x, (int) xi_ev->root_y };
+					x11_on_cursor_motion(&c);
+				}
+				return;
+			case XI_RawKeyPress:
+				// a key was pressed
+				// -> we ensure that the active window is on screen
+				{
+					// (the GDK keymap cannot be used outside
+					// of the GTK thread)
+					XIRawEvent* xi_ev = (XIRawEvent*) cookie->data;
+					switch(XkbKeycodeToKeysym(display, xi_ev->detail,
+							0, // FIXME: how to determine the group?
+							0))
+					{
+					case  XK_Control_L:
+					case  XK_Control_R:
+					case  XK_Meta_L:
+					case  XK_Meta_R:
+					case  XK_Alt_L:
+					case  XK_Alt_R:
+						// ignore modifier keys (except shift)
+						// because they may be used by the
+						// window manager
+						return;
+					}
+				
+					x11_show_active_window();
+					return;
+				}
+			}
+		}
+	}
+#endif
+
+#ifdef COPY_CURSOR
+	if(copy_cursor)
+	{
+		if (ev->type == xfixes_event_base + XFixesCursorNotify) {
+			XFixesCursorNotifyEvent* c_ev = (XFixesCursorNotifyEvent*) ev;
+			record_cursor();
+			x11_refresh_cursor_image(c_ev->cursor_serial, c_ev->cursor_name);
+
+			return;
+		}
+	}
+#endif
+
+#ifdef HAVE_XDAMAGE
+	if(damage)
+	{
+		if (ev->type == xdamage_event_base + XDamageNotify)
 		{
-			x11_refresh_active_window_geometry();
-			return GDK_FILTER_CONTINUE;
+			XDamageNotifyEvent* xd_ev = (XDamageNotifyEvent*) ev;
+
+			trace_begin("damage");
+
+#ifdef WINDOW_PIXMAP
+			if (x11_on_window_damage(xd_ev)) {
+				trace_end("damage");
+				return;
+			}
+#endif
+#ifdef ADAPTIVE_DAMAGE
+			if ((damage_level == XDamageReportNonEmpty) && (xd_ev->damage == damage))
+			{
+				// the damaged region will be fetched when
+				// refreshing the image
+				damage_pending = TRUE;
+				x11_mark_damage_time(xd_ev->timestamp);
+				x11_try_refresh_image(xd_ev->timestamp);
+				x11_update_damage_rate(xd_ev->timestamp, 1);
+				trace_end("damage");
+				return;
+			}
+			x11_update_damage_rate(xd_ev->timestamp, 1);
+#endif
+
+			// get the damaged area
+			GdkRectangle rect = {
+				xd_ev->area.x,     xd_ev->area.y,
+				xd_ev->area.width, xd_ev->area.height
+			};
+			record_damage(xd_ev->timestamp, &rect, xd_ev->more);
+			x11_on_damage(xd_ev->timestamp, &rect, xd_ev->more);
+
+			trace_end("damage");
+		}
+	}
+#endif
+
+#ifdef HAVE_XRANDR
+	if (xrandr_event_base)
+	{
+		if (ev->type == xrandr_event_base + RRScreenChangeNotify) {
+			// (the monitors are selected again by the GTK thread,
+			// see squint_reconfigure())
+			XRRUpdateConfiguration(ev);
+		}
+	}
+#endif
+}
+
+void x11_sample_request_count();
+
+static gboolean
+x11_event_source_prepare(GSource* src, gint* timeout)
+{
+	*timeout = -1;
+	x11_sample_request_count();
+
+	// (also flushes the requests before sleeping)
+	return XPending(display)
+#ifdef HAVE_XCB
+		|| x11_poll_replies()
+#endif
+	;
+}
+
+static gboolean
+x11_event_source_check(GSource* src)
+{
+	return XPending(display)
+#ifdef HAVE_XCB
+		|| x11_poll_replies()
+#endif
+	;
+}
+
+static gboolean
+x11_event_source_dispatch(GSource* src, GSourceFunc callback, gpointer user_data)
+{
+	while (XPending(display))
+	{
+		XEvent ev;
+		XNextEvent(display, &ev);
+
+		gboolean has_data = XGetEventData(display, &ev.xcookie);
+		x11_on_x11_event(&ev);
+		if (has_data) {
+			XFreeEventData(display, &ev.xcookie);
 		}
 	}
+#ifdef HAVE_XCB
+	x11_dispatch_replies();
+#endif
+	return G_SOURCE_CONTINUE;
+}
 
-#ifdef HAVE_XI
-	if(can_track_cursor)
-	{
-		XGenericEventCookie *cookie = &ev->xcookie;
+static GSourceFuncs x11_event_source_funcs = {
+	x11_event_source_prepare,
+	x11_event_source_check,
+	x11_event_source_dispatch,
+	NULL,
+};
 
-		if (	(cookie->type == GenericEvent)
-		    &&	(cookie->extension == xi_opcode))
-		{
-			switch (cookie->evtype)
-			{
-			case XI_RawMotion:
-				// cursor was moved
-				x11_refresh_cursor_location(FALSE);
+gpointer
+x11_capture_thread(gpointer data)
+{
+	g_main_context_push_thread_default(capture_context);
 
-				return GDK_FILTER_REMOVE;
-			case XI_RawKeyPress:
-				// a key was pressed
-				// -> we ensure that the active window is on screen
-				{
-					XIRawEvent* xi_ev = (XIRawEvent*) cookie->data;
-					GdkKeymap* km = gdk_keymap_get_for_display(gdisplay);
-					guint keyval;
+	GMainLoop* loop = g_main_loop_new(capture_context, FALSE);
+	g_main_loop_run(loop);
+	return NULL;
+}
 
-					if(gdk_keymap_translate_keyboard_state(km, xi_ev->detail,
-							0, // FIXME: do we need the modifier?
-							0, // FIXME: how to determine the group?
-							&keyval, NULL, NULL, NULL))
-					{
-						switch(keyval)
-						{
-						case  GDK_KEY_Control_L:
-						case  GDK_KEY_Control_R:
-						case  GDK_KEY_Meta_L:
-						case  GDK_KEY_Meta_R:
-						case  GDK_KEY_Alt_L:
-						case  GDK_KEY_Alt_R:
-							// ignore modifier keys (except shift)
-							// because they may be used by the
-							// window manager
-							return GDK_FILTER_REMOVE;
-						}
-					}
-				
-					x11_show_active_window();
-					return GDK_FILTER_REMOVE;
-				}
-			}
+//
+// Replay
+//
+// The events of a recording (see record.c) are fed into the same handlers as
+// the live events. Damage events keep their original timestamps, the frames
+// are paced as in a live session (unless replaying as fast as possible).
+//
+void
+x11_replay_record(const struct record* rec)
+{
+	GdkRectangle rect = { rec->x, rec->y, rec->width, rec->height };
+
+	switch (rec->type)
+	{
+	case RECORD_DAMAGE:
+#ifdef HAVE_XDAMAGE
+		x11_on_damage(rec->timestamp, &rect, rec->more);
+#else
+		x11_refresh_image(&rect);
+#endif
+		break;
+	case RECORD_MOTION:
+		x11_move_cursor((GdkPoint){ rec->x, rec->y });
+		break;
+	case RECORD_CURSOR:
+#ifdef COPY_CURSOR
+		if (copy_cursor) {
+			x11_refresh_cursor_image(0, None);
 		}
-	}
 #endif
+		break;
+	case RECORD_ACTIVE_WINDOW:
+		if (!config.opt_passive) {
+			x11_show_window_rect(&rect);
+		}
+		break;
+	}
+}
 
-#ifdef COPY_CURSOR
-	if(copy_cursor)
+gboolean
+x11_replay_step(gpointer data)
+{
+	replay_timer = 0;
+
+	while (replay_index < replay_count)
 	{
-		if (ev->type == xfixes_event_base + XFixesCursorNotify) {
-			x11_refresh_cursor_image();
+		const struct record* rec = &replay_records[replay_index];
+
+		if (!config.opt_replay_fast) {
+			// wait until the time of the next record
+			gint64 now = (g_get_monotonic_time() - replay_start) / 1000;
+			if (rec->time > now) {
+				replay_timer = x11_capture_add(rec->time - now, x11_replay_step, NULL);
+				return G_SOURCE_REMOVE;
+			}
+		}
+
+		replay_index++;
+		x11_replay_record(rec);
+
+		if (config.opt_replay_fast && !rec->more) {
+			// let the main loop run between two batches of events
+			replay_timer = x11_capture_add(0, x11_replay_step, NULL);
+			return G_SOURCE_REMOVE;
+		}
+	}
+
+	// end of the recording
+	XFlush(display);
+	g_idle_add(x11_on_idle_quit, NULL);
+	return G_SOURCE_REMOVE;
+}
+
+gboolean
+x11_start_replay()
+{
+	replay_records = record_load(config.replay_file, &replay_count);
+	if (!replay_records) {
+		return FALSE;
+	}
+	replay_index = 0;
+	replay_start = g_get_monotonic_time();
+	replay_timer = x11_capture_add(0, x11_replay_step, NULL);
+	return TRUE;
+}
+
+void
+x11_stop_replay()
+{
+	if (replay_timer) {
+		x11_capture_remove(replay_timer);
+		replay_timer = 0;
+	}
+	g_free(replay_records);
+	replay_records = NULL;
+	replay_count = 0;
+}
+
+#ifdef HAVE_XI
+void
+x11_set_xi_eventmask(gboolean active)
+{
+	// inspired from: http://keithp.com/blogs/Cursor_tracking/
+
+	XIEventMask evmasks[1];
+	unsigned char mask1[(XI_LASTEVENT + 7)/8];
+	memset(mask1, 0, sizeof(mask1));
 
-			return GDK_FILTER_REMOVE;
+	if (active) {
+		// select for button and key events from all master devices
+		XISetMask(mask1, XI_RawMotion);
+		XISetMask(mask1, XI_Motion);
+		if (!config.opt_passive) {
+			XISetMask(mask1, XI_RawKeyPress);
 		}
 	}
+
+	evmasks[0].deviceid = XIAllMasterDevices;
+	evmasks[0].mask_len = sizeof(mask1);
+	evmasks[0].mask = mask1;
+
+	XISelectEvents(display, root_window, evmasks, 1);
+}
+
+void x11_init_cursor_tracking()
+{
+	int event, error;
+	if (!XQueryExtension(display, "XInputExtension", &xi_opcode, &event, &error))
+		return;
+
+	int major=2, minor=2;
+	if (XIQueryVersion(display, &major, &minor) != Success)
+		return;
+
+	if ((major > 2) || ((major == 2) && (minor >= 2))) {
+		can_track_cursor = TRUE;
+	}
+}
+
+void
+x11_enable_cursor_tracking()
+{
+	if (can_track_cursor) {
+		x11_set_xi_eventmask(TRUE);
+	}
+}
+
+void
+x11_disable_cursor_tracking()
+{
+	if (can_track_cursor) {
+		x11_set_xi_eventmask(FALSE);
+	}
+	if (motion_timer) {
+		x11_capture_remove(motion_timer);
+		motion_timer = 0;
+	}
+	motion_pending = FALSE;
+}
 #endif
 
 #ifdef HAVE_XDAMAGE
-	if(damage)
+void
+x11_init_xdamage()
+{
+	if (config.opt_rate > 0) {
+		// user requested fixed refresh rate
+		return;
+	}
+
+	// detect the Xdamage extension
+	int major=1, minor=0, error_base;
+	if (	   !XDamageQueryExtension(display, &xdamage_event_base, &error_base)
+		|| !XDamageQueryVersion(display, &major, &minor)
+		|| (major<1)
+	) {
+		return;
+	}
+
+	// the frames are paced on the refresh rate of the destination monitor
+	// (unless replaying as fast as possible)
+	pacing_init(capture_context, x11_on_frame, x11_sync_vblank);
+	pacing_set_limit((config.replay_file && config.opt_replay_fast) ? 0 : config.opt_limit);
+
+	can_use_xdamage = TRUE;
+}
+
+void
+x11_enable_xdamage()
+{
+	if (can_use_xdamage) {
+		damage = XDamageCreate(display, root_window, XDamageReportRawRectangles);
+#ifdef ADAPTIVE_DAMAGE
+		damage_level = XDamageReportRawRectangles;
+		damage_parts = XFixesCreateRegion(display, NULL, 0);
+		damage_pending = FALSE;
+		damage_rate_start = 0;
+		damage_rate_count = 0;
+#endif
+	}
+}
+
+void
+x11_disable_xdamage()
+{
+	if (damage) {
+		XDamageDestroy(display, damage);
+		damage = 0;
+	}
+#ifdef ADAPTIVE_DAMAGE
+#ifdef ASYNC_DAMAGE
+	x11_cancel_damage_region_request();
+#endif
+	if (damage_parts) {
+		XFixesDestroyRegion(display, damage_parts);
+		damage_parts = 0;
+	}
+#endif
+}
+
+#ifdef ADAPTIVE_DAMAGE
+void
+x11_set_damage_level(int level, Time timestamp)
+{
+	if (level == damage_level) {
+		return;
+	}
+
+	// (the region accumulated by the old damage object would be lost)
+	if (damage_level == XDamageReportNonEmpty) {
+		x11_fetch_damage(timestamp);
+	}
+
+	// create the new damage object before destroying the old one, so
+	// that we do not miss any damage in between
+	Damage old = damage;
+	damage = XDamageCreate(display, root_window, level);
+	XDamageDestroy(display, old);
+
+	damage_level = level;
+	damage_level_start = timestamp;
+	damage_pending = FALSE;
+}
+
+// estimate the rate of damage (rectangles in RawRectangles mode, events in
+// NonEmpty mode) and switch the report level when entering/leaving a damage
+// storm
+void
+x11_update_damage_rate(Time timestamp, int count)
+{
+	damage_rate_count += count;
+
+	guint32 elapsed = (guint32)(timestamp - damage_rate_start);
+	if (elapsed < 1000) {
+		return;
+	}
+
+	guint64 rate = (guint64)damage_rate_count * 1000 / elapsed;
+	damage_rate_start = timestamp;
+	damage_rate_count = 0;
+
+	if ((damage_level == XDamageReportRawRectangles) && (rate > DAMAGE_STORM_RATE)) {
+		x11_set_damage_level(XDamageReportNonEmpty, timestamp);
+	} else if ((damage_level == XDamageReportNonEmpty) && (rate < DAMAGE_CALM_RATE)
+		   && ((guint32)(timestamp - damage_level_start) >= DAMAGE_HOLD_TIME)) {
+		x11_set_damage_level(XDamageReportRawRectangles, timestamp);
+	}
+}
+
+// split a rectangle of the region fetched from the damage object between the
+// sessions
+void
+x11_add_damage_part(Time timestamp, const GdkRectangle* rect, gboolean more)
+{
+	record_damage(timestamp, rect, more);
+
+	struct x11_session* s;
+	for (s=x11_sessions ; s<x11_sessions+n_sessions ; s++) {
+		x11_compute_damaged_rect(s, rect, &s->frame_damage);
+	}
+}
+
+// fetch the region accumulated by the damage object since the last frame
+// (in XDamageReportNonEmpty mode) and split it between the sessions
+//
+// (one round trip, x11_request_damage_region() is the asynchronous version)
+void
+x11_fetch_damage(Time timestamp)
+{
+	if (!damage_pending) {
+		return;
+	}
+	damage_pending = FALSE;
+
+	XDamageSubtract(display, damage, None, damage_parts);
+
+	int i, n = 0;
+	XRectangle* rects = XFixesFetchRegion(display, damage_parts, &n);
+	for (i=0 ; i<n ; i++)
 	{
-		if (ev->type == xdamage_event_base + XDamageNotify)
+		GdkRectangle rect = {
+			rects[i].x,     rects[i].y,
+			rects[i].width, rects[i].height
+		};
+		x11_add_damage_part(timestamp, &rect, i < n-1);
+	}
+	if (rects) {
+		XFree(rects);
+	}
+}
+
+#ifdef ASYNC_DAMAGE
+// request the region accumulated by the damage object since the last frame
+// (the request is not flushed)
+void
+x11_request_damage_region(Time timestamp)
+{
+	damage_pending = FALSE;
+
+	// (Xlib flushes its own requests into XCB first, so the subtraction
+	// comes before the fetch)
+	XDamageSubtract(display, damage, None, damage_parts);
+	damage_region_cookie = xcb_xfixes_fetch_region(xcb, damage_parts);
+	damage_region_requested = TRUE;
+	damage_region_timestamp = timestamp;
+}
+
+// return TRUE if the reply to x11_request_damage_region() was received
+gboolean
+x11_poll_damage_region()
+{
+	if (damage_region_requested) {
+		xcb_generic_error_t* error = NULL;
+		if (xcb_poll_for_reply(xcb, damage_region_cookie.sequence,
+				(void**) &damage_region_reply, &error))
 		{
-			XDamageNotifyEvent* xd_ev = (XDamageNotifyEvent*) ev;
-			static GdkRectangle accumulated_damage = { 0, 0, 0, 0 };
+			damage_region_requested = FALSE;
+			damage_region_received = TRUE;
+			free(error);
+		}
+	}
+	return damage_region_received;
+}
 
-			// get the damaged area
+// handle the reply to x11_request_damage_region(): produce the frame
+void
+x11_on_damage_region_reply()
+{
+	xcb_xfixes_fetch_region_reply_t* r = damage_region_reply;
+	damage_region_reply = NULL;
+	damage_region_received = FALSE;
+
+	if (r) {
+		const xcb_rectangle_t* rects = xcb_xfixes_fetch_region_rectangles(r);
+		int i, n = xcb_xfixes_fetch_region_rectangles_length(r);
+		for (i=0 ; i<n ; i++)
+		{
 			GdkRectangle rect = {
-				xd_ev->area.x,     xd_ev->area.y,
-				xd_ev->area.width, xd_ev->area.height
+				rects[i].x,     rects[i].y,
+				rects[i].width, rects[i].height
 			};
+			x11_add_damage_part(damage_region_timestamp, &rect, i < n-1);
+		}
+		free(r);
+	}
+	x11_produce_frame();
 
-			if (x11_compute_damaged_rect(&rect)) {
-				// source screen damaged
-				if (accumulated_damage.width == 0) {
-					accumulated_damage = rect;
-				} else {
-					gdk_rectangle_union(&rect,
-							&accumulated_damage,
-							&accumulated_damage);
-				}
-			}
+	if (frame_deferred) {
+		frame_deferred = FALSE;
+		pacing_schedule();
+	}
+}
 
-			if (!xd_ev->more && accumulated_damage.width)
-			{
-				x11_try_refresh_image(xd_ev->timestamp, &accumulated_damage);
-				accumulated_damage.width = 0;
+void
+x11_cancel_damage_region_request()
+{
+	if (damage_region_requested) {
+		xcb_discard_reply(xcb, damage_region_cookie.sequence);
+		damage_region_requested = FALSE;
+	}
+	free(damage_region_reply);
+	damage_region_reply = NULL;
+	damage_region_received = FALSE;
+	frame_deferred = FALSE;
+}
+#endif
+#endif
+
+// add the parts of a damaged rectangle to be refreshed in a session into a
+// region (one for each source)
+//
+// return FALSE if the session is not damaged
+gboolean
+x11_compute_damaged_rect(struct x11_session* s, const GdkRectangle* area,
+		struct region* rg)
+{
+	gboolean damaged = FALSE;
+	int i, j;
+	for (i=0 ; i<s->session->n_sources ; i++)
+	{
+#ifdef WINDOW_PIXMAP
+		if (s->window_pixmaps[i]) {
+			// damages are taken from the window
+			continue;
+		}
+#endif
+		// intersect the rectangle with the source
+		GdkRectangle rect;
+		if (!gdk_rectangle_intersect(&s->session->sources[i].rect, area, &rect)) {
+			// source not damaged
+			continue;
+		}
+
+		gboolean inside_dst = FALSE;
+		for (j=0 ; j<s->n_outputs ; j++)
+		{
+			const GdkRectangle* dst_rect = &s->outputs[j].rect;
+
+			// does it intersect with the dst_rect?
+			if (gdk_rectangle_intersect(&rect, dst_rect, NULL)) {
+				// part of the damages are inside dst_rect
+				// keep it only if we have other damages
+				// outside dst_rect
+				GdkRectangle r;
+				gdk_rectangle_union(&rect, dst_rect, &r);
+				if (gdk_rectangle_equal(dst_rect, &r)) {
+					inside_dst = TRUE;
+					break;
+				}
 			}
 		}
+		if (!inside_dst) {
+			// (some) damages outside the dst_rects
+			region_add(rg, &rect);
+			damaged = TRUE;
+		}
 	}
+	return damaged;
+}
 #endif
 
-#ifdef HAVE_XRANDR
-	if (xrandr_event_base)
-	{
-		if (ev->type == xrandr_event_base + RRScreenChangeNotify) {
-			squint_disable();
+
+// incremented by each x11_enable(), the geometry notified before it is stale
+static gint enable_generation = 0;
+
+struct configure_call {
+	const struct output* out;
+	gint generation;
+	GdkRectangle rect;
+};
+
+// apply the new geometry of the window of an output
+void
+x11_set_output_rect(struct x11_output* o, const GdkRectangle* rect)
+{
+	memcpy(&o->rect, rect, sizeof(*rect));
+#ifdef HAVE_XRENDER
+	if (transformed) {
+		if ((rect->width != o->output_width) || (rect->height != o->output_height)) {
+			x11_resize_transform(o);
 		}
+		return;
 	}
 #endif
-	return GDK_FILTER_CONTINUE;
+	if (x11_fix_offset(o)) {
+		x11_update_output_area(o, 0, 0, o->owner->session->mirror_width,
+				o->owner->session->mirror_height);
+		x11_commit_window(o->owner);
+	}
 }
 
-#ifdef HAVE_XI
-void
-x11_set_xi_eventmask(gboolean active)
+// apply the new geometry of the window of an output (in the capture thread)
+gboolean
+x11_on_output_configure(gpointer data)
 {
-	// inspired from: http://keithp.com/blogs/Cursor_tracking/
-
-	XIEventMask evmasks[1];
-	unsigned char mask1[(XI_LASTEVENT + 7)/8];
-	memset(mask1, 0, sizeof(mask1));
+	const struct configure_call* call = data;
 
-	if (active) {
-		// select for button and key events from all master devices
-		XISetMask(mask1, XI_RawMotion);
-		if (!config.opt_passive) {
-			XISetMask(mask1, XI_RawKeyPress);
-		}
+	if (!event_source || (call->generation != g_atomic_int_get(&enable_generation))) {
+		// disabled meanwhile
+		return G_SOURCE_REMOVE;
 	}
-
-	evmasks[0].deviceid = XIAllMasterDevices;
-	evmasks[0].mask_len = sizeof(mask1);
-	evmasks[0].mask = mask1;
-
-	XISelectEvents(display, root_window, evmasks, 1);
+	struct x11_output* o = x11_get_output(call->out);
+	if (o) {
+		x11_set_output_rect(o, &call->rect);
+	}
+	return G_SOURCE_REMOVE;
 }
 
-void x11_init_cursor_tracking()
+gboolean
+x11_on_window_configure_event(GtkWidget *widget, GdkEvent *event, gpointer   user_data)
 {
-	int event, error;
-	if (!XQueryExtension(display, "XInputExtension", &xi_opcode, &event, &error))
-		return;
-
-	int major=2, minor=2;
-	if (XIQueryVersion(display, &major, &minor) != Success)
-		return;
+	GdkEventConfigure* e = (GdkEventConfigure*) event;
 
-	if ((major > 2) || ((major == 2) && (minor >= 2))) {
-		can_track_cursor = TRUE;
+	if(!enabled || fullscreen) {
+		return TRUE;
 	}
+
+	struct configure_call* call = g_new(struct configure_call, 1);
+	call->out = user_data;
+	call->generation = g_atomic_int_get(&enable_generation);
+	call->rect.x = e->x;
+	call->rect.y = e->y;
+	call->rect.width  = e->width;
+	call->rect.height = e->height;
+	g_main_context_invoke_full(capture_context, G_PRIORITY_DEFAULT,
+			x11_on_output_configure, call, g_free);
+	return TRUE;
 }
 
-void
-x11_enable_cursor_tracking()
+gboolean
+x11_on_squint_window_draw(GtkWidget* widget, void* cairo_ctx, gpointer user_data)
 {
-	if (can_track_cursor) {
-		x11_set_xi_eventmask(TRUE);
-	}
+	// do not propagate the event to the GtkWindow
+	return TRUE;
 }
 
+// register the events of the window of an output (in the GTK thread, they are
+// disconnected by x11_disable())
 void
-x11_disable_cursor_tracking()
+x11_connect_output_window(struct output* out)
 {
-	if (can_track_cursor) {
-		x11_set_xi_eventmask(FALSE);
+	if (!fullscreen) {
+		// - window moved/resized
+		g_signal_connect (out->gtkwin, "configure-event", G_CALLBACK (x11_on_window_configure_event), out);
 	}
+
+	// intercept the 'draw' event of the squint window to prevent any rendering by gtk
+	g_signal_connect(out->gtkwin, "draw", G_CALLBACK(x11_on_squint_window_draw), out);
 }
-#endif
 
-#ifdef HAVE_XDAMAGE
+#ifdef HAVE_XSHM
 void
-x11_init_xdamage()
+x11_init_shm()
 {
-	if (config.opt_rate > 0) {
-		// user requested fixed refresh rate
+	if (!config.opt_shm && !config.opt_tile_hash) {
 		return;
 	}
-
-	// detect the Xdamage extension
-	int major=1, minor=0, error_base;
-	if (	   !XDamageQueryExtension(display, &xdamage_event_base, &error_base)
-		|| !XDamageQueryVersion(display, &major, &minor)
-		|| (major<1)
-	) {
+	if (!XShmQueryExtension(display)) {
+		squint_error("The MIT-SHM extension is not available");
 		return;
 	}
-
-	if (config.opt_limit == 0) {
-		// no limit
-		min_refresh_period = 0;
-	} else {
-		// 50 fps by default
-		min_refresh_period = 1000 / ((config.opt_limit<0) ? 50 : config.opt_limit); 
-	}
-
-	can_use_xdamage = TRUE;
+	can_use_shm = TRUE;
 }
 
 void
-x11_enable_xdamage()
+x11_disable_shm(struct x11_session* s)
 {
-	if (can_use_xdamage) {
-		damage = XDamageCreate(display, root_window, XDamageReportRawRectangles);
+	if (!s->shm_frame) {
+		return;
 	}
+
+	XShmDetach(display, &s->shm_info);
+	XSync(display, False);
+	shmdt(s->shm_info.shmaddr);
+
+	s->shm_frame->data = NULL;
+	XDestroyImage(s->shm_frame);
+	s->shm_frame = NULL;
+	s->shm_scratch = NULL;
 }
 
 void
-x11_disable_xdamage()
+x11_enable_shm(struct x11_session* s)
 {
-	if (damage) {
-		XDamageDestroy(display, damage);
-		damage = 0;
+	if (!can_use_shm || (s->session->n_sources > 1)) {
+		return;
 	}
-}
+#ifdef WINDOW_PIXMAP
+	if (s->window_pixmaps[0]) {
+		// (the window is not captured from the screen)
+		return;
+	}
+#endif
 
-gboolean
-x11_compute_damaged_rect(GdkRectangle* rect)
-{
-	// intersect the rectangle with src_rect
-	if (!gdk_rectangle_intersect(&src_rect, rect, rect)) {
-		// src_rect not damaged
-		return FALSE;
+	s->shm_frame = XShmCreateImage(display, DefaultVisual(display, screen), depth,
+			ZPixmap, NULL, &s->shm_info,
+			s->session->mirror_width, s->session->mirror_height);
+	if (!s->shm_frame) {
+		x11_error("XShmCreateImage() failed");
+		return;
 	}
 
-	// does it intersect with the dst_rect?
-	if (gdk_rectangle_intersect(rect, &dst_rect, NULL)) {
-		// part of the damages are inside dst_rect
-		// return TRUE only if we have other damages outside dst_rect
-		GdkRectangle r;
-		gdk_rectangle_union(rect,   &dst_rect, &r);
-		return !gdk_rectangle_equal(&dst_rect, &r);
-	} else {
-		// all damages outside dst_rect
-		return TRUE;
+	// one frame + the scratch area
+	size_t frame_size = s->shm_frame->bytes_per_line * s->shm_frame->height;
+	s->shm_info.shmid = shmget(IPC_PRIVATE, 2 * frame_size, IPC_CREAT | 0600);
+	if (s->shm_info.shmid < 0) {
+		x11_error("shmget() failed");
+		XDestroyImage(s->shm_frame);
+		s->shm_frame = NULL;
+		return;
+	}
+	s->shm_info.shmaddr = shmat(s->shm_info.shmid, NULL, 0);
+	s->shm_info.readOnly = False;
+
+	// the segment is destroyed as soon as both processes are detached
+	shmctl(s->shm_info.shmid, IPC_RMID, NULL);
+
+	if (s->shm_info.shmaddr == (char*)-1) {
+		x11_error("shmat() failed");
+		XDestroyImage(s->shm_frame);
+		s->shm_frame = NULL;
+		return;
+	}
+	s->shm_frame->data = s->shm_info.shmaddr;
+	s->shm_scratch = s->shm_info.shmaddr + frame_size;
+
+	// attaching fails if the X server is remote
+	x11_error_trap_push();
+	XShmAttach(display, &s->shm_info);
+	XSync(display, False);
+	if (x11_error_trap_pop()) {
+		x11_error("XShmAttach() failed, falling back to server-side copies");
+		shmdt(s->shm_info.shmaddr);
+		s->shm_frame->data = NULL;
+		XDestroyImage(s->shm_frame);
+		s->shm_frame = NULL;
+		can_use_shm = FALSE;
 	}
 }
 #endif
 
+// number of requests sent to the X server (for the statistics)
+//
+// (sampled by the capture thread before it sleeps, since the statistics are
+// reported by the GTK thread)
+static guint64 request_count = 0;
+G_LOCK_DEFINE_STATIC(request_count);
 
-gboolean
-x11_on_window_configure_event(GtkWidget *widget, GdkEvent *event, gpointer   user_data)
+void
+x11_sample_request_count()
 {
-	GdkEventConfigure* e = (GdkEventConfigure*) event;
-	GdkRectangle rect;
-	rect.x = e->x;
-	rect.y = e->y;
-	rect.width  = e->width;
-	rect.height = e->height;
-
-	if(!enabled) {
-		return TRUE;
-	}
+	G_LOCK(request_count);
+	request_count = XNextRequest(display) - 1;
+	G_UNLOCK(request_count);
+}
 
-	if(!fullscreen) {
-		memcpy(&dst_rect, &rect, sizeof(rect));
-		if (x11_fix_offset()) {
-			XClearWindow(display, window);
-		}
-	}
-	return TRUE;
+guint64
+x11_request_count()
+{
+	G_LOCK(request_count);
+	guint64 count = request_count;
+	G_UNLOCK(request_count);
+	return count;
 }
 
 #ifdef HAVE_XRANDR
@@ -844,12 +4139,81 @@ x11_init_xrandr()
 
 	XRRSelectInput(display, root_window, RRScreenChangeNotifyMask);
 }
+
+// refresh rate (in Hz) of the CRTC displaying the center of a rectangle (0 if
+// unknown)
+double
+x11_get_refresh_rate(const GdkRectangle* r)
+{
+	if (!xrandr_event_base) {
+		return 0;
+	}
+	XRRScreenResources* res = XRRGetScreenResourcesCurrent(display, root_window);
+	if (!res) {
+		return 0;
+	}
+
+	int cx = r->x + r->width  / 2;
+	int cy = r->y + r->height / 2;
+	double rate = 0;
+	int i, j;
+	for (i=0 ; (i<res->ncrtc) && !rate ; i++)
+	{
+		XRRCrtcInfo* crtc = XRRGetCrtcInfo(display, res, res->crtcs[i]);
+		if (!crtc) {
+			continue;
+		}
+		if (crtc->mode
+		    && (cx >= crtc->x) && (cx < crtc->x + (int)crtc->width)
+		    && (cy >= crtc->y) && (cy < crtc->y + (int)crtc->height))
+		{
+			for (j=0 ; j<res->nmode ; j++)
+			{
+				const XRRModeInfo* m = &res->modes[j];
+				if (m->id != crtc->mode) {
+					continue;
+				}
+				double lines = m->vTotal;
+				if (m->modeFlags & RR_DoubleScan) {
+					lines *= 2;
+				}
+				if (m->modeFlags & RR_Interlace) {
+					lines /= 2;
+				}
+				if (m->hTotal && lines) {
+					rate = m->dotClock / (m->hTotal * lines);
+				}
+			}
+		}
+		XRRFreeCrtcInfo(crtc);
+	}
+	XRRFreeScreenResources(res);
+	return rate;
+}
 #endif
 
+// must be called before any other Xlib call (the connection of GDK and the
+// capture connection are used by two threads)
+void
+x11_init_threads()
+{
+	XInitThreads();
+}
+
 gboolean
 x11_init()
 {
-	display = gdk_x11_get_default_xdisplay();
+	// open the capture connection
+	display = XOpenDisplay(DisplayString(gdk_x11_get_default_xdisplay()));
+	if (!display) {
+		squint_error("cannot open the X display");
+		return FALSE;
+	}
+	gdk_error_handler = XSetErrorHandler(x11_on_error);
+	capture_context = g_main_context_new();
+#ifdef HAVE_XCB
+	xcb = XGetXCBConnection(display);
+#endif
 
 	screen = DefaultScreen (display);
 
@@ -883,6 +4247,25 @@ x11_init()
 #endif
 #ifdef COPY_CURSOR
 	x11_init_copy_cursor();
+#ifdef OVERLAY_CURSOR
+	x11_init_overlay_cursor();
+#endif
+#endif
+#ifdef HAVE_XPRESENT
+	x11_init_present();
+#endif
+#ifdef HAVE_XRENDER
+	x11_init_transform();
+	x11_init_composite();
+#else
+	if ((config.opt_scale != SCALE_NONE) || config.opt_rotate
+	    || config.opt_flip_h || config.opt_flip_v) {
+		squint_error("squint was built without XRender, the mirror cannot be scaled or rotated");
+	}
+	if (config.opt_layout == LAYOUT_PIP) {
+		squint_error("squint was built without XRender, falling back to the tiles layout");
+		config.opt_layout = LAYOUT_TILES;
+	}
 #endif
 #ifdef HAVE_XI
 	x11_init_cursor_tracking();
@@ -890,193 +4273,587 @@ x11_init()
 #ifdef HAVE_XDAMAGE
 	x11_init_xdamage();
 #endif
+#ifdef HAVE_XSHM
+	x11_init_shm();
+#endif
+#ifdef WINDOW_PIXMAP
+	x11_init_window_pixmaps();
+#endif
+
+	// atom name
+	net_active_window_atom = XInternAtom(display, "_NET_ACTIVE_WINDOW", FALSE);
+
+	x11_sample_request_count();
+	stats_set_request_counter(x11_request_count);
+	stats_watch_context(capture_context);
+
+	g_thread_new("capture", x11_capture_thread, NULL);
+	return TRUE;
+}
+
+// erase the previous cursor of a session (if any)
+gboolean
+x11_clear_cursor(struct x11_session* s)
+{
+#ifdef OVERLAY_CURSOR
+	if (overlay_cursor) {
+		// (never drawn into the mirror)
+		return FALSE;
+	}
+#endif
+	if (s->backed_up)
+	{
+		trace_begin("clear_cursor");
+		if (s->direct) {
+			// copy the area again from the root window
+			XCopyArea(display, root_window, s->canvas, gc,
+					s->backup.x + s->session->sources[0].rect.x,
+					s->backup.y + s->session->sources[0].rect.y,
+					s->backup.width, s->backup.height,
+					s->backup.x, s->backup.y);
+		} else {
+			XCopyArea(display, s->backup_pixmap, s->pixmap, gc,
+					0, 0,
+					s->backup.width, s->backup.height,
+					s->backup.x, s->backup.y);
+		}
+		s->backed_up = FALSE;
+		trace_end("clear_cursor");
+		return TRUE;
+	} else {
+		return FALSE;
+	}
+}
+
+// save the area below the cursor (s->backup)
+void
+x11_backup_cursor_area(struct x11_session* s)
+{
+	s->backed_up = TRUE;
+	if (!s->direct) {
+		XCopyArea(display, s->pixmap, s->backup_pixmap, gc,
+				s->backup.x, s->backup.y,
+				s->backup.width, s->backup.height,
+				0, 0);
+	}
+}
+
+// draw the new cursor of a session (if on screen)
+gboolean
+x11_draw_cursor(struct x11_session* s)
+{
+	const GdkPoint cursor = s->cursor;
+#ifdef OVERLAY_CURSOR
+	if (overlay_cursor) {
+		return FALSE;
+	}
+#endif
+	if (cursor.x >= 0)
+	{
+		trace_begin("draw_cursor");
+#ifdef COPY_CURSOR
+		if (copy_cursor && current_cursor) {
+			const struct cursor* c = current_cursor;
+			s->backup = (GdkRectangle){ cursor.x - c->xhot, cursor.y - c->yhot,
+					c->width, c->height };
+			x11_backup_cursor_area(s);
+			XRenderComposite(display, PictOpOver,
+					c->picture, 0,
+					s->pixmap_picture,
+					0, 0, 0, 0,
+					s->backup.x, s->backup.y,
+					s->backup.width, s->backup.height);
+		}
+		else
+#endif
+		{
+			const int len = CURSOR_CROSSHAIR_LEN;
+			s->backup = (GdkRectangle){ cursor.x - (len+1), cursor.y - (len+1),
+					CURSOR_CROSSHAIR_SIZE, CURSOR_CROSSHAIR_SIZE };
+			x11_backup_cursor_area(s);
+			XDrawLine(display, s->canvas, gc_white,
+					cursor.x-(len+1), cursor.y,
+					cursor.x+(len+2), cursor.y);
+			XDrawLine(display, s->canvas, gc_white,
+					cursor.x, cursor.y-(len+1),
+					cursor.x, cursor.y+(len+2));
+			XDrawLine(display, s->canvas, gc,
+					cursor.x-len, cursor.y,
+					cursor.x+len, cursor.y);
+			XDrawLine(display, s->canvas, gc,
+					cursor.x, cursor.y-len,
+					cursor.x, cursor.y+len);
+
+		}
+		trace_end("draw_cursor");
+		return TRUE;
+	} else {
+		return FALSE;
+	}
+}
+
+void
+x11_redraw_cursor(struct x11_session* s, gboolean clear_window)
+{
+#ifdef OVERLAY_CURSOR
+	if (overlay_cursor) {
+		struct x11_output* o;
+		gboolean updated = FALSE;
+		for (o=s->outputs ; o<s->outputs+s->n_outputs ; o++) {
+			x11_move_overlay_cursor(o);
+			if (o->moved) {
+				o->moved = FALSE;
+				x11_update_output_area(o, 0, 0, s->session->mirror_width,
+						s->session->mirror_height);
+				updated = TRUE;
+			}
+		}
+		if (updated) {
+			x11_commit_window(s);
+		}
+		stats_cursor(0);
+		return;
+	}
+#endif
+	GdkRectangle cleared_rect = s->backup;
+
+	gboolean cleared = x11_clear_cursor(s);
+	gboolean drawn   = x11_draw_cursor(s);
+
+	if (clear_window) {
+		GdkRectangle rect = {0, 0, 0, 0};
+		if (drawn && cleared) {
+			gdk_rectangle_union(&s->backup, &cleared_rect, &rect);
+		}
+		else if (drawn)
+		{
+			rect = s->backup;
+		}
+		else if (cleared)
+		{
+			rect = cleared_rect;
+		}
+
+		// the outputs whose offset was updated are redrawn entirely
+		struct x11_output* o;
+		gboolean updated = FALSE;
+		for (o=s->outputs ; o<s->outputs+s->n_outputs ; o++) {
+			if (o->moved) {
+				o->moved = FALSE;
+				x11_update_output_area(o, 0, 0, s->session->mirror_width,
+						s->session->mirror_height);
+				updated = TRUE;
+			} else if (rect.width) {
+				x11_update_output_area(o, rect.x, rect.y,
+						rect.width, rect.height);
+				updated = TRUE;
+			}
+		}
+		if (!updated) {
+			return;
+		}
+		x11_commit_window(s);
+		stats_cursor(rect.width * rect.height * 4);
+	}
+}
+
+//
+// Prepare the windows to host the duplicated screen (create the pixmaps, subwindows)
+//
+// initialises:
+// 	x11_sessions (pixmap, cursor & outputs)
+//
+
+// create the sub-window of an output
+void
+x11_enable_output_window(struct x11_session* s, struct x11_output* o, struct output* out)
+{
+	memset(o, 0, sizeof(*o));
+	o->owner = s;
+	o->out = out;
+	o->rect = out->rect;
+
+	// have the main window painted black by X11
+	Window squint_window = gdk_x11_window_get_xid(out->gdkwin);
+	XSetWindowBackground(display, squint_window, 0);
+
+	XSetWindowAttributes attr;
+	unsigned long mask = CWBackPixmap;
+	attr.background_pixmap = s->direct ? None : s->pixmap;
+	int width  = s->session->mirror_width;
+	int height = s->session->mirror_height;
+#ifdef HAVE_XRENDER
+	if (x11_enable_transform(o)) {
+		attr.background_pixmap = o->output_pixmap;
+		width  = o->output_width;
+		height = o->output_height;
+	}
+#endif
+#ifdef HAVE_XPRESENT
+	if (can_present) {
+		attr.background_pixmap = None;
+	}
+#endif
+	if (s->direct) {
+		// let the server keep the content when possible
+		attr.backing_store = WhenMapped;
+		mask |= CWBackingStore;
+	}
+	o->window = XCreateWindow (display, squint_window,
+				o->offset.x, o->offset.y,
+				width, height,
+				0, CopyFromParent,
+				InputOutput, CopyFromParent,
+				mask, &attr);
+	if (s->direct) {
+		XSelectInput(display, o->window, ExposureMask);
+	}
+#ifdef HAVE_XPRESENT
+	x11_enable_present(o, width, height);
+#endif
+	XMapWindow(display, o->window);
+
+#ifdef OVERLAY_CURSOR
+	if (overlay_cursor) {
+		// (a sibling of the output window, so that the copies into
+		// the window in direct mode do not overwrite it)
+		o->cursor_window = XCreateWindow (display, squint_window,
+					0, 0, 1, 1,
+					0, CopyFromParent,
+					InputOutput, CopyFromParent,
+					0, NULL);
+		o->cursor_mapped = FALSE;
+		if (current_cursor) {
+			x11_set_overlay_cursor(o);
+		}
+	}
+#endif
+}
 
-	// atom name
-	net_active_window_atom = XInternAtom(display, "_NET_ACTIVE_WINDOW", FALSE);
-
-	return TRUE;
+#ifdef HAVE_XRENDER
+// set the transform of a scaled tile (from mirror coordinates to root window
+// coordinates, the tile is shrunk by the X server)
+void
+x11_update_tile_transform(struct x11_session* s, int index)
+{
+	const struct source* src = &s->session->sources[index];
+	double kx = (double) src->rect.width  / src->tile.width;
+	double ky = (double) src->rect.height / src->tile.height;
+	double x = src->rect.x, y = src->rect.y;
+#ifdef WINDOW_PIXMAP
+	if (s->window_pixmaps[index]) {
+		// (the window pixmap starts at the origin of the source)
+		x = y = 0;
+	}
+#endif
+	XTransform t = {{
+		{ XDoubleToFixed(kx), 0, XDoubleToFixed(x - src->tile.x * kx) },
+		{ 0, XDoubleToFixed(ky), XDoubleToFixed(y - src->tile.y * ky) },
+		{ 0, 0,                  XDoubleToFixed(1) },
+	}};
+	XRenderSetPictureTransform(display, s->tile_pictures[index], &t);
 }
+#endif
 
-gboolean
-x11_on_squint_window_draw(GtkWidget* widget, void* cairo_ctx, gpointer user_data)
+#ifdef HAVE_XRENDER
+// create the picture used to draw a tile with XRender (from the root window
+// or a window pixmap)
+void
+x11_create_tile_picture(struct x11_session* s, int index, Drawable src, Visual* visual)
 {
-	// do not propagate the event to the GtkWindow
-	return TRUE;
+	XRenderPictureAttributes attr;
+	attr.subwindow_mode = IncludeInferiors;
+	s->tile_pictures[index] = XRenderCreatePicture(display, src,
+			XRenderFindVisualFormat(display, visual),
+			CPSubwindowMode, &attr);
+	x11_update_tile_transform(s, index);
+	x11_set_picture_filter(s->tile_pictures[index]);
+
+	if (!s->canvas_picture) {
+		s->canvas_picture = XRenderCreatePicture(display, s->pixmap,
+				XRenderFindVisualFormat(display, DefaultVisual(display, screen)),
+				0, NULL);
+	}
 }
+#endif
 
-// erase the previous cursor (if any)
-gboolean
-x11_clear_cursor()
+#ifdef WINDOW_PIXMAP
+// redirect the tracked windows of a session and name their pixmaps
+void
+x11_enable_window_pixmaps(struct x11_session* s)
 {
-	if (backup.x != -CURSOR_SIZE)
+	const struct session* session = s->session;
+	int i;
+	for (i=0 ; i<session->n_sources ; i++)
 	{
-		XCopyArea(display, backup_pixmap, pixmap, gc,
-				0, 0,
-				CURSOR_SIZE, CURSOR_SIZE,
-				backup.x, backup.y);
-		backup.x = -CURSOR_SIZE;
-		return TRUE;
-	} else {
-		return FALSE;
+		const struct source* src = &session->sources[i];
+		if (!src->window) {
+			continue;
+		}
+
+		// ignore X11 errors (the window belongs to another application)
+		x11_error_trap_push();
+
+		XWindowAttributes attr;
+		if (!XGetWindowAttributes(display, src->window, &attr)
+		    || (attr.map_state != IsViewable)) {
+			x11_error_trap_pop_ignored();
+			continue;
+		}
+#ifndef HAVE_XRENDER
+		if (attr.depth != depth) {
+			// cannot be copied with XCopyArea
+			x11_error_trap_pop_ignored();
+			continue;
+		}
+#endif
+		XCompositeRedirectWindow(display, src->window, CompositeRedirectAutomatic);
+		s->window_pixmaps[i] = XCompositeNameWindowPixmap(display, src->window);
+		XSync(display, False);
+		if (x11_error_trap_pop()) {
+			x11_error("XCompositeNameWindowPixmap() failed, capturing the window from the screen");
+			s->window_pixmaps[i] = 0;
+			continue;
+		}
+
+#ifdef HAVE_XRENDER
+		if (attr.depth != depth) {
+			// (eg: ARGB window) copied with XRender
+			x11_create_tile_picture(s, i, s->window_pixmaps[i], attr.visual);
+		}
+#endif
+		if (can_use_xdamage) {
+			s->window_damages[i] = XDamageCreate(display, src->window,
+					XDamageReportRawRectangles);
+		}
 	}
 }
 
-// draw the new cursor (if on screen)
-gboolean
-x11_draw_cursor()
+void
+x11_disable_window_pixmaps(struct x11_session* s)
 {
-	if (cursor.x >= 0)
+	int i;
+	x11_error_trap_push();
+	for (i=0 ; i<MAX_SOURCES ; i++)
 	{
-#ifdef COPY_CURSOR
-		if (copy_cursor) {
-			backup.x = cursor.x - cursor_xhot;
-			backup.y = cursor.y - cursor_yhot;
-			XCopyArea(display, pixmap, backup_pixmap, gc,
-					backup.x, backup.y,
-					CURSOR_SIZE, CURSOR_SIZE,
-					0, 0);
-			XRenderComposite(display, PictOpOver,
-					cursor_picture, 0,
-					pixmap_picture,
-					0, 0, 0, 0,
-					backup.x, backup.y, CURSOR_SIZE, CURSOR_SIZE);
+		if (s->window_damages[i]) {
+			XDamageDestroy(display, s->window_damages[i]);
+			s->window_damages[i] = 0;
 		}
-		else
-#endif
-		{
-			const int len = CURSOR_CROSSHAIR_LEN;
-			backup.x = cursor.x - (len+1);
-			backup.y = cursor.y - (len+1);
-			XCopyArea(display, pixmap, backup_pixmap, gc,
-					backup.x, backup.y,
-					CURSOR_SIZE, CURSOR_SIZE,
-					0, 0);
-			XDrawLine(display, pixmap, gc_white,
-					cursor.x-(len+1), cursor.y,
-					cursor.x+(len+2), cursor.y);
-			XDrawLine(display, pixmap, gc_white,
-					cursor.x, cursor.y-(len+1),
-					cursor.x, cursor.y+(len+2));
-			XDrawLine(display, pixmap, gc,
-					cursor.x-len, cursor.y,
-					cursor.x+len, cursor.y);
-			XDrawLine(display, pixmap, gc,
-					cursor.x, cursor.y-len,
-					cursor.x, cursor.y+len);
+		if (s->window_pixmaps[i]) {
+			XFreePixmap(display, s->window_pixmaps[i]);
+			XCompositeUnredirectWindow(display, s->session->sources[i].window,
+					CompositeRedirectAutomatic);
+			s->window_pixmaps[i] = 0;
+		}
+	}
+	x11_error_trap_pop_ignored();
+}
 
+// return TRUE if a session has a source to be captured from a window pixmap
+gboolean
+x11_has_window_pixmap(const struct session* session)
+{
+	int i;
+	for (i=0 ; i<session->n_sources ; i++) {
+		if (session->sources[i].window && can_name_pixmap) {
+			return TRUE;
 		}
-		return TRUE;
-	} else {
-		return FALSE;
 	}
+	return FALSE;
 }
+#endif
 
+// prepare the pixmap of a session composited from several sources
 void
-x11_redraw_cursor(gboolean clear_window)
+x11_enable_tiles(struct x11_session* s)
 {
-	int cleared_x = backup.x;
-	int cleared_y = backup.y;
+	const struct session* session = s->session;
+	int i, j;
 
-	gboolean cleared = x11_clear_cursor();
-	gboolean drawn   = x11_draw_cursor();
+	// the gaps between the tiles are black
+	XFillRectangle(display, s->pixmap, gc, 0, 0,
+			session->mirror_width, session->mirror_height);
 
-	if (clear_window) {
-		GdkRectangle rect = {0, 0, CURSOR_SIZE, CURSOR_SIZE };
-		if (drawn && cleared) {
-			rect.x = MIN(backup.x, cleared_x);
-			rect.y = MIN(backup.y, cleared_y);
-			rect.width  += ABS(backup.x - cleared_x);
-			rect.height += ABS(backup.y - cleared_y);
-		}
-		else if (drawn)
-		{
-			rect.x = backup.x;
-			rect.y = backup.y;
+	for (i=0 ; i<session->n_sources ; i++)
+	{
+		const struct source* src = &session->sources[i];
+		for (j=0 ; j<i ; j++) {
+			s->overlapping |= gdk_rectangle_intersect(&src->tile, &session->sources[j].tile, NULL);
 		}
-		else if (cleared)
-		{
-			rect.x = cleared_x;
-			rect.y = cleared_y;
+
+#ifdef HAVE_XRENDER
+		if (!can_composite || ((src->tile.width == src->rect.width)
+					&& (src->tile.height == src->rect.height))) {
+			continue;
 		}
-		else
-		{
-			return;
+
+		if (!s->tile_pictures[i]) {
+			Drawable d = root_window;
+#ifdef WINDOW_PIXMAP
+			if (s->window_pixmaps[i]) {
+				d = s->window_pixmaps[i];
+			}
+#endif
+			x11_create_tile_picture(s, i, d, DefaultVisual(display, screen));
 		}
-		XClearArea(display, window, rect.x, rect.y,
-				rect.width, rect.height, FALSE);
+#endif
 	}
 }
 
-//
-// Prepare the window to host the duplicated screen (create the pixmap, subwindow)
-//
-// initialises:
-// 	offset
-// 	pixmap
-// 	window
-//	cursor
-//
-
 void
-x11_enable_window()
+x11_disable_tiles(struct x11_session* s)
 {
-	cursor.x = -1;
-	cursor.y = -1;
-	offset.x = 0;
-	offset.y = 0;
-
-	if (!fullscreen) {
-		// register events
-		// - window moved/resized
-		g_signal_connect (gtkwin, "configure-event", G_CALLBACK (x11_on_window_configure_event), NULL);
+#ifdef HAVE_XRENDER
+	int i;
+	for (i=0 ; i<MAX_SOURCES ; i++) {
+		if (s->tile_pictures[i]) {
+			XRenderFreePicture(display, s->tile_pictures[i]);
+			s->tile_pictures[i] = 0;
+		}
 	}
+#endif
+	s->overlapping = FALSE;
+}
 
-	// intercept the 'draw' event of the squint window to prevent any rendering by gtk
-	g_signal_connect(gtkwin, "draw", G_CALLBACK(x11_on_squint_window_draw), NULL);
+// return TRUE if a session can be drawn directly into the window of its output
+gboolean
+x11_can_use_direct(const struct session* session)
+{
+	// the direct mode is not compatible with the modes that process the
+	// pixmap (and it needs the pixmap to be shared by several outputs or
+	// composited from several sources)
+	gboolean direct = config.opt_direct && (session->n_outputs == 1) && (session->n_sources == 1);
+#ifdef WINDOW_PIXMAP
+	direct &= !x11_has_window_pixmap(session);
+#endif
+#ifdef HAVE_XRENDER
+	direct &= !can_transform;
+#endif
+#ifdef HAVE_XPRESENT
+	direct &= !can_present;
+#endif
+#ifdef HAVE_XSHM
+	direct &= !can_use_shm;
+#endif
+	return direct;
+}
 
-	// have the main window painted black by X11
-	Window squint_window = gdk_x11_window_get_xid(gdkwin);
-	XSetWindowBackground(display, squint_window, 0);
+// create the pixmap and the sub-windows of a session
+void
+x11_enable_session_window(struct x11_session* s, struct session* session)
+{
+	memset(s, 0, sizeof(*s));
+	s->session = session;
+	s->n_outputs = session->n_outputs;
+	s->cursor.x = -1;
+	s->cursor.y = -1;
+	s->direct = x11_can_use_direct(session);
 
 	// create the pixmap
-	pixmap = XCreatePixmap (display, root_window, src_rect.width, src_rect.height, depth);
-	
-	// create the sub-window
-	{
-		XSetWindowAttributes attr;
-		attr.background_pixmap = pixmap;
-		window = XCreateWindow (display, squint_window,
-					offset.x, offset.y,
-					src_rect.width, src_rect.height,
-					0, CopyFromParent,
-					InputOutput, CopyFromParent,
-					CWBackPixmap, &attr);
-		XMapWindow(display, window);
+	s->pixmap = s->direct ? 0 : XCreatePixmap (display, root_window,
+			session->mirror_width, session->mirror_height, depth);
+#ifdef WINDOW_PIXMAP
+	if (can_name_pixmap) {
+		x11_enable_window_pixmaps(s);
+	}
+#endif
+	if (session->n_sources > 1) {
+		x11_enable_tiles(s);
+	}
+
+	// create the sub-windows
+	int i;
+	for (i=0 ; i<s->n_outputs ; i++) {
+		x11_enable_output_window(s, &s->outputs[i], &session->outputs[i]);
 	}
+	s->canvas = s->direct ? s->outputs[0].window : s->pixmap;
 
 	// create a backup pixmap for storing the background (below the cursor)
-	backup.x = -CURSOR_SIZE;
-	backup_pixmap = XCreatePixmap(display, root_window,
+	s->backed_up = FALSE;
+	s->backup_pixmap = XCreatePixmap(display, root_window,
 				CURSOR_SIZE, CURSOR_SIZE, 24);
+}
+
+void
+x11_enable_window()
+{
+	int i;
+	for (i=0 ; i<n_sessions ; i++) {
+		x11_enable_session_window(&x11_sessions[i], &sessions[i]);
+	}
 
 	// force refreshing the cursor position
 	x11_refresh_cursor_location(TRUE);
 }
 
+// destroy the sub-window of an output
 void
-x11_disable_window()
+x11_disable_output_window(struct x11_output* o)
 {
-	XFreePixmap(display, backup_pixmap);
-	backup_pixmap = 0;
-	backup.x = -CURSOR_SIZE;
+#ifdef HAVE_XPRESENT
+	x11_disable_present(o);
+#endif
+#ifdef OVERLAY_CURSOR
+	if (o->cursor_window) {
+		XDestroyWindow(display, o->cursor_window);
+		o->cursor_window = 0;
+	}
+#endif
+	XDestroyWindow(display, o->window);
+	o->window = 0;
 
-	XDestroyWindow(display, window);
-	window = 0;
+#ifdef HAVE_XRENDER
+	x11_disable_transform(o);
+#endif
+}
 
-	XFreePixmap(display, pixmap);
-	pixmap = 0;
+void
+x11_disable_session_window(struct x11_session* s)
+{
+#ifdef WINDOW_PIXMAP
+	x11_disable_window_pixmaps(s);
+#endif
+	XFreePixmap(display, s->backup_pixmap);
+	s->backup_pixmap = 0;
+	s->backed_up = FALSE;
+
+	struct x11_output* o;
+	for (o=s->outputs ; o<s->outputs+s->n_outputs ; o++) {
+		x11_disable_output_window(o);
+	}
+	s->n_outputs = 0;
+
+	x11_disable_tiles(s);
+#ifdef HAVE_XRENDER
+	if (s->canvas_picture) {
+		XRenderFreePicture(display, s->canvas_picture);
+		s->canvas_picture = 0;
+	}
+#endif
+
+	if (s->pixmap) {
+		XFreePixmap(display, s->pixmap);
+		s->pixmap = 0;
+	}
+	s->canvas = 0;
+	s->direct = FALSE;
 }
 
+void
+x11_disable_window()
+{
+	int i;
+	for (i=0 ; i<n_sessions ; i++) {
+		x11_disable_session_window(&x11_sessions[i]);
+	}
+#ifdef HAVE_XPRESENT
+	present = FALSE;
+#endif
+#ifdef HAVE_XRENDER
+	transformed = FALSE;
+#endif
+}
 
 void
 x11_enable_focus_tracking()
@@ -1099,15 +4876,41 @@ x11_disable_focus_tracking()
 	XChangeWindowAttributes(display, root_window, CWEventMask, &attr);
 }
 
-void
-x11_enable()
+gboolean
+x11_enable_capture(gpointer data)
 {
+	gboolean* result = data;
+
+	// when replaying a recording, the events are not taken from the X
+	// server (and the mirror is not enabled if it cannot be loaded)
+	gboolean live = !config.replay_file;
+	if (!live && !x11_start_replay()) {
+		*result = FALSE;
+		return G_SOURCE_REMOVE;
+	}
+	*result = TRUE;
+
+	// drop the events received while disabled
+	XSync(display, True);
+
 	x11_enable_window();
 
-	x11_enable_focus_tracking();
+	int i;
+#ifdef HAVE_XSHM
+	for (i=0 ; i<n_sessions ; i++) {
+		x11_enable_shm(&x11_sessions[i]);
+	}
+#endif
+
+	if (live) {
+		x11_enable_focus_tracking();
+		x11_enable_window_tracking();
+	}
 	
 #ifdef HAVE_XI
-	x11_enable_cursor_tracking();
+	if (live) {
+		x11_enable_cursor_tracking();
+	}
 #endif
 
 #ifdef COPY_CURSOR
@@ -1115,21 +4918,38 @@ x11_enable()
 #endif
 
 #ifdef HAVE_XDAMAGE
-	x11_enable_xdamage();
+	{
+		double hz = 0;
+#ifdef HAVE_XRANDR
+		// (the frames are paced on the first output of the first
+		// session)
+		hz = x11_get_refresh_rate(&sessions[0].outputs[0].rect);
+#endif
+		pacing_set_refresh_rate(hz);
+	}
+	if (live) {
+		x11_enable_xdamage();
+	}
 #endif
 
 	XFlush (display);
 
 	x11_get_window_geometry(root_window, &root_window_rect);
-	x11_active_window_start_monitoring();
+	if (live) {
+		x11_active_window_start_monitoring();
+	}
 
 	// catch all X11 events
-	gdk_window_add_filter(NULL, x11_on_x11_event, NULL);
+	event_source = g_source_new(&x11_event_source_funcs, sizeof(GSource));
+	g_source_add_unix_fd(event_source, ConnectionNumber(display), G_IO_IN);
+	g_source_set_priority(event_source, G_PRIORITY_HIGH);
+	g_source_attach(event_source, capture_context);
 
+	if (live
 #if HAVE_XDAMAGE && HAVE_XI
-	if (!(damage && can_track_cursor))
+	    && !(damage && can_track_cursor)
 #endif
-	{
+	) {
 		int rate = 25; // default to 25 fps
 		if(config.opt_rate > 0) {
 			rate = config.opt_rate;
@@ -1137,31 +4957,70 @@ x11_enable()
 			rate = config.opt_limit;
 		}
 
-		refresh_timer = g_timeout_add (1000/rate,
-				G_SOURCE_FUNC(&x11_refresh_image), &src_rect);
+#ifdef HAVE_XSHM
+		// (the tiles are tracked for a single session)
+		if (config.opt_tile_hash && x11_sessions[0].shm_frame && (n_sessions == 1)
+#ifdef HAVE_XDAMAGE
+		    && !damage
+#endif
+		) {
+			tiles_init(sessions[0].mirror_width, sessions[0].mirror_height);
+			shm_tiles = TRUE;
+			refresh_timer = x11_capture_add (1000/rate,
+					G_SOURCE_FUNC(&x11_refresh_tiles), NULL);
+		} else
+#endif
+		refresh_timer = x11_capture_add (1000/rate,
+				G_SOURCE_FUNC(&x11_refresh_image), &root_window_rect);
+	}
+
+	int j;
+#ifdef WINDOW_PIXMAP
+	// (the window pixmaps are not damaged until the windows are redrawn)
+	for (i=0 ; i<n_sessions ; i++) {
+		for (j=0 ; j<sessions[i].n_sources ; j++) {
+			if (x11_sessions[i].window_pixmaps[j]) {
+				x11_refresh_image(&sessions[i].sources[j].rect);
+			}
+		}
 	}
+#endif
 
-	// Redraw the window
-	XClearWindow(display, gdk_x11_window_get_xid(gdkwin));
+	// Redraw the windows
+	for (i=0 ; i<n_sessions ; i++) {
+		for (j=0 ; j<sessions[i].n_outputs ; j++) {
+			XClearWindow(display, gdk_x11_window_get_xid(sessions[i].outputs[j].gdkwin));
+		}
+	}
+	XFlush(display);
+	return G_SOURCE_REMOVE;
 }
 
-void
-x11_disable()
+gboolean
+x11_disable_capture(gpointer data)
 {
+	x11_stop_replay();
+
 #ifdef HAVE_XDAMAGE
-	if (refresh_timeout) {
-		g_source_remove(refresh_timeout);
-		refresh_timeout = 0;
-	}
+	pacing_cancel();
 #endif
 	if (refresh_timer) {
-		g_source_remove(refresh_timer);
+		x11_capture_remove(refresh_timer);
 		refresh_timer = 0;
 	}
 
-	gdk_window_remove_filter(NULL, x11_on_x11_event, NULL);
+	if (event_source) {
+		g_source_destroy(event_source);
+		g_source_unref(event_source);
+		event_source = NULL;
+	}
 
+#ifdef HAVE_XCB
+	x11_cancel_active_window_request();
+#endif
 	x11_active_window_stop_monitoring();
+	x11_clear_frame_cache();
+	x11_disable_window_tracking();
 
 #ifdef HAVE_XI
 	x11_disable_cursor_tracking();
@@ -1176,5 +5035,187 @@ x11_disable()
 #endif
 	x11_disable_focus_tracking();
 
+#ifdef HAVE_XSHM
+	int i;
+	for (i=0 ; i<n_sessions ; i++) {
+		x11_disable_shm(&x11_sessions[i]);
+	}
+	if (shm_tiles) {
+		tiles_free();
+		shm_tiles = FALSE;
+	}
+#endif
+
 	x11_disable_window();
+	XSync(display, False);
+	return G_SOURCE_REMOVE;
+}
+
+// return FALSE on failure
+gboolean
+x11_enable()
+{
+	gboolean result = FALSE;
+	g_atomic_int_inc(&enable_generation);
+	x11_capture_run(x11_enable_capture, &result);
+	return result;
+}
+
+struct reconfigure_call {
+	struct session* selection;
+	gboolean applied;
+};
+
+// return TRUE if the pixmap of a session must be reallocated (and all its
+// sub-windows recreated) to apply a new selection: when the size of the
+// mirror, the tracked windows or the direct mode change
+gboolean
+x11_must_rebuild_session(const struct x11_session* s, const struct session* next)
+{
+	const struct session* session = s->session;
+	if (	   (session->mirror_width  != next->mirror_width)
+		|| (session->mirror_height != next->mirror_height)
+		|| (session->n_sources != next->n_sources)
+		|| (s->direct != x11_can_use_direct(next)))
+	{
+		return TRUE;
+	}
+	if (s->direct && !is_same_output(session, next, 0)) {
+		// (the canvas is the window of the output)
+		return TRUE;
+	}
+#ifdef WINDOW_PIXMAP
+	if (!is_same_sources(session, next) && x11_has_window_pixmap(session)) {
+		return TRUE;
+	}
+#endif
+	return FALSE;
+}
+
+// apply a new selection to a session (in the capture thread)
+//
+// The selections are swapped ('next' receives the previous one). Only the
+// sub-windows of the outputs that changed are recreated, the pixmap is kept
+// unless x11_must_rebuild_session().
+void
+x11_reconfigure_session(struct x11_session* s, struct session* next)
+{
+	struct session* session = s->session;
+	int i;
+
+	if (x11_must_rebuild_session(s, next)) {
+#ifdef HAVE_XSHM
+		x11_disable_shm(s);
+#endif
+		x11_disable_session_window(s);
+		swap_selection(session, next);
+		x11_enable_session_window(s, session);
+#ifdef HAVE_XSHM
+		x11_enable_shm(s);
+#endif
+		return;
+	}
+
+	for (i=0 ; i<s->n_outputs ; i++) {
+		if (!is_same_output(session, next, i)) {
+			x11_disable_output_window(&s->outputs[i]);
+		}
+	}
+	gboolean same_sources = is_same_sources(session, next);
+	swap_selection(session, next);
+
+	if (!same_sources && (session->n_sources > 1)) {
+		// the sources were moved or resized
+		x11_disable_tiles(s);
+		x11_enable_tiles(s);
+	}
+	for (i=0 ; i<session->n_outputs ; i++)
+	{
+		struct x11_output* o = &s->outputs[i];
+		if (!is_same_output(session, next, i)) {
+			x11_enable_output_window(s, o, &session->outputs[i]);
+		} else if (fullscreen && !gdk_rectangle_equal(&o->rect, &session->outputs[i].rect)) {
+			// the destination was resized or moved
+			x11_set_output_rect(o, &session->outputs[i].rect);
+		}
+	}
+	s->n_outputs = session->n_outputs;
+}
+
+// the monitors were reconfigured and a new selection was made (the damage
+// object, the cursor tracking and the window tracking are kept)
+gboolean
+x11_reconfigure_capture(gpointer data)
+{
+	struct reconfigure_call* call = data;
+	int i, j;
+
+#ifdef HAVE_XSHM
+	// (the tiles are hashed with the size of the mirror)
+	if (shm_tiles && x11_must_rebuild_session(&x11_sessions[0], &call->selection[0])) {
+		call->applied = FALSE;
+		return G_SOURCE_REMOVE;
+	}
+#endif
+	call->applied = TRUE;
+
+	for (i=0 ; i<n_sessions ; i++) {
+		x11_reconfigure_session(&x11_sessions[i], &call->selection[i]);
+	}
+	x11_refresh_cursor_location(TRUE);
+
+	x11_get_window_geometry(root_window, &root_window_rect);
+#if defined(HAVE_XDAMAGE) && defined(HAVE_XRANDR)
+	// (the mode of the destination may have changed)
+	pacing_set_refresh_rate(x11_get_refresh_rate(&sessions[0].outputs[0].rect));
+#endif
+
+	// redraw the whole mirror
+	for (i=0 ; i<n_sessions ; i++) {
+		for (j=0 ; j<sessions[i].n_outputs ; j++) {
+			XClearWindow(display, gdk_x11_window_get_xid(sessions[i].outputs[j].gdkwin));
+		}
+	}
+	x11_refresh_image(&root_window_rect);
+	XFlush(display);
+	return G_SOURCE_REMOVE;
+}
+
+// apply a new selection to the running mirror, the windows of the new
+// destinations must already be created in 'selection' (which receives the
+// previous selection)
+//
+// return FALSE if the mirror must be restarted instead (the selections are
+// not swapped)
+gboolean
+x11_reconfigure(struct session* selection)
+{
+	// (the geometry notified for the windows being replaced is stale)
+	int i, j;
+	for (i=0 ; i<n_sessions ; i++) {
+		for (j=0 ; j<sessions[i].n_outputs ; j++) {
+			if (!is_same_output(&sessions[i], &selection[i], j)) {
+				g_atomic_int_inc(&enable_generation);
+				break;
+			}
+		}
+	}
+
+	struct reconfigure_call call = { selection, FALSE };
+	x11_capture_run(x11_reconfigure_capture, &call);
+	return call.applied;
+}
+
+void
+x11_disable()
+{
+	x11_capture_run(x11_disable_capture, NULL);
+
+	int i, j;
+	for (i=0 ; i<n_sessions ; i++) {
+		for (j=0 ; j<sessions[i].n_outputs ; j++) {
+			struct output* out = &sessions[i].outputs[j];
+			g_signal_handlers_disconnect_by_data(out->gtkwin, out);
+		}
+	}
 }